@@ -30,28 +30,527 @@ SOFTWARE.
 #include "logging.h"
 #include "callbacks.h"
 #include "event_strand.h"
+#include "event_queue_pool.h"
 
 #include <type_traits>
 #include <functional>
 #include <vector>
+#include <iterator>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <limits>
 
 namespace md{
 
+// callbacks called more than once are reported on checked builds only.
+#if !defined(MD_ASYNC_CHECKED) && (defined(_DEBUG) || !defined(NDEBUG))
+#define MD_ASYNC_CHECKED
+#endif
+
+#ifdef MD_THREAD_SAFE
+#define MD_LOCK_ASYNC_DATA(d) std::unique_lock<std::mutex> lock((d)->mutex)
+#define MD_UNLOCK_ASYNC_DATA lock.unlock()
+#else
+#define MD_LOCK_ASYNC_DATA(d)
+#define MD_UNLOCK_ASYNC_DATA
+#endif
 
 class async final
 {
 private:
     async(){}
     
+    // detect a step callback called more than once with a generation
+    // counter stored in the combinator state.
+    class cb_guard_t
+    {
+    public:
+    #ifdef MD_ASYNC_CHECKED
+        typedef uint32_t ticket;
+        
+        cb_guard_t(): _gen(0)
+        {
+        }
+        
+        ticket arm()
+        {
+            return ++_gen;
+        }
+        
+        bool release(ticket t)
+        {
+            if(t != _gen){
+                report();
+                return false;
+            }
+            ++_gen;
+            return true;
+        }
+        
+        // a callback called once its state was released.
+        static void report()
+        {
+            md::log::default_logger()->fatal(MD_ERR(
+                "Callback already called once!"
+            ));
+        }
+        
+    private:
+        ticket _gen;
+    #else
+        class ticket{};
+        
+        ticket arm() { return ticket();}
+        bool release(ticket) { return true;}
+        static void report() {}
+    #endif
+    };
+    
+    // same check for the callbacks running concurrently.
+    class cb_flag_t
+    {
+    public:
+    #ifdef MD_ASYNC_CHECKED
+        cb_flag_t(): _called(std::make_shared<std::atomic<bool>>(false))
+        {
+        }
+        
+        bool release() const
+        {
+            if(_called->exchange(true)){
+                md::log::default_logger()->fatal(MD_ERR(
+                    "Callback already called once!"
+                ));
+                return false;
+            }
+            return true;
+        }
+        
+    private:
+        std::shared_ptr<std::atomic<bool>> _called;
+    #else
+        bool release() const { return true;}
+    #endif
+    };
+    
+    // the step callbacks of the std::tuple series and waterfall hold a
+    // slot of the pipeline and the generation of their step, 16
+    // trivially copyable bytes kept in the std::function small buffer.
+    // the slots are recycled and never freed, a callback called after
+    // the end of its pipeline finds a newer generation instead of a
+    // released state.
+    class step_slot_t
+    {
+    public:
+        static step_slot_t* acquire(void* d)
+        {
+            step_slot_t* slot = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(_pool_mutex());
+                if(!_pool().empty()){
+                    slot = _pool().back();
+                    _pool().pop_back();
+                }
+            }
+            if(!slot)
+                slot = new step_slot_t();
+            slot->_data = d;
+            return slot;
+        }
+        
+        uint64_t arm()
+        {
+            return _gen.fetch_add(1) +1;
+        }
+        
+        /// the state of the pipeline if gen is its current step.
+        void* accept(uint64_t gen)
+        {
+            if(!_gen.compare_exchange_strong(gen, gen +1))
+                return nullptr;
+            return _data;
+        }
+        
+        void release()
+        {
+            ++_gen;
+            _data = nullptr;
+            std::unique_lock<std::mutex> lock(_pool_mutex());
+            _pool().emplace_back(this);
+        }
+        
+    private:
+        step_slot_t(): _gen(0), _data(nullptr)
+        {
+        }
+        
+        static std::mutex& _pool_mutex()
+        {
+            static std::mutex m;
+            return m;
+        }
+        static std::vector<step_slot_t*>& _pool()
+        {
+            static auto* p = new std::vector<step_slot_t*>();
+            return *p;
+        }
+        
+        std::atomic<uint64_t> _gen;
+        void* _data;
+    };
+    
+    class step_data_t
+    {
+    public:
+        step_data_t(): ended(false), cancel_id(0)
+        {
+        }
+        
+        md::callback::cb_error err;
+        cb_guard_t guard;
+        bool ended;
+        uint64_t cancel_id;
+    };
+    
     template<typename T>
     class waterfall_data_t
     {
     public:
+        waterfall_data_t(): data(), ended(false), cancel_id(0)
+        {
+        }
+        
         T data;
         md::callback::cb_error err;
+        cb_guard_t guard;
+        bool ended;
+        uint64_t cancel_id;
     };
     template<typename T>
     using waterfall_data = std::shared_ptr<waterfall_data_t<T>>;
+
+    template<typename Iterator, typename F, typename R>
+    class limit_data_t
+    {
+    public:
+        limit_data_t(
+            std::shared_ptr<event_queue_t> q,
+            Iterator f, Iterator l, size_t lim, F c)
+            : eq(q), it(f), last(l), limit(lim == 0 ? 1 : lim), cb(c),
+            index(0), running(0), done(false), cancel_id(0)
+        {
+        }
+
+        #ifdef MD_THREAD_SAFE
+        std::mutex mutex;
+        #endif
+        std::shared_ptr<event_queue_t> eq;
+        Iterator it;
+        Iterator last;
+        size_t limit;
+        F cb;
+        size_t index;
+        size_t running;
+        bool done;
+        std::vector<R> results;
+        md::callback::value_cb<std::vector<R>> end_cb;
+        md::cancel_token ct;
+        uint64_t cancel_id;
+    };
+    
+    // the loop is a single event task pushing itself back on its owner
+    // after each iteration, the callback given to cb only holds a weak
+    // pointer to it and the guard ticket.
+    class loop_task_t
+        : public event_task_base_t
+    {
+    public:
+        enum class step_state
+        {
+            running = 0,
+            done = 1,
+            pending = 2,
+        };
+        
+        class next_t
+        {
+        public:
+            void operator()(const md::callback::cb_error& err) const
+            {
+                auto sl = lt.lock();
+                if(!sl)
+                    return cb_guard_t::report();
+                sl->next(ticket, err);
+            }
+            std::weak_ptr<loop_task_t> lt;
+            cb_guard_t::ticket ticket;
+        };
+        
+        loop_task_t(
+            std::shared_ptr<event_queue_t> q,
+            md::callback::continue_cb ccb,
+            md::callback::async_series_cb c,
+            md::callback::async_cb ecb,
+            bool check_first, size_t max_sync, md::cancel_token t)
+            : event_task_base_t(q.get()),
+            eq(q), cont_cb(ccb), cb(c), end_cb(ecb), ct(t),
+            _check_first(check_first),
+            _max_sync(max_sync == 0 ? 1 : max_sync),
+            _state(step_state::pending), _done(false)
+        {
+        }
+        
+        bool force_push() const { return true;}
+        event_requeue_pos requeue() const { return event_requeue_pos::none;}
+        size_t size() const { return 1;}
+        
+        void run_task()
+        {
+            auto keep = self;
+            for(size_t n = 0; n < _max_sync; ++n){
+                if(ct && ct->cancelled())
+                    return _end(async::_cancelled_error());
+                if(_check_first && !cont_cb())
+                    return _end(nullptr);
+                
+                _state = step_state::running;
+                cb(md::callback::async_cb(next_t{self, _guard.arm()}));
+                
+                // next will rearm the task once cb completes.
+                if(_state.exchange(step_state::pending) != step_state::done)
+                    return;
+                if(_done)
+                    return;
+            }
+            rearm();
+        }
+        
+        void next(cb_guard_t::ticket ticket, const md::callback::cb_error& err)
+        {
+            if(!_guard.release(ticket))
+                return;
+            
+            auto keep = self;
+            if(err)
+                _end(err);
+            else if(ct && ct->cancelled())
+                _end(async::_cancelled_error());
+            else if(!_check_first && !cont_cb())
+                _end(nullptr);
+            
+            // still in run_task, let it run the next iteration.
+            if(_state.exchange(step_state::done) == step_state::running)
+                return;
+            if(!_done)
+                rearm();
+        }
+        
+        void rearm()
+        {
+            eq->push_back(std::static_pointer_cast<event_task_base_t>(self));
+        }
+        
+        std::shared_ptr<event_queue_t> eq;
+        md::callback::continue_cb cont_cb;
+        md::callback::async_series_cb cb;
+        md::callback::async_cb end_cb;
+        md::cancel_token ct;
+        std::shared_ptr<loop_task_t> self;
+        
+    private:
+        void _end(const md::callback::cb_error& err)
+        {
+            _done = true;
+            auto lt = std::move(self);
+            eq->push_back([lt, err]() -> void {
+                lt->end_cb(err);
+            });
+        }
+        
+        bool _check_first;
+        size_t _max_sync;
+        std::atomic<step_state> _state;
+        bool _done;
+        cb_guard_t _guard;
+    };
+    
+    template<typename T>
+    class race_data_t
+    {
+    public:
+        race_data_t(md::callback::value_cb<T> e)
+            : done(false), end_cb(e), cancel_id(0)
+        {
+        }
+        
+        #ifdef MD_THREAD_SAFE
+        std::mutex mutex;
+        #endif
+        bool done;
+        std::vector<uint64_t> ids;
+        md::callback::value_cb<T> end_cb;
+        md::cancel_token ct;
+        uint64_t cancel_id;
+    };
+    
+    template<typename T>
+    class retry_data_t
+    {
+    public:
+        retry_data_t(
+            std::shared_ptr<event_queue_t> q, size_t t, uint32_t b,
+            md::callback::async_task_cb<T> tsk, md::callback::value_cb<T> e)
+            : eq(q), times(t == 0 ? 1 : t), backoff_ms(b), attempt(0),
+            task(tsk), end_cb(e), done(false), cancel_id(0)
+        {
+        }
+        
+        std::shared_ptr<event_queue_t> eq;
+        size_t times;
+        uint32_t backoff_ms;
+        size_t attempt;
+        md::callback::async_task_cb<T> task;
+        md::callback::value_cb<T> end_cb;
+        std::atomic<bool> done;
+        md::cancel_token ct;
+        uint64_t cancel_id;
+    };
+    
+    // series over a std::tuple of steps, the steps, the state and the
+    // continuation all live in one allocation, the callback given to
+    // the steps only hold its slot and the step generation and fits in
+    // the std::function small buffer.
+    template<typename... Steps>
+    class series_steps_t
+    {
+    public:
+        static constexpr size_t size = sizeof...(Steps);
+        
+        series_steps_t(
+            std::tuple<Steps...> s, md::callback::async_cb e,
+            md::cancel_token t)
+            : steps(std::move(s)), end_cb(e), ct(t), step(0), slot(nullptr)
+        {
+        }
+        
+        class next_t
+        {
+        public:
+            void operator()(const md::callback::cb_error& err) const
+            {
+                auto d = async::_static_accept<series_steps_t>(slot, gen);
+                if(d)
+                    async::_static_next(d, err);
+            }
+            step_slot_t* slot;
+            uint64_t gen;
+        };
+        
+        template<size_t I>
+        static void call(series_steps_t* d)
+        {
+            std::get<I>(d->steps)(
+                md::callback::async_cb(next_t{d->slot, d->slot->arm()})
+            );
+        }
+        
+        void end(const md::callback::cb_error& err)
+        {
+            end_cb(err);
+        }
+        
+        std::tuple<Steps...> steps;
+        md::callback::async_cb end_cb;
+        md::cancel_token ct;
+        size_t step;
+        step_slot_t* slot;
+        std::shared_ptr<series_steps_t> self;
+    };
+    
+    template<typename T, typename... Steps>
+    class waterfall_steps_t
+    {
+    public:
+        static constexpr size_t size = sizeof...(Steps);
+        
+        waterfall_steps_t(
+            std::tuple<Steps...> s, md::callback::value_cb<T> e,
+            md::cancel_token t)
+            : steps(std::move(s)), end_cb(e), ct(t), step(0), slot(nullptr),
+            data()
+        {
+        }
+        
+        class next_t
+        {
+        public:
+            void operator()(const md::callback::cb_error& err, T val) const
+            {
+                auto d = async::_static_accept<waterfall_steps_t>(slot, gen);
+                if(!d)
+                    return;
+                if(!err)
+                    d->data = std::move(val);
+                async::_static_next(d, err);
+            }
+            step_slot_t* slot;
+            uint64_t gen;
+        };
+        
+        template<size_t I>
+        static void call(waterfall_steps_t* d)
+        {
+            std::get<I>(d->steps)(
+                d->data,
+                md::callback::value_cb<T>(next_t{d->slot, d->slot->arm()})
+            );
+        }
+        
+        void end(const md::callback::cb_error& err)
+        {
+            end_cb(err, data);
+        }
+        
+        std::tuple<Steps...> steps;
+        md::callback::value_cb<T> end_cb;
+        md::cancel_token ct;
+        size_t step;
+        step_slot_t* slot;
+        T data;
+        std::shared_ptr<waterfall_steps_t> self;
+    };
+    
+#ifdef MD_THREAD_SAFE
+    template<typename R>
+    class parallel_data_t
+    {
+    public:
+        parallel_data_t(
+            std::shared_ptr<event_queue_t> q,
+            size_t f, size_t l, size_t g, size_t workers, R i)
+            : eq(q), next(f), last(l), grain(g == 0 ? 1 : g),
+            chunk_div(workers * 2), pending(workers), failed(false),
+            init(i), value(i), has_value(false)
+        {
+        }
+        
+        std::mutex mutex;
+        std::shared_ptr<event_queue_t> eq;
+        std::atomic<size_t> next;
+        size_t last;
+        size_t grain;
+        size_t chunk_div;
+        std::atomic<size_t> pending;
+        std::atomic<bool> failed;
+        md::callback::cb_error err;
+        R init;
+        R value;
+        bool has_value;
+        md::callback::value_cb<R> end_cb;
+        md::cancel_token ct;
+    };
+#endif //MD_THREAD_SAFE
     
 public:
     
@@ -111,11 +610,12 @@ public:
         std::shared_ptr<event_queue_t> eq,
         Iterator first, Iterator last,
         T cb,
-        md::callback::async_cb end_cb)
+        md::callback::async_cb end_cb,
+        md::cancel_token ct = nullptr)
     {
         typedef typename std::iterator_traits<Iterator>::value_type U;
         md::callback::async_item_cb<U> aicb = cb;
-        md::async::each<Iterator,U>(eq, first, last, aicb, end_cb);
+        md::async::each<Iterator,U>(eq, first, last, aicb, end_cb, ct);
     }
 
     
@@ -127,7 +627,8 @@ public:
         std::shared_ptr<event_queue_t> eq,
         Iterator first, Iterator last,
         md::callback::async_item_cb<T> cb,
-        md::callback::async_cb end_cb)
+        md::callback::async_cb end_cb,
+        md::cancel_token ct = nullptr)
     {
         std::vector<T> v;
         auto it = first;
@@ -135,7 +636,7 @@ public:
             v.emplace_back(*it);
             ++it;
         }
-        each(eq, v, cb, end_cb);
+        each(eq, v, cb, end_cb, ct);
     }
     
     
@@ -149,32 +650,36 @@ public:
         each<T>(eq, v, cb, end_cb);
     }
     
+    /*!
+     * call cb on the items one after the other, once ct is cancelled the
+     * items left are dropped and end_cb receive a cancelled cb_error.
+     */
     template<typename T>
     static void each(
         std::shared_ptr<event_queue_t> eq,
         std::vector<T> v,
         md::callback::async_item_cb<T> cb,
-        md::callback::async_cb end_cb)
+        md::callback::async_cb end_cb,
+        md::cancel_token ct = nullptr)
     {
-        auto strand = eq->new_strand<md::callback::cb_error>(false);
+        auto strand = eq->new_strand<step_data_t>(false);
         for(auto i = 0U; i < v.size(); ++i){
             strand->push_back([strand, cb, it = v[i]]() -> void {
-                if(strand->data()){
+                if(strand->data().err){
                     strand->requeue_self_back();
                     strand->activate();
                     return;
                 }
                 
-                auto cb_called = std::make_shared<bool>(false);
-                cb(it, (md::callback::async_cb)[strand, cb_called]
+                auto ticket = strand->data().guard.arm();
+                cb(it, (md::callback::async_cb)[strand, ticket]
                 (const md::callback::cb_error& err) -> void {
-                    if(*cb_called)
-                        md::log::default_logger()->fatal(MD_ERR(
-                            "Callback already called once!"
-                        ));
-                    *cb_called = true;
+                    if(!strand->data().guard.release(ticket))
+                        return;
+                    if(strand->data().ended)
+                        return;
                     if(err){
-                        strand->data(err);
+                        strand->data().err = err;
                         strand->requeue_self_last_front();
                         strand->activate();
                         return;
@@ -183,15 +688,459 @@ public:
                     strand->requeue_self_back();
                     strand->activate();
                 });
-            });
+            }, ct);
         }
-        strand->push_back([strand, end_cb]() -> void {
-            end_cb(strand->data());
+        strand->push_back([strand, end_cb, ct]() -> void {
+            if(!_strand_end(strand->data(), ct))
+                return;
+            end_cb(strand->data().err);
+        }, ct);
+        _strand_on_cancel(eq, strand, strand->data(), ct,
+        [strand, end_cb]() -> void {
+            end_cb(strand->data().err);
         });
         strand->requeue_self_back();
         strand->activate();
     }
     
+    template<typename Iterator, typename T>
+    static void each_limit(
+        Iterator first, Iterator last, size_t limit,
+        T cb,
+        md::callback::async_cb end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        each_limit(eq, first, last, limit, cb, end_cb);
+    }
+
+    /*!
+     * run cb on every item of [first, last) keeping up to 'limit' items
+     * in flight, end_cb is called once with the first error or when all
+     * the items are completed.
+     *
+     * the items are not copied, the range must outlive the operation.
+     * cancelling ct removes the queued items and ends with a cancelled
+     * cb_error without waiting for the ones in flight.
+     *
+     *	example:
+     *      md::async::each_limit(eq, v.begin(), v.end(), 16,
+     *      [&](const std::string& host, md::callback::async_cb icb){
+     *          ping(host, icb);
+     *      }, [&](const md::callback::cb_error& err) -> void {
+     *          ...
+     *      });
+     */
+    template<typename Iterator, typename T>
+    static void each_limit(
+        std::shared_ptr<event_queue_t> eq,
+        Iterator first, Iterator last, size_t limit,
+        T cb,
+        md::callback::async_cb end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        auto st = std::make_shared<limit_data_t<Iterator, T, std::nullptr_t>>(
+            eq, first, last, limit, cb
+        );
+        st->end_cb = [end_cb](
+            const md::callback::cb_error& err, std::vector<std::nullptr_t>
+        ) -> void {
+            end_cb(err);
+        };
+        _limit_on_cancel(st, ct);
+        for(size_t i = 0; i < st->limit; ++i)
+            _limit_next(st);
+    }
+
+    template<typename R, typename Iterator, typename T>
+    static void map_limit(
+        Iterator first, Iterator last, size_t limit,
+        T cb,
+        md::callback::value_cb<std::vector<R>> end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        map_limit<R>(eq, first, last, limit, cb, end_cb);
+    }
+
+    /*!
+     * same as each_limit but cb returns a value, the values are collected
+     * in input order and passed to end_cb.
+     *
+     *	example:
+     *      md::async::map_limit<size_t>(eq, v.begin(), v.end(), 16,
+     *      [&](const std::string& key, md::callback::value_cb<size_t> icb){
+     *          fetch_size(key, icb);
+     *      }, [&](const md::callback::cb_error& err, std::vector<size_t> r){
+     *          ...
+     *      });
+     */
+    template<typename R, typename Iterator, typename T>
+    static void map_limit(
+        std::shared_ptr<event_queue_t> eq,
+        Iterator first, Iterator last, size_t limit,
+        T cb,
+        md::callback::value_cb<std::vector<R>> end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        auto st = std::make_shared<limit_data_t<Iterator, T, R>>(
+            eq, first, last, limit, cb
+        );
+        st->results.resize(std::distance(first, last));
+        st->end_cb = end_cb;
+        _limit_on_cancel(st, ct);
+        for(size_t i = 0; i < st->limit; ++i)
+            _limit_next(st);
+    }
+    
+#ifdef MD_THREAD_SAFE
+    template<typename T>
+    static void parallel_for(
+        size_t first, size_t last,
+        T fn,
+        md::callback::async_cb end_cb,
+        size_t grain = 1)
+    {
+        parallel_for(
+            md::event_queue_t::get_default(),
+            md::event_queue_pool_t::get_default(),
+            first, last, fn, end_cb, grain
+        );
+    }
+    
+    /*!
+     * call fn(idx) for every idx of [first, last) on the pool workers,
+     * end_cb is called on eq once every chunk is done or with the first
+     * exception thrown by fn, the remaining chunks are then skipped.
+     * 
+     * the chunks are claimed by the workers as they go, their size
+     * decrease with the remaining work and never goes below grain.
+     * the workers stop claiming chunks once ct is cancelled.
+     * 
+     *	example:
+     *      md::async::parallel_for(eq, pool, 0, v.size(),
+     *      [&](size_t i){
+     *          v[i] = compute(i);
+     *      }, [&](const md::callback::cb_error& err) -> void {
+     *          ...
+     *      });
+     */
+    template<typename T>
+    static void parallel_for(
+        std::shared_ptr<event_queue_t> eq,
+        std::shared_ptr<event_queue_pool_t> pool,
+        size_t first, size_t last,
+        T fn,
+        md::callback::async_cb end_cb,
+        size_t grain = 1,
+        md::cancel_token ct = nullptr)
+    {
+        _parallel_run<std::nullptr_t>(
+            eq, pool, first, last, grain, ct, nullptr,
+            [fn](std::nullptr_t&, size_t b, size_t e) -> void {
+                for(size_t i = b; i < e; ++i)
+                    fn(i);
+            },
+            [](std::nullptr_t, std::nullptr_t) -> std::nullptr_t {
+                return nullptr;
+            },
+            [end_cb](const md::callback::cb_error& err, std::nullptr_t){
+                end_cb(err);
+            }
+        );
+    }
+    
+    template<typename R, typename T, typename J>
+    static void parallel_reduce(
+        size_t first, size_t last,
+        R init, T fn, J join,
+        md::callback::value_cb<R> end_cb,
+        size_t grain = 1)
+    {
+        parallel_reduce<R>(
+            md::event_queue_t::get_default(),
+            md::event_queue_pool_t::get_default(),
+            first, last, init, fn, join, end_cb, grain
+        );
+    }
+    
+    /*!
+     * each worker accumulate fn(acc, idx) in a local acc starting at init,
+     * the partial results are then combined with join(a, b) and passed to
+     * end_cb on eq. init must be the identity value of join.
+     * 
+     *	example:
+     *      md::async::parallel_reduce<uint64_t>(eq, pool, 0, v.size(), 0,
+     *      [&](uint64_t& acc, size_t i){
+     *          acc += v[i];
+     *      }, [](uint64_t a, uint64_t b){
+     *          return a + b;
+     *      }, [&](const md::callback::cb_error& err, uint64_t sum){
+     *          ...
+     *      });
+     */
+    template<typename R, typename T, typename J>
+    static void parallel_reduce(
+        std::shared_ptr<event_queue_t> eq,
+        std::shared_ptr<event_queue_pool_t> pool,
+        size_t first, size_t last,
+        R init, T fn, J join,
+        md::callback::value_cb<R> end_cb,
+        size_t grain = 1,
+        md::cancel_token ct = nullptr)
+    {
+        _parallel_run<R>(
+            eq, pool, first, last, grain, ct, init,
+            [fn](R& acc, size_t b, size_t e) -> void {
+                for(size_t i = b; i < e; ++i)
+                    fn(acc, i);
+            },
+            join, end_cb
+        );
+    }
+#endif //MD_THREAD_SAFE
+    
+    static void parallel(
+        std::vector< md::callback::async_series_cb > tasks,
+        md::callback::async_cb end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        parallel(eq, std::move(tasks), end_cb);
+    }
+    
+    /*!
+     * start all the tasks on eq without waiting for the previous ones,
+     * end_cb is called with the first error or once they all completed.
+     */
+    static void parallel(
+        std::shared_ptr<event_queue_t> eq,
+        std::vector< md::callback::async_series_cb > tasks,
+        md::callback::async_cb end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        auto tv = std::make_shared<std::vector<md::callback::async_series_cb>>(
+            std::move(tasks)
+        );
+        each_limit(eq, tv->begin(), tv->end(), tv->size(),
+        [](const md::callback::async_series_cb& t,
+            md::callback::async_cb cb) -> void {
+            t(cb);
+        }, [tv, end_cb](const md::callback::cb_error& err) -> void {
+            end_cb(err);
+        }, ct);
+    }
+    
+    template<typename T>
+    static void parallel(
+        std::vector< md::callback::async_task_cb<T> > tasks,
+        md::callback::value_cb<std::vector<T>> end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        parallel<T>(eq, std::move(tasks), end_cb);
+    }
+    
+    /*!
+     * same as parallel, the results are stored in a preallocated vector
+     * in the tasks order.
+     * 
+     *	example:
+     *      md::async::parallel<std::string>(eq, {
+     *          [&](md::callback::value_cb<std::string> tcb) -> void {
+     *              get_user(id, tcb);
+     *          },
+     *          [&](md::callback::value_cb<std::string> tcb) -> void {
+     *              get_group(id, tcb);
+     *          }
+     *      }, [&](const md::callback::cb_error& err,
+     *          std::vector<std::string> res) -> void {
+     *          ...
+     *      });
+     */
+    template<typename T>
+    static void parallel(
+        std::shared_ptr<event_queue_t> eq,
+        std::vector< md::callback::async_task_cb<T> > tasks,
+        md::callback::value_cb<std::vector<T>> end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        auto tv = std::make_shared<std::vector<md::callback::async_task_cb<T>>>(
+            std::move(tasks)
+        );
+        map_limit<T>(eq, tv->begin(), tv->end(), tv->size(),
+        [](const md::callback::async_task_cb<T>& t,
+            md::callback::value_cb<T> cb) -> void {
+            t(cb);
+        }, [tv, end_cb](
+            const md::callback::cb_error& err, std::vector<T> res
+        ) -> void {
+            end_cb(err, std::move(res));
+        }, ct);
+    }
+    
+    template<typename T>
+    static void race(
+        std::vector< md::callback::async_task_cb<T> > tasks,
+        md::callback::value_cb<T> end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        race<T>(eq, std::move(tasks), end_cb);
+    }
+    
+    /*!
+     * start all the tasks on eq, the first one to complete, with or
+     * without error, is passed to end_cb. the tasks still waiting in
+     * the queue are cancelled and the later results are ignored.
+     */
+    template<typename T>
+    static void race(
+        std::shared_ptr<event_queue_t> eq,
+        std::vector< md::callback::async_task_cb<T> > tasks,
+        md::callback::value_cb<T> end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        if(tasks.size() == 0){
+            eq->push_back(std::bind(end_cb, nullptr, T()));
+            return;
+        }
+        
+        if(ct && ct->cancelled()){
+            eq->push_back(std::bind(end_cb, _cancelled_error(), T()));
+            return;
+        }
+        
+        auto st = std::make_shared<race_data_t<T>>(end_cb);
+        st->ids.reserve(tasks.size());
+        st->ct = ct;
+        
+        MD_LOCK_ASYNC_DATA(st);
+        for(auto& t : tasks)
+            st->ids.emplace_back(eq->push_back([eq, st, t]() -> void {
+                {
+                    MD_LOCK_ASYNC_DATA(st);
+                    if(st->done)
+                        return;
+                }
+                
+                cb_flag_t flag;
+                t([eq, st, flag](
+                    const md::callback::cb_error& err, T val
+                ) -> void {
+                    if(!flag.release())
+                        return;
+                    
+                    MD_LOCK_ASYNC_DATA(st);
+                    if(st->done)
+                        return;
+                    st->done = true;
+                    uint64_t cancel_id = st->cancel_id;
+                    MD_UNLOCK_ASYNC_DATA;
+                    
+                    for(auto id : st->ids)
+                        eq->cancel_task(id);
+                    if(st->ct)
+                        st->ct->remove_handler(cancel_id);
+                    st->end_cb(err, std::move(val));
+                });
+            }, ct));
+        MD_UNLOCK_ASYNC_DATA;
+        
+        if(!ct)
+            return;
+        
+        // on_cancel calls the handler right away if ct was cancelled in
+        // the meantime, the handler locks st so st is not locked here.
+        uint64_t cancel_id = ct->on_cancel([eq, st]() -> void {
+            MD_LOCK_ASYNC_DATA(st);
+            if(st->done)
+                return;
+            st->done = true;
+            MD_UNLOCK_ASYNC_DATA;
+            
+            eq->cancel_tasks(st->ct);
+            eq->push_back([st]() -> void {
+                st->end_cb(_cancelled_error(), T());
+            });
+        });
+        
+        bool done;
+        {
+            MD_LOCK_ASYNC_DATA(st);
+            st->cancel_id = cancel_id;
+            done = st->done;
+        }
+        if(done)
+            ct->remove_handler(cancel_id);
+    }
+    
+    static void retry(
+        size_t times, uint32_t backoff_ms,
+        md::callback::async_series_cb task,
+        md::callback::async_cb end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        retry(eq, times, backoff_ms, task, end_cb);
+    }
+    
+    /*!
+     * run task up to 'times' times until it succeeds, the delay between
+     * the attempts starts at backoff_ms and doubles after every failure.
+     * end_cb receive the last error if all the attempts failed, or a
+     * cancelled cb_error right away when ct is cancelled.
+     */
+    static void retry(
+        std::shared_ptr<event_queue_t> eq,
+        size_t times, uint32_t backoff_ms,
+        md::callback::async_series_cb task,
+        md::callback::async_cb end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        retry<std::nullptr_t>(eq, times, backoff_ms,
+        [task](md::callback::value_cb<std::nullptr_t> cb) -> void {
+            task([cb](const md::callback::cb_error& err) -> void {
+                cb(err, nullptr);
+            });
+        }, [end_cb](const md::callback::cb_error& err, std::nullptr_t){
+            end_cb(err);
+        }, ct);
+    }
+    
+    template<typename T>
+    static void retry(
+        size_t times, uint32_t backoff_ms,
+        md::callback::async_task_cb<T> task,
+        md::callback::value_cb<T> end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        retry<T>(eq, times, backoff_ms, task, end_cb);
+    }
+    
+    template<typename T>
+    static void retry(
+        std::shared_ptr<event_queue_t> eq,
+        size_t times, uint32_t backoff_ms,
+        md::callback::async_task_cb<T> task,
+        md::callback::value_cb<T> end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        if(ct && ct->cancelled()){
+            eq->push_back(std::bind(end_cb, _cancelled_error(), T()));
+            return;
+        }
+        
+        auto st = std::make_shared<retry_data_t<T>>(
+            eq, times, backoff_ms, task, end_cb
+        );
+        st->ct = ct;
+        if(ct)
+            st->cancel_id = ct->on_cancel([st]() -> void {
+                if(st->done.exchange(true))
+                    return;
+                st->eq->push_back([st]() -> void {
+                    st->end_cb(_cancelled_error(), T());
+                });
+            });
+        eq->push_back([st]() -> void {
+            _retry_attempt(st);
+        }, ct);
+    }
     
     static void series(
         std::vector< md::callback::async_series_cb > cbs,
@@ -214,37 +1163,40 @@ public:
      *          if(err)
      *              return cb(err, cfg);
      *          cb(nullptr, cfg);
-     *      });
+     *      }, ct);
+     * 
+     * ct is optional, when cancelled the steps left are dropped and
+     * end_cb is called with a cancelled cb_error.
      */
     static void series(
         std::shared_ptr<event_queue_t> eq,
         std::vector< md::callback::async_series_cb > cbs,
-        md::callback::async_cb end_cb)
+        md::callback::async_cb end_cb,
+        md::cancel_token ct = nullptr)
     {
         if(cbs.size() == 0){
             eq->push_back(std::bind(end_cb, nullptr));
             return;
         }
         
-        auto strand = eq->new_strand<md::callback::cb_error>(false);
+        auto strand = eq->new_strand<step_data_t>(false);
         for(auto i = 0U; i < cbs.size(); ++i){
             strand->push_back([strand, cb = cbs[i]]() -> void {
-                if(strand->data()){
+                if(strand->data().err){
                     strand->requeue_self_back();
                     strand->activate();
                     return;
                 }
                 
-                auto cb_called = std::make_shared<bool>(false);
-                cb((md::callback::async_cb)[strand, cb_called]
+                auto ticket = strand->data().guard.arm();
+                cb((md::callback::async_cb)[strand, ticket]
                 (const md::callback::cb_error& err) -> void {
-                    if(*cb_called)
-                        md::log::default_logger()->fatal(MD_ERR(
-                            "Callback already called once!"
-                        ));
-                    *cb_called = true;
+                    if(!strand->data().guard.release(ticket))
+                        return;
+                    if(strand->data().ended)
+                        return;
                     if(err){
-                        strand->data(err);
+                        strand->data().err = err;
                         strand->requeue_self_last_front();
                         strand->activate();
                         return;
@@ -253,16 +1205,71 @@ public:
                     strand->requeue_self_back();
                     strand->activate();
                 });
-            });
+            }, ct);
         }
         
-        strand->push_back([strand, end_cb]() -> void {
-            end_cb(strand->data());
+        strand->push_back([strand, end_cb, ct]() -> void {
+            if(!_strand_end(strand->data(), ct))
+                return;
+            end_cb(strand->data().err);
+        }, ct);
+        _strand_on_cancel(eq, strand, strand->data(), ct,
+        [strand, end_cb]() -> void {
+            end_cb(strand->data().err);
         });
         strand->requeue_self_back();
         strand->activate();
     }
     
+    template<typename... Steps>
+    static void series(
+        std::tuple<Steps...> steps,
+        md::callback::async_cb end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        series(eq, std::move(steps), end_cb);
+    }
+    
+    /*!
+     * series built at compile time, the whole pipeline is stored in a
+     * single allocation and no std::function is created for the steps.
+     * a step completing synchronously directly runs the next one.
+     * ct is checked between the steps.
+     * 
+     *	example: 
+     *      md::async::series(eq, std::make_tuple(
+     *          [&](md::callback::async_cb scb) -> void {
+     *              return scb(nullptr);
+     *          },
+     *          [&](md::callback::async_cb scb) -> void {
+     *              return scb(nullptr);
+     *          }
+     *      ), [&](const md::callback::cb_error& err) -> void {
+     *          ...
+     *      });
+     */
+    template<typename... Steps>
+    static void series(
+        std::shared_ptr<event_queue_t> eq,
+        std::tuple<Steps...> steps,
+        md::callback::async_cb end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        if(sizeof...(Steps) == 0){
+            eq->push_back(std::bind(end_cb, nullptr));
+            return;
+        }
+        
+        auto d = std::make_shared<series_steps_t<Steps...>>(
+            std::move(steps), end_cb, ct
+        );
+        d->self = d;
+        d->slot = step_slot_t::acquire(d.get());
+        eq->push_back([sd = d.get()]() -> void {
+            _static_run(sd, 0);
+        });
+    }
+    
     template<typename T>
     static void waterfall(
         std::vector< md::callback::async_waterfall_cb<T> > cbs,
@@ -276,7 +1283,8 @@ public:
     static void waterfall(
         std::shared_ptr<event_queue_t> eq,
         std::vector< md::callback::async_waterfall_cb<T> > cbs,
-        md::callback::value_cb<T> end_cb)
+        md::callback::value_cb<T> end_cb,
+        md::cancel_token ct = nullptr)
     {
         auto sdata = std::make_shared<waterfall_data_t<T>>();
         if(cbs.size() == 0){
@@ -295,18 +1303,17 @@ public:
                     return;
                 }
                 
-                auto cb_called = std::make_shared<bool>(false);
+                auto ticket = strand->data()->guard.arm();
                 cb(
                     strand->data()->data,
                     
                     //(md::callback::value_cb<T>)
-                    [strand, cb_called]
+                    [strand, ticket]
                     (const md::callback::cb_error& err, T new_data) -> void {
-                        if(*cb_called)
-                            md::log::default_logger()->fatal(MD_ERR(
-                                "Callback already called once!"
-                            ));
-                        *cb_called = true;
+                        if(!strand->data()->guard.release(ticket))
+                            return;
+                        if(strand->data()->ended)
+                            return;
                         if(err){
                             strand->data()->err = err;
                             strand->requeue_self_last_front();
@@ -319,149 +1326,449 @@ public:
                         strand->activate();
                     }
                 );
-            });
+            }, ct);
         }
-        strand->push_back([strand, end_cb]() -> void {
+        strand->push_back([strand, end_cb, ct]() -> void {
+            if(!_strand_end(*strand->data(), ct))
+                return;
+            end_cb(strand->data()->err, strand->data()->data);
+        }, ct);
+        _strand_on_cancel(eq, strand, *sdata, ct,
+        [strand, end_cb]() -> void {
             end_cb(strand->data()->err, strand->data()->data);
         });
         strand->requeue_self_back();
         strand->activate();
     }
     
+    template<typename T, typename... Steps>
+    static void waterfall(
+        std::tuple<Steps...> steps,
+        md::callback::value_cb<T> end_cb)
+    {
+        std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
+        waterfall<T>(eq, std::move(steps), end_cb);
+    }
+    
+    /*!
+     * waterfall built at compile time, see the std::tuple series.
+     * 
+     *	example: 
+     *      md::async::waterfall<int>(eq, std::make_tuple(
+     *          [&](int& val, md::callback::value_cb<int> wcb) -> void {
+     *              return wcb(nullptr, val +1);
+     *          },
+     *          [&](int& val, md::callback::value_cb<int> wcb) -> void {
+     *              return wcb(nullptr, val * 2);
+     *          }
+     *      ), [&](const md::callback::cb_error& err, int val) -> void {
+     *          ...
+     *      });
+     */
+    template<typename T, typename... Steps>
+    static void waterfall(
+        std::shared_ptr<event_queue_t> eq,
+        std::tuple<Steps...> steps,
+        md::callback::value_cb<T> end_cb,
+        md::cancel_token ct = nullptr)
+    {
+        if(sizeof...(Steps) == 0){
+            eq->push_back(std::bind(end_cb, nullptr, T()));
+            return;
+        }
+        
+        auto d = std::make_shared<waterfall_steps_t<T, Steps...>>(
+            std::move(steps), end_cb, ct
+        );
+        d->self = d;
+        d->slot = step_slot_t::acquire(d.get());
+        eq->push_back([sd = d.get()]() -> void {
+            _static_run(sd, 0);
+        });
+    }
+    
     static void loop(
         md::callback::continue_cb cont_cb,
         md::callback::async_series_cb cb,
-        md::callback::async_cb end_cb)
+        md::callback::async_cb end_cb,
+        size_t max_sync = 1)
     {
         std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
-        loop(eq, cont_cb, cb, end_cb);
+        loop(eq, cont_cb, cb, end_cb, max_sync);
     }
     
+    /*!
+     * call cb while cont_cb returns true, cont_cb is checked before
+     * every iteration.
+     * 
+     * the loop is a single task requeued after every iteration, up to
+     * max_sync iterations completing synchronously are run before
+     * yielding to the other tasks of the queue. ct is checked before
+     * and after every iteration.
+     */
     static void loop(
         std::shared_ptr<event_queue_t> eq,
         md::callback::continue_cb cont_cb,
         md::callback::async_series_cb cb,
-        md::callback::async_cb end_cb)
+        md::callback::async_cb end_cb,
+        size_t max_sync = 1,
+        md::cancel_token ct = nullptr)
     {
-        auto strand = eq->new_strand<md::callback::cb_error>(false);
-        if(!cont_cb)
-            cont_cb = []()->bool{ return true;};
-        if(!end_cb)
-            end_cb = [](const md::callback::cb_error&){};
-        _call_loop(strand, cont_cb, cb, end_cb);
+        _start_loop(eq, cont_cb, cb, end_cb, true, max_sync, ct);
     }
     
     static void loop(
         md::callback::async_series_cb cb,
         md::callback::continue_cb cont_cb,
-        md::callback::async_cb end_cb)
+        md::callback::async_cb end_cb,
+        size_t max_sync = 1)
     {
         std::shared_ptr<event_queue_t> eq = md::event_queue_t::get_default();
-        loop(eq, cb, cont_cb, end_cb);
+        loop(eq, cb, cont_cb, end_cb, max_sync);
     }
     
+    /*!
+     * same as the other loop but cont_cb is checked after every
+     * iteration, cb is called at least once.
+     */
     static void loop(
         std::shared_ptr<event_queue_t> eq,
         md::callback::async_series_cb cb,
         md::callback::continue_cb cont_cb,
-        md::callback::async_cb end_cb)
+        md::callback::async_cb end_cb,
+        size_t max_sync = 1,
+        md::cancel_token ct = nullptr)
     {
-        auto strand = eq->new_strand<md::callback::cb_error>(false);
-        if(!cont_cb)
-            cont_cb = []()->bool{ return true;};
-        if(!end_cb)
-            end_cb = [](const md::callback::cb_error&){};
-        _call_loop(strand, cb, cont_cb, end_cb);
+        _start_loop(eq, cont_cb, cb, end_cb, false, max_sync, ct);
     }
     
 private:
-    static void _call_loop(
-        md::event_strand<md::callback::cb_error> strand,
-        md::callback::continue_cb cont_cb,
-        md::callback::async_series_cb cb,
-        md::callback::async_cb end_cb)
+    template<typename Iterator, typename T, typename R>
+    static void _limit_next(std::shared_ptr<limit_data_t<Iterator, T, R>> st)
     {
-        strand->push_back(
-        [strand, cont_cb, cb, end_cb](){
-            if(!cont_cb()){
-                strand->push_back([strand, end_cb]() -> void {
-                    end_cb(nullptr);
-                });
-                strand->requeue_self_last_front();
-                strand->activate();
+        MD_LOCK_ASYNC_DATA(st);
+        if(st->done)
+            return;
+        
+        if(st->it == st->last){
+            if(st->running > 0)
                 return;
-            }
+            st->done = true;
+            MD_UNLOCK_ASYNC_DATA;
+            if(st->ct)
+                st->ct->remove_handler(st->cancel_id);
+            st->eq->push_back([st]() -> void {
+                st->end_cb(nullptr, std::move(st->results));
+            });
+            return;
+        }
+        
+        Iterator it = st->it;
+        ++st->it;
+        size_t idx = st->index++;
+        ++st->running;
+        MD_UNLOCK_ASYNC_DATA;
+        
+        st->eq->push_back([st, it, idx]() -> void {
+            _limit_run(st, it, idx);
+        }, st->ct);
+    }
+    
+    template<typename Iterator, typename T, typename R>
+    static void _limit_on_cancel(
+        const std::shared_ptr<limit_data_t<Iterator, T, R>>& st,
+        md::cancel_token ct)
+    {
+        if(!ct)
+            return;
+        
+        st->ct = ct;
+        st->cancel_id = ct->on_cancel([st]() -> void {
+            MD_LOCK_ASYNC_DATA(st);
+            if(st->done)
+                return;
+            st->done = true;
+            MD_UNLOCK_ASYNC_DATA;
             
-            auto cb_called = std::make_shared<bool>(false);
-            cb((md::callback::async_cb)
-            [strand, cont_cb, cb, end_cb, cb_called]
-            (const md::callback::cb_error& err) -> void {
-                if(*cb_called)
-                    md::log::default_logger()->fatal(MD_ERR(
-                        "Callback already called once!"
-                    ));
-                *cb_called = true;
-                if(err){
-                    strand->push_back([strand, end_cb]() -> void {
-                        end_cb(strand->data());
-                    });
-                    
-                    strand->data(err);
-                    strand->requeue_self_last_front();
-                    strand->activate();
-                    return;
-                }
-                
-                _call_loop(strand, cont_cb, cb, end_cb);
+            st->eq->cancel_tasks(st->ct);
+            st->eq->push_back([st]() -> void {
+                st->end_cb(_cancelled_error(), std::vector<R>());
             });
         });
-        strand->requeue_self_back();
-        strand->activate();
     }
     
-    static void _call_loop(
-        md::event_strand<md::callback::cb_error> strand,
-        md::callback::async_series_cb cb,
-        md::callback::continue_cb cont_cb,
-        md::callback::async_cb end_cb)
+    template<typename Iterator, typename T, typename R>
+    static void _limit_done(
+        const std::shared_ptr<limit_data_t<Iterator, T, R>>& st,
+        const md::callback::cb_error& err)
     {
-        strand->push_back(
-        [strand, cont_cb, cb, end_cb](){
-            auto cb_called = std::make_shared<bool>(false);
-            cb((md::callback::async_cb)
-            [strand, cont_cb, cb, end_cb, cb_called]
-            (const md::callback::cb_error& err) -> void {
-                if(*cb_called)
-                    md::log::default_logger()->fatal(MD_ERR(
-                        "Callback already called once!"
-                    ));
-                *cb_called = true;
-                
-                if(err){
-                    strand->push_back([strand, end_cb]() -> void {
-                        end_cb(strand->data());
-                    });
-                    
-                    strand->data(err);
-                    strand->requeue_self_last_front();
-                    strand->activate();
+        MD_LOCK_ASYNC_DATA(st);
+        --st->running;
+        if(st->done)
+            return;
+        
+        if(err){
+            st->done = true;
+            MD_UNLOCK_ASYNC_DATA;
+            if(st->ct)
+                st->ct->remove_handler(st->cancel_id);
+            st->eq->push_back([st, err]() -> void {
+                st->end_cb(err, std::vector<R>());
+            });
+            return;
+        }
+        MD_UNLOCK_ASYNC_DATA;
+        
+        _limit_next(st);
+    }
+    
+    // each_limit items, no result to collect.
+    template<typename Iterator, typename T>
+    static void _limit_run(
+        const std::shared_ptr<limit_data_t<Iterator, T, std::nullptr_t>>& st,
+        Iterator it, size_t /*idx*/)
+    {
+        cb_flag_t flag;
+        st->cb(*it, (md::callback::async_cb)[st, flag]
+        (const md::callback::cb_error& err) -> void {
+            if(!flag.release())
+                return;
+            _limit_done(st, err);
+        });
+    }
+    
+    // map_limit items, the result is stored at the item index.
+    template<typename Iterator, typename T, typename R>
+    static void _limit_run(
+        const std::shared_ptr<limit_data_t<Iterator, T, R>>& st,
+        Iterator it, size_t idx)
+    {
+        cb_flag_t flag;
+        st->cb(*it, (md::callback::value_cb<R>)[st, idx, flag]
+        (const md::callback::cb_error& err, R val) -> void {
+            if(!flag.release())
+                return;
+            if(!err)
+                st->results[idx] = std::move(val);
+            _limit_done(st, err);
+        });
+    }
+    
+    template<typename T>
+    static void _retry_attempt(std::shared_ptr<retry_data_t<T>> st)
+    {
+        if(st->done)
+            return;
+        
+        cb_flag_t flag;
+        st->task([st, flag](const md::callback::cb_error& err, T val) -> void {
+            if(!flag.release())
+                return;
+            
+            if(!err || ++st->attempt >= st->times){
+                if(st->done.exchange(true))
                     return;
+                if(st->ct)
+                    st->ct->remove_handler(st->cancel_id);
+                return st->end_cb(err, std::move(val));
+            }
+            
+            uint64_t delay = (uint64_t)st->backoff_ms << std::min(
+                st->attempt -1, (size_t)16
+            );
+            delay = std::min(
+                delay, (uint64_t)std::numeric_limits<uint32_t>::max()
+            );
+            st->eq->push_back_delayed(delay, [st]() -> void {
+                _retry_attempt(st);
+            });
+        });
+    }
+    
+    template<typename Data, size_t... I>
+    static void _static_call(Data* d, size_t idx, std::index_sequence<I...>)
+    {
+        typedef void(*step_fn)(Data*);
+        static const step_fn steps[] = { &Data::template call<I>... };
+        steps[idx](d);
+    }
+    
+    template<typename Data>
+    static void _static_run(Data* d, size_t idx)
+    {
+        if(idx == Data::size)
+            return _static_end(d, nullptr);
+        if(d->ct && d->ct->cancelled())
+            return _static_end(d, _cancelled_error());
+        
+        // the step may end the pipeline before returning.
+        auto self = d->self;
+        d->step = idx;
+        _static_call(d, idx, std::make_index_sequence<Data::size>());
+    }
+    
+    // a late callback is reported the same way as a repeated one.
+    template<typename Data>
+    static Data* _static_accept(step_slot_t* slot, uint64_t gen)
+    {
+        auto d = (Data*)slot->accept(gen);
+        if(!d)
+            cb_guard_t::report();
+        return d;
+    }
+        
+    template<typename Data>
+    static void _static_next(Data* d, const md::callback::cb_error& err)
+    {
+        if(err)
+            return _static_end(d, err);
+        _static_run(d, d->step +1);
+    }
+    
+    template<typename Data>
+    static void _static_end(Data* d, const md::callback::cb_error& err)
+    {
+        auto self = std::move(d->self);
+        d->slot->release();
+        d->end(err);
+    }
+    
+#ifdef MD_THREAD_SAFE
+    template<typename R, typename T, typename J>
+    static void _parallel_run(
+        std::shared_ptr<event_queue_t> eq,
+        std::shared_ptr<event_queue_pool_t> pool,
+        size_t first, size_t last, size_t grain, md::cancel_token ct,
+        R init, T body, J join,
+        md::callback::value_cb<R> end_cb)
+    {
+        if(first >= last){
+            eq->push_back(std::bind(end_cb, nullptr, init));
+            return;
+        }
+        
+        if(grain == 0)
+            grain = 1;
+        size_t workers = std::min(
+            pool->size(), (last - first + grain -1) / grain
+        );
+        auto st = std::make_shared<parallel_data_t<R>>(
+            eq, first, last, grain, workers, init
+        );
+        st->end_cb = end_cb;
+        st->ct = ct;
+        
+        for(size_t w = 0; w < workers; ++w)
+            pool->worker(w)->push_back([st, body, join]() -> void {
+                R acc = st->init;
+                bool has_acc = false;
+                size_t b, e;
+                try{
+                    while(_parallel_claim(*st, b, e)){
+                        body(acc, b, e);
+                        has_acc = true;
+                    }
+                }catch(const std::exception& err){
+                    std::unique_lock<std::mutex> lock(st->mutex);
+                    if(!st->failed)
+                        st->err = md::callback::cb_error(err);
+                    st->failed = true;
                 }
                 
-                if(!cont_cb()){
-                    strand->push_back([strand, end_cb]() -> void {
-                        end_cb(nullptr);
-                    });
-                    strand->requeue_self_last_front();
-                    strand->activate();
-                    return;
+                if(has_acc && !st->failed){
+                    std::unique_lock<std::mutex> lock(st->mutex);
+                    st->value = st->has_value ? join(st->value, acc) : acc;
+                    st->has_value = true;
                 }
                 
-                _call_loop(strand, cb, cont_cb, end_cb);
+                if(--st->pending > 0)
+                    return;
+                st->eq->push_back([st]() -> void {
+                    if(st->err)
+                        return st->end_cb(st->err, st->init);
+                    if(st->ct && st->ct->cancelled())
+                        return st->end_cb(_cancelled_error(), st->init);
+                    st->end_cb(nullptr, st->value);
+                });
+            });
+    }
+    
+    template<typename R>
+    static bool _parallel_claim(parallel_data_t<R>& st, size_t& b, size_t& e)
+    {
+        size_t cur = st.next.load();
+        do{
+            if(cur >= st.last || st.failed)
+                return false;
+            if(st.ct && st.ct->cancelled())
+                return false;
+            size_t sz = std::max(st.grain, (st.last - cur) / st.chunk_div);
+            b = cur;
+            e = std::min(st.last, cur + sz);
+        }while(!st.next.compare_exchange_weak(cur, e));
+        return true;
+    }
+#endif //MD_THREAD_SAFE
+    
+    static md::callback::cb_error _cancelled_error()
+    {
+        return md::callback::cb_error(md::error::cancelled_error());
+    }
+    
+    // the end step of a strand based combinator, returns false if the
+    // combinator was already ended by ct.
+    template<typename D>
+    static bool _strand_end(D& d, const md::cancel_token& ct)
+    {
+        if(d.ended)
+            return false;
+        d.ended = true;
+        if(ct)
+            ct->remove_handler(d.cancel_id);
+        return true;
+    }
+    
+    // once ct is cancelled the steps still queued in the strand are
+    // dropped in a single pass and the combinator is ended on eq.
+    template<typename S, typename D, typename E>
+    static void _strand_on_cancel(
+        std::shared_ptr<event_queue_t> eq, S strand, D& d,
+        md::cancel_token ct, E end)
+    {
+        if(!ct)
+            return;
+        
+        std::weak_ptr<cancel_token_t> wct = ct;
+        d.cancel_id = ct->on_cancel([eq, strand, &d, wct, end]() -> void {
+            eq->push_front([strand, &d, ct = wct.lock(), end]() -> void {
+                if(d.ended)
+                    return;
+                d.ended = true;
+                if(ct)
+                    strand->cancel_tasks(ct);
+                d.err = _cancelled_error();
+                end();
             });
         });
-        strand->requeue_self_back();
-        strand->activate();
+    }
+    
+    static void _start_loop(
+        std::shared_ptr<event_queue_t> eq,
+        md::callback::continue_cb cont_cb,
+        md::callback::async_series_cb cb,
+        md::callback::async_cb end_cb,
+        bool check_first, size_t max_sync, md::cancel_token ct)
+    {
+        if(!cont_cb)
+            cont_cb = []()->bool{ return true;};
+        if(!end_cb)
+            end_cb = [](const md::callback::cb_error&){};
+            
+        auto lt = std::make_shared<loop_task_t>(
+            eq, cont_cb, cb, end_cb, check_first, max_sync, ct
+        );
+        lt->self = lt;
+        lt->rearm();
     }
     
 };
@@ -45,6 +45,8 @@ using no_err_value_cb = std::function<void(T)>;
 template<typename T>
 using async_item_cb = typename std::function<void(const T& val, async_cb)>;
 typedef std::function<void(async_cb)> async_series_cb;
+template<typename T>
+using async_task_cb = typename std::function<void(value_cb<T>)>;
 
 template<typename T>
 using async_waterfall_cb = 
@@ -0,0 +1,493 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _tools_md_channel_h
+#define _tools_md_channel_h
+
+#include "event_queue.h"
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+namespace md{
+
+#ifdef MD_THREAD_SAFE
+#define MD_LOCK_CHANNEL std::unique_lock<std::mutex> lock(_mutex)
+#define MD_UNLOCK_CHANNEL lock.unlock()
+#else
+#define MD_LOCK_CHANNEL
+#define MD_UNLOCK_CHANNEL
+#endif
+
+template<typename T>
+class channel_t;
+template<typename In, typename Out>
+class pipeline_t;
+
+template<typename T>
+using channel = std::shared_ptr< md::channel_t<T> >;
+
+/*!
+ * bounded queue of T between event queues, the items are moved in and
+ * out of a fixed size ring. 
+ * 
+ * push callbacks are delayed until the item fits in the ring so a
+ * producer waiting for its callback is suspended while the consumers
+ * are behind. pop callbacks are called on the queue given to pop as
+ * soon as an item is available.
+ * 
+ *	example:
+ *      auto ch = std::make_shared<md::channel_t<std::string>>(64);
+ *      ch->push(eq, std::move(line), [&](const md::callback::cb_error& err){
+ *          // next line
+ *      });
+ *      ch->pop(eq2, [&](const md::callback::cb_error& err, std::string l){
+ *          ...
+ *      });
+ */
+template<typename T>
+class channel_t
+{
+    class pop_waiter_t
+    {
+    public:
+        std::shared_ptr<event_queue_t> eq;
+        md::callback::value_cb<T> cb;
+        T item;
+    };
+    
+    class push_waiter_t
+    {
+    public:
+        std::shared_ptr<event_queue_t> eq;
+        md::callback::async_cb cb;
+        T item;
+    };
+    
+public:
+    channel_t(size_t capacity)
+        : _items(capacity == 0 ? 1 : capacity), _head(0), _count(0),
+        _closed(false)
+    {
+    }
+    
+    size_t capacity() const { return _items.size();}
+    
+    size_t size() const
+    {
+        MD_LOCK_CHANNEL;
+        return _count;
+    }
+    
+    bool closed() const
+    {
+        MD_LOCK_CHANNEL;
+        return _closed;
+    }
+    
+    /// error given to close, empty when the channel was closed normally.
+    md::callback::cb_error error() const
+    {
+        MD_LOCK_CHANNEL;
+        return _err;
+    }
+    
+    /// false if the channel is full or closed.
+    bool try_push(T item)
+    {
+        MD_LOCK_CHANNEL;
+        if(_closed)
+            return false;
+        
+        if(!_pop_waiters.empty()){
+            auto w = _pop_waiters.front();
+            _pop_waiters.pop_front();
+            MD_UNLOCK_CHANNEL;
+            w->item = std::move(item);
+            _dispatch(w, nullptr);
+            return true;
+        }
+        
+        if(_count == _items.size())
+            return false;
+        _put(std::move(item));
+        return true;
+    }
+    
+    /// false if the channel is empty.
+    bool try_pop(T& item)
+    {
+        MD_LOCK_CHANNEL;
+        if(_count == 0)
+            return false;
+        
+        item = _take();
+        auto pw = _refill();
+        MD_UNLOCK_CHANNEL;
+        
+        if(pw)
+            pw->eq->push_back(std::bind(pw->cb, nullptr));
+        return true;
+    }
+    
+    void push(
+        std::shared_ptr<event_queue_t> eq, T item, md::callback::async_cb cb)
+    {
+        MD_LOCK_CHANNEL;
+        if(_closed){
+            MD_UNLOCK_CHANNEL;
+            eq->push_back(std::bind(cb, _closed_error()));
+            return;
+        }
+        
+        if(!_pop_waiters.empty()){
+            auto w = _pop_waiters.front();
+            _pop_waiters.pop_front();
+            MD_UNLOCK_CHANNEL;
+            w->item = std::move(item);
+            _dispatch(w, nullptr);
+            eq->push_back(std::bind(cb, nullptr));
+            return;
+        }
+        
+        if(_count < _items.size()){
+            _put(std::move(item));
+            MD_UNLOCK_CHANNEL;
+            eq->push_back(std::bind(cb, nullptr));
+            return;
+        }
+        
+        auto w = std::make_shared<push_waiter_t>();
+        w->eq = eq;
+        w->cb = cb;
+        w->item = std::move(item);
+        _push_waiters.emplace_back(w);
+    }
+    
+    void pop(std::shared_ptr<event_queue_t> eq, md::callback::value_cb<T> cb)
+    {
+        auto w = std::make_shared<pop_waiter_t>();
+        w->eq = eq;
+        w->cb = cb;
+        
+        MD_LOCK_CHANNEL;
+        if(_count > 0){
+            w->item = _take();
+            auto pw = _refill();
+            MD_UNLOCK_CHANNEL;
+            
+            _dispatch(w, nullptr);
+            if(pw)
+                pw->eq->push_back(std::bind(pw->cb, nullptr));
+            return;
+        }
+        
+        if(_closed){
+            MD_UNLOCK_CHANNEL;
+            _dispatch(w, _closed_error());
+            return;
+        }
+        _pop_waiters.emplace_back(w);
+    }
+    
+    /*!
+     * the items already in the channel can still be poped, the waiting
+     * producers and the consumers of an empty channel receive an error.
+     */
+    void close(const md::callback::cb_error& err = nullptr)
+    {
+        MD_LOCK_CHANNEL;
+        if(_closed)
+            return;
+        _closed = true;
+        _err = err;
+        
+        std::deque< std::shared_ptr<pop_waiter_t> > pop_waiters;
+        std::deque< std::shared_ptr<push_waiter_t> > push_waiters;
+        pop_waiters.swap(_pop_waiters);
+        push_waiters.swap(_push_waiters);
+        MD_UNLOCK_CHANNEL;
+        
+        auto cerr = _closed_error();
+        for(auto& w : pop_waiters)
+            _dispatch(w, cerr);
+        for(auto& w : push_waiters)
+            w->eq->push_back(std::bind(w->cb, cerr));
+    }
+    
+private:
+    md::callback::cb_error _closed_error() const
+    {
+        if(_err)
+            return _err;
+        return md::callback::cb_error(MD_ERR("Channel closed"));
+    }
+    
+    void _put(T&& item)
+    {
+        _items[(_head + _count) % _items.size()] = std::move(item);
+        ++_count;
+    }
+    
+    T _take()
+    {
+        T item = std::move(_items[_head]);
+        _head = (_head +1) % _items.size();
+        --_count;
+        return item;
+    }
+    
+    // move the item of the first waiting producer in the ring.
+    std::shared_ptr<push_waiter_t> _refill()
+    {
+        if(_push_waiters.empty())
+            return nullptr;
+        
+        auto pw = _push_waiters.front();
+        _push_waiters.pop_front();
+        _put(std::move(pw->item));
+        return pw;
+    }
+    
+    static void _dispatch(
+        const std::shared_ptr<pop_waiter_t>& w,
+        const md::callback::cb_error& err)
+    {
+        w->eq->push_back([w, err]() -> void {
+            w->cb(err, std::move(w->item));
+        });
+    }
+    
+    #ifdef MD_THREAD_SAFE
+    mutable std::mutex _mutex;
+    #endif
+    std::vector<T> _items;
+    size_t _head;
+    size_t _count;
+    bool _closed;
+    md::callback::cb_error _err;
+    std::deque< std::shared_ptr<pop_waiter_t> > _pop_waiters;
+    std::deque< std::shared_ptr<push_waiter_t> > _push_waiters;
+};
+
+
+/*!
+ * chain of stages connected by channels, each stage runs on its own
+ * event queue or strand and pulls the next item once its result was
+ * accepted by the next channel, a slow stage suspends the ones before
+ * it up to the producer.
+ * 
+ * a stage given several queues runs one consumer per queue on the same
+ * input channel, the items order is then not preserved.
+ * 
+ * an error returned by a stage closes the channels on both sides, the
+ * producer receive it from push and the sink from end_cb.
+ * 
+ *	example:
+ *      auto p = md::make_pipeline<std::string>(256)
+ *      .then<record_t>(pool_queues,
+ *      [](std::string line, md::callback::value_cb<record_t> cb){
+ *          cb(nullptr, parse(line));
+ *      }).sink(writer_eq,
+ *      [&](record_t r, md::callback::async_cb cb){
+ *          write(r, cb);
+ *      }, [&](const md::callback::cb_error& err){
+ *          ...
+ *      });
+ *      p.push(eq, std::move(line), next_line_cb);
+ *      ...
+ *      p.close();
+ */
+template<typename In, typename Out>
+class pipeline_t
+{
+    template<typename I, typename O>
+    friend class pipeline_t;
+    
+public:
+    pipeline_t(channel<In> in, channel<Out> out, size_t capacity)
+        : _in(in), _out(out), _capacity(capacity)
+    {
+    }
+    
+    channel<In> input() const { return _in;}
+    channel<Out> output() const { return _out;}
+    
+    template<typename N>
+    pipeline_t<In, N> then(
+        std::shared_ptr<event_queue_t> eq,
+        std::function<void(Out, md::callback::value_cb<N>)> fn)
+    {
+        return then<N>(
+            std::vector< std::shared_ptr<event_queue_t> >{eq}, fn
+        );
+    }
+    
+    template<typename N>
+    pipeline_t<In, N> then(
+        std::vector< std::shared_ptr<event_queue_t> > eqs,
+        std::function<void(Out, md::callback::value_cb<N>)> fn)
+    {
+        auto out = std::make_shared<channel_t<N>>(_capacity);
+        auto sfn = std::make_shared<
+            std::function<void(Out, md::callback::value_cb<N>)>
+        >(fn);
+        auto live = std::make_shared<std::atomic<size_t>>(eqs.size());
+        for(auto& eq : eqs)
+            eq->push_back([eq, in = _out, out, sfn, live]() -> void {
+                _run_stage(eq, in, out, sfn, live);
+            });
+        return pipeline_t<In, N>(_in, out, _capacity);
+    }
+    
+    pipeline_t<In, Out>& sink(
+        std::shared_ptr<event_queue_t> eq,
+        std::function<void(Out, md::callback::async_cb)> fn,
+        md::callback::async_cb end_cb)
+    {
+        return sink(
+            std::vector< std::shared_ptr<event_queue_t> >{eq}, fn, end_cb
+        );
+    }
+    
+    /// end_cb is called once the input is closed and all the items done.
+    pipeline_t<In, Out>& sink(
+        std::vector< std::shared_ptr<event_queue_t> > eqs,
+        std::function<void(Out, md::callback::async_cb)> fn,
+        md::callback::async_cb end_cb)
+    {
+        auto sfn = std::make_shared<
+            std::function<void(Out, md::callback::async_cb)>
+        >(fn);
+        auto live = std::make_shared<std::atomic<size_t>>(eqs.size());
+        for(auto& eq : eqs)
+            eq->push_back([eq, in = _out, sfn, live, end_cb]() -> void {
+                _run_sink(eq, in, sfn, live, end_cb);
+            });
+        return *this;
+    }
+    
+    void push(
+        std::shared_ptr<event_queue_t> eq, In item, md::callback::async_cb cb)
+    {
+        _in->push(eq, std::move(item), cb);
+    }
+    
+    bool try_push(In item)
+    {
+        return _in->try_push(std::move(item));
+    }
+    
+    void close(const md::callback::cb_error& err = nullptr)
+    {
+        _in->close(err);
+    }
+    
+private:
+    template<typename I, typename O>
+    static void _run_stage(
+        std::shared_ptr<event_queue_t> eq, channel<I> in, channel<O> out,
+        std::shared_ptr<std::function<void(I, md::callback::value_cb<O>)>> fn,
+        std::shared_ptr<std::atomic<size_t>> live)
+    {
+        in->pop(eq, [eq, in, out, fn, live]
+        (const md::callback::cb_error& err, I item) -> void {
+            if(err)
+                return _stage_end(in, out, live);
+            
+            (*fn)(std::move(item), [eq, in, out, fn, live]
+            (const md::callback::cb_error& err, O res) -> void {
+                if(err){
+                    out->close(err);
+                    in->close(err);
+                    return _stage_end(in, out, live);
+                }
+                
+                out->push(eq, std::move(res), [eq, in, out, fn, live]
+                (const md::callback::cb_error& err) -> void {
+                    // the next stage failed
+                    if(err){
+                        in->close(err);
+                        return _stage_end(in, out, live);
+                    }
+                    _run_stage(eq, in, out, fn, live);
+                });
+            });
+        });
+    }
+    
+    template<typename I, typename O>
+    static void _stage_end(
+        const channel<I>& in, const channel<O>& out,
+        const std::shared_ptr<std::atomic<size_t>>& live)
+    {
+        if(--*live == 0)
+            out->close(in->error());
+    }
+    
+    template<typename I>
+    static void _run_sink(
+        std::shared_ptr<event_queue_t> eq, channel<I> in,
+        std::shared_ptr<std::function<void(I, md::callback::async_cb)>> fn,
+        std::shared_ptr<std::atomic<size_t>> live,
+        md::callback::async_cb end_cb)
+    {
+        in->pop(eq, [eq, in, fn, live, end_cb]
+        (const md::callback::cb_error& err, I item) -> void {
+            if(err){
+                if(--*live == 0)
+                    end_cb(in->error());
+                return;
+            }
+            
+            (*fn)(std::move(item), [eq, in, fn, live, end_cb]
+            (const md::callback::cb_error& err) -> void {
+                if(err){
+                    in->close(err);
+                    if(--*live == 0)
+                        end_cb(in->error());
+                    return;
+                }
+                _run_sink(eq, in, fn, live, end_cb);
+            });
+        });
+    }
+    
+    channel<In> _in;
+    channel<Out> _out;
+    size_t _capacity;
+};
+
+/// start a pipeline, capacity is the size of the channels between stages.
+template<typename T>
+pipeline_t<T, T> make_pipeline(size_t capacity = 64)
+{
+    auto ch = std::make_shared<channel_t<T>>(capacity);
+    return pipeline_t<T, T>(ch, ch, capacity);
+}
+
+}//::md
+#endif //_tools_md_channel_h
@@ -194,6 +194,17 @@ private:
 };
 
 
+/// error passed to the callbacks of a cancelled operation.
+class cancelled_error : public std::runtime_error
+{
+public:
+    cancelled_error(const std::string& msg = "Operation cancelled")
+        : std::runtime_error(msg)
+    {
+    }
+};
+
+
 }}//::md::error
 
 #if defined(_DEBUG) || !defined(NDEBUG)
@@ -217,14 +228,18 @@ class cb_error
 public:
     static cb_error no_err;
 
-    cb_error(): _has_err(false), _msg(""), _has_stack(false)
+    cb_error(): _has_err(false), _msg(""), _cancelled(false), _has_stack(false)
     {}
 
-    cb_error(nullptr_t /*np*/): _has_err(false), _msg(""), _has_stack(false)
+    cb_error(nullptr_t /*np*/):
+        _has_err(false), _msg(""), _cancelled(false), _has_stack(false)
     {}
 
     cb_error(const std::exception& err):
-        _err(err), _has_err(true)
+        _err(err), _has_err(true),
+        _cancelled(
+            dynamic_cast<const md::error::cancelled_error*>(&err) != nullptr
+        )
     {
         _msg = std::string(err.what());
 
@@ -266,6 +281,8 @@ public:
         return _msg.c_str();
     }
 
+    bool is_cancelled() const { return _cancelled;}
+
     bool has_stack() const { return _has_stack;}
     std::string stack() const { return _stack;}
     std::string file() const { return _file;}
@@ -276,6 +293,7 @@ private:
     std::exception _err;
     bool _has_err;
     std::string _msg;
+    bool _cancelled;
 
     bool _has_stack;
     std::string _stack;
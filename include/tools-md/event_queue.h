@@ -28,15 +28,18 @@ SOFTWARE.
 #include <vector>
 #include <chrono>
 #include <thread>
+#include <mutex>
 #include "stable_headers.h"
 #include "errors.h"
 #include "logging.h"
 #include "callbacks.h"
+#include "date_time.h"
 
 namespace md{
 
 #define MD_TO_TASKBASE(x) std::static_pointer_cast<md::event_task_base_t>(x)
 
+class cancel_token_t;
 class event_task_base_t;
 class event_task_t;
 template<typename T>
@@ -45,6 +48,7 @@ class event_queue_t;
 
 typedef std::shared_ptr< md::event_queue_t > event_queue;
 typedef std::shared_ptr< md::event_task_base_t > event_task;
+typedef std::shared_ptr< md::cancel_token_t > cancel_token;
 
 
 //typedef std::shared_ptr< md::event_strand_t > event_strand;
@@ -60,11 +64,87 @@ uint64_t get_event_task_id();
 template<typename Task,
     typename std::enable_if<std::is_invocable<Task>::value, int32_t>::type = -1
 >
-uint64_t _event_queue_push_back(event_queue_t* eq, Task task);
+uint64_t _event_queue_push_back(
+    event_queue_t* eq, Task task, md::cancel_token ct = nullptr);
 template< typename Task,
     typename std::enable_if<std::is_invocable<Task>::value, int32_t>::type = -1
 >
-uint64_t _event_queue_push_front(event_queue_t* eq, Task task);
+uint64_t _event_queue_push_front(
+    event_queue_t* eq, Task task, md::cancel_token ct = nullptr);
+
+/*!
+ * cancellation flag shared by the tasks of an operation, once cancelled
+ * the tasks bound to the token are skipped by their event_queue_t and
+ * the handlers registered with on_cancel are called once.
+ * 
+ *  \code
+ *      auto ct = std::make_shared<md::cancel_token_t>();
+ *      md::async::series(eq, {...}, end_cb, ct);
+ *      ...
+ *      ct->cancel(); // end_cb receive a cancelled cb_error
+ *  \endcode
+ */
+class cancel_token_t
+{
+public:
+    cancel_token_t()
+        : _cancelled(false), _next_id(0)
+    {
+    }
+    
+    bool cancelled() const
+    {
+        return _cancelled.load(std::memory_order_acquire);
+    }
+    
+    void cancel()
+    {
+        std::vector< std::pair<uint64_t, std::function<void()>> > handlers;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(_cancelled)
+                return;
+            _cancelled = true;
+            handlers.swap(_handlers);
+        }
+        
+        for(auto& h : handlers)
+            h.second();
+    }
+    
+    /// fn is called right away if the token is already cancelled.
+    uint64_t on_cancel(std::function<void()> fn)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if(_cancelled){
+            lock.unlock();
+            fn();
+            return 0;
+        }
+        _handlers.emplace_back(++_next_id, fn);
+        return _next_id;
+    }
+    
+    void remove_handler(uint64_t id)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _handlers.erase(
+            std::remove_if(
+                _handlers.begin(), _handlers.end(),
+                [id](const std::pair<uint64_t, std::function<void()>>& h){
+                    return h.first == id;
+                }
+            ),
+            _handlers.end()
+        );
+    }
+    
+private:
+    std::mutex _mutex;
+    std::atomic<bool> _cancelled;
+    uint64_t _next_id;
+    std::vector< std::pair<uint64_t, std::function<void()>> > _handlers;
+};
 
 enum class event_requeue_pos
 {
@@ -91,6 +171,16 @@ public:
     event_queue_t* owner(){ return _owner;}
     uint64_t id() const { return _id;}
     
+    const md::cancel_token& token() const { return _token;}
+    void token(md::cancel_token ct){ _token = ct;}
+    bool cancelled() const { return _token && _token->cancelled();}
+    
+    /// remove the sub tasks bound to ct, used by the strands.
+    virtual size_t cancel_tasks(const md::cancel_token& /*ct*/)
+    {
+        return 0;
+    }
+    
     virtual bool activate_on_requeue() const { return true;}
     
     virtual bool force_push() const { return false;}
@@ -103,15 +193,18 @@ public:
 protected:
     event_queue_t* _owner;
     uint64_t _id;
+    md::cancel_token _token;
 };
 
 class event_task_t
     : public event_task_base_t
 {
 public:
-    event_task_t(event_queue_t* owner, event_task_fn t)
+    event_task_t(
+        event_queue_t* owner, event_task_fn t, md::cancel_token ct = nullptr)
         : event_task_base_t(owner), task(t)
     {
+        _token = ct;
     }
     
     virtual ~event_task_t(){}
@@ -141,13 +234,15 @@ class event_queue_t
     template<typename Task,
     typename std::enable_if<std::is_invocable<Task>::value, int32_t>::type
     >
-    friend uint64_t _event_queue_push_back(event_queue_t* eq, Task task);
+    friend uint64_t _event_queue_push_back(
+        event_queue_t* eq, Task task, md::cancel_token ct);
     friend uint64_t _event_queue_push_back(event_queue_t* eq, event_task task);
 
     template<typename Task,
     typename std::enable_if<std::is_invocable<Task>::value, int32_t>::type
     >
-    friend uint64_t _event_queue_push_front(event_queue_t* eq, Task task);
+    friend uint64_t _event_queue_push_front(
+        event_queue_t* eq, Task task, md::cancel_token ct);
     friend uint64_t _event_queue_push_front(
         event_queue_t* eq, event_task task);
     
@@ -261,6 +356,61 @@ public:
         MD_LOCK_EVENT_QUEUE;
         return _event_queue_push_front(this, task);
     }
+    
+    /// the task is skipped once ct is cancelled
+    template< typename Task >
+    uint64_t push_back(Task task, md::cancel_token ct)
+    {
+        MD_LOCK_EVENT_QUEUE;
+        return _event_queue_push_back(this, task, ct);
+    }
+    
+    /// the task is skipped once ct is cancelled
+    template< typename Task >
+    uint64_t push_front(Task task, md::cancel_token ct)
+    {
+        MD_LOCK_EVENT_QUEUE;
+        return _event_queue_push_front(this, task, ct);
+    }
+    
+    /*!
+     * remove all the tasks bound to ct in a single pass, including the
+     * ones waiting in the strands of the queue.
+     */
+    virtual size_t cancel_tasks(const md::cancel_token& ct)
+    {
+        if(!ct)
+            return 0;
+        
+        // the strands are cancelled once the queue is unlocked, a strand
+        // push_back locks the strand and then its owner.
+        std::vector<event_task> kept;
+        size_t count = 0;
+        {
+            MD_LOCK_EVENT_QUEUE;
+            if(_tasks.empty())
+                return 0;
+            
+            size_t ts = _tasks.size();
+            _tasks.erase(
+                std::remove_if(
+                    _tasks.begin(), _tasks.end(),
+                    [&ct, &kept](const event_task& t)-> bool {
+                        if(t->token() == ct)
+                            return true;
+                        kept.emplace_back(t);
+                        return false;
+                    }
+                ),
+                _tasks.end()
+            );
+            count = ts - _tasks.size();
+        }
+        
+        for(auto& t : kept)
+            count += t->cancel_tasks(ct);
+        return count;
+    }
 
     bool cancel_task(uint64_t task_id)
     {
@@ -276,10 +426,56 @@ public:
                 [task_id](const event_task& t)-> bool {
                     return t->id() == task_id;
                 }
-            )
+            ),
+            _tasks.end()
         );
         return ts > _tasks.size();
     }
+    
+    /*!
+     * push the task once delay_ms is elapsed, the delay is handled by
+     * the event_base timers, without event_base the task is pushed
+     * right away. the timer keeps the queue alive so the queue must be
+     * owned by a std::shared_ptr, md::error is thrown otherwise.
+     */
+    virtual void push_back_delayed(uint32_t delay_ms, event_task_fn task)
+    {
+        event_base* evb = this->ev_base();
+        if(delay_ms == 0 || !evb){
+            this->push_back(task);
+            return;
+        }
+        
+        struct delayed_task_t
+        {
+            std::shared_ptr<event_queue_t> eq;
+            event_task_fn task;
+        };
+        
+        std::shared_ptr<event_queue_t> self;
+        try{
+            self = this->shared_from_this();
+        }catch(const std::bad_weak_ptr&){
+            throw MD_ERR(
+                "push_back_delayed needs a queue owned by a std::shared_ptr!"
+            );
+        }
+        
+        auto dt = new delayed_task_t{self, task};
+        struct timeval tv = md::date::ms_to_timeval(delay_ms);
+        if(event_base_once(
+            evb, -1, EV_TIMEOUT,
+            [](int /*fd*/, short /*events*/, void* arg){
+                delayed_task_t* dt = (delayed_task_t*)arg;
+                dt->eq->push_back(dt->task);
+                delete dt;
+            },
+            dt, &tv) == -1
+        ){
+            delete dt;
+            throw MD_ERR("event_base_once failed!");
+        }
+    }
 
     template<
         typename Iterator,
@@ -410,7 +606,8 @@ private:
                     }
                     return false;
                 }
-            )
+            ),
+            _tasks.end()
         );
         task->switch_owner(new_owner, false);
         new_owner->activate();
@@ -418,7 +615,7 @@ private:
     
     void run_event_task(event_task& t)
     {
-        if(!t)
+        if(!t || t->cancelled())
             return;
         
         t->run_task();
@@ -451,10 +648,11 @@ private:
 template<typename Task,
     typename std::enable_if<std::is_invocable<Task>::value, int32_t>::type
 >
-uint64_t _event_queue_push_back(event_queue_t* eq, Task task)
+uint64_t _event_queue_push_back(
+    event_queue_t* eq, Task task, md::cancel_token ct)
 {
     eq->activate();
-    event_task t(new event_task_t(eq, md::event_task_fn(task)));
+    event_task t(new event_task_t(eq, md::event_task_fn(task), ct));
     eq->_tasks.emplace_back(t);
     return t->id();
 }
@@ -462,10 +660,11 @@ uint64_t _event_queue_push_back(event_queue_t* eq, Task task)
 template<typename Task,
     typename std::enable_if<std::is_invocable<Task>::value, int32_t>::type
 >
-uint64_t _event_queue_push_front(event_queue_t* eq, Task task)
+uint64_t _event_queue_push_front(
+    event_queue_t* eq, Task task, md::cancel_token ct)
 {
     eq->activate();
-    event_task t(new event_task_t(eq, md::event_task_fn( task )));
+    event_task t(new event_task_t(eq, md::event_task_fn( task ), ct));
     eq->_tasks.emplace_front(t);
     return t->id();
 }
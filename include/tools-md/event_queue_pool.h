@@ -0,0 +1,180 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _tools_md_event_queue_pool_h
+#define _tools_md_event_queue_pool_h
+
+#include "event_queue.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// the workers are fed from other threads, the event_queue_t must be locked.
+#ifdef MD_THREAD_SAFE
+
+namespace md{
+
+class event_worker_t;
+class event_queue_pool_t;
+typedef std::shared_ptr< md::event_worker_t > event_worker;
+typedef std::shared_ptr< md::event_queue_pool_t > event_queue_pool;
+
+/*!
+ * event_queue_t running its tasks on a dedicated thread.
+ */
+class event_worker_t
+    : public event_queue_t
+{
+public:
+    event_worker_t()
+        : event_queue_t(), _signals(0), _stop(false)
+    {
+    }
+    
+    virtual ~event_worker_t()
+    {
+        stop();
+    }
+    
+    void start()
+    {
+        if(_thread.joinable())
+            return;
+        _stop = false;
+        _thread = std::thread(&event_worker_t::_run, this);
+    }
+    
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_wmutex);
+            _stop = true;
+        }
+        _cv.notify_one();
+        if(_thread.joinable())
+            _thread.join();
+    }
+    
+    // called by push_back/push_front while the queue is locked,
+    // the worker only wait on _wmutex to avoid any lock inversion.
+    void activate()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_wmutex);
+            ++_signals;
+        }
+        _cv.notify_one();
+    }
+    
+private:
+    void _run()
+    {
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(_wmutex);
+                _cv.wait(lock, [this]() -> bool {
+                    return _stop || _signals > 0;
+                });
+                if(_stop)
+                    return;
+                _signals = 0;
+            }
+            
+            size_t count = this->local_size();
+            if(count > 0)
+                this->run_n(count);
+        }
+    }
+    
+    std::mutex _wmutex;
+    std::condition_variable _cv;
+    size_t _signals;
+    bool _stop;
+    std::thread _thread;
+};
+
+/*!
+ * fixed set of event_worker_t, one thread by worker.
+ */
+class event_queue_pool_t
+{
+protected:
+    static std::shared_ptr<event_queue_pool_t>& _default()
+    {
+        static std::shared_ptr<event_queue_pool_t> _def;
+        return _def;
+    }
+    
+public:
+    static std::shared_ptr<event_queue_pool_t> get_default()
+    {
+        if(!_default())
+            _default() = std::make_shared<event_queue_pool_t>();
+        return _default();
+    }
+    static void destroy_default()
+    {
+        _default().reset();
+    }
+    
+    event_queue_pool_t(size_t worker_count = 0)
+        : _next(0)
+    {
+        if(worker_count == 0)
+            worker_count = std::max(std::thread::hardware_concurrency(), 1U);
+        
+        for(size_t i = 0; i < worker_count; ++i){
+            _workers.emplace_back(std::make_shared<event_worker_t>());
+            _workers.back()->start();
+        }
+    }
+    
+    ~event_queue_pool_t()
+    {
+        for(auto& w : _workers)
+            w->stop();
+    }
+    
+    size_t size() const { return _workers.size();}
+    
+    std::shared_ptr<event_worker_t> worker(size_t idx) const
+    {
+        return _workers[idx % _workers.size()];
+    }
+    
+    /// round robin on the workers
+    std::shared_ptr<event_worker_t> next()
+    {
+        return _workers[_next++ % _workers.size()];
+    }
+    
+private:
+    std::vector<event_worker> _workers;
+    std::atomic<size_t> _next;
+};
+
+}//::md
+#endif //MD_THREAD_SAFE
+#endif //_tools_md_event_queue_pool_h
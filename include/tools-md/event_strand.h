@@ -65,7 +65,8 @@ public:
     event_strand_t(event_queue_t* owner, bool auto_requeue = true)
         : event_queue_t(),
         event_task_base_t(owner),
-        _auto_requeue(auto_requeue)
+        _auto_requeue(auto_requeue),
+        _activate_on_requeue(true)
     {
     }
     
@@ -99,6 +100,22 @@ public:
         return _tasks.size();
     }
     
+    /// the delay is handled by the owner, the task then runs in the strand.
+    virtual void push_back_delayed(uint32_t delay_ms, event_task_fn task)
+    {
+        auto self = std::static_pointer_cast<event_strand_t<T>>(
+            this->shared_from_this()
+        );
+        this->_owner->push_back_delayed(delay_ms, [self, task]() -> void {
+            self->push_back(task);
+        });
+    }
+    
+    virtual size_t cancel_tasks(const md::cancel_token& ct)
+    {
+        return event_queue_t::cancel_tasks(ct);
+    }
+    
     virtual event_requeue_pos requeue() const
     {
         if(_auto_requeue && this->size() > 0)
@@ -107,7 +124,7 @@ public:
         return event_requeue_pos::none;
     }
     
-    T data(){ return _data;}
+    T& data(){ return _data;}
     void data(T val){ _data = val;}
     
     template< typename Task >
@@ -137,6 +154,32 @@ public:
         return id;
     }
     
+    template< typename Task >
+    uint64_t push_back(Task task, md::cancel_token ct)
+    {
+        MD_LOCK_EVENT_QUEUE;
+        
+        auto id = _event_queue_push_back(this, task, ct);
+        if(_auto_requeue)
+            this->_owner->push_back(
+                MD_STRAND_TO_TASKBASE(this->shared_from_this())
+            );
+        return id;
+    }
+    
+    template< typename Task >
+    uint64_t push_front(Task task, md::cancel_token ct)
+    {
+        MD_LOCK_EVENT_QUEUE;
+        
+        auto id = _event_queue_push_front(this, task, ct);
+        if(_auto_requeue)
+            this->_owner->push_back(
+                MD_STRAND_TO_TASKBASE(this->shared_from_this())
+            );
+        return id;
+    }
+    
     virtual void run_task()
     {
         this->run_n();
@@ -29,6 +29,13 @@ SOFTWARE.
 #include "errors.h"
 
 #include <zlib.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <climits>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 // http://www.zlib.net/manual.html#Advanced
 #define MD_COMPRESSION_NOT_SUPPORTED (-MAX_WBITS - 1000)
@@ -41,6 +48,18 @@ SOFTWARE.
 
 namespace md{ namespace files{
 
+/*!
+ * wait until a non-blocking descriptor accepts more data, a full pipe
+ * or socket is drained by its reader, not by a sync.
+ */
+inline void wait_writable(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    while(poll(&pfd, 1, -1) < 0 && errno == EINTR);
+}
 
 /* Write "n" bytes to a descriptor. */
 inline ssize_t writen(int fd, const void *vptr, size_t n)
@@ -57,7 +76,7 @@ inline ssize_t writen(int fd, const void *vptr, size_t n)
                 if(errno == EINTR)
                     nwritten = 0;/* and call write() again */
                 else if(errno == EAGAIN || errno == EWOULDBLOCK){
-                    fsync(fd);
+                    wait_writable(fd);
                     nwritten = 0;/* and call write() again */
                 }else
                     return(-1);/* error */
@@ -76,178 +95,68 @@ inline ssize_t writen(int fd, const void *vptr, size_t n)
     }
 }
 
-
-
-/*
-namespace _internal{
-    struct gzip_file{
-        event* ev;
-        int fd_in;
-        int fd_out;
-        z_stream* zs;
-        uLong zs_size;
-        evmvc::async_cb cb;
-    };
-    
-    struct gzip_file* new_gzip_file()
-    {
-        struct evmvc::_internal::gzip_file* gzf = nullptr;
-        mm__alloc_(gzf, struct evmvc::_internal::gzip_file, {
-            nullptr, -1, -1, nullptr, 0, nullptr
-        });
-        
-        gzf->zs = (z_stream*)malloc(sizeof(*gzf->zs));
-        memset(gzf->zs, 0, sizeof(*gzf->zs));
-        return gzf;
-    }
-    
-    void free_gzip_file(struct evmvc::_internal::gzip_file* gzf)
-    {
-        deflateEnd(gzf->zs);
-        event_del(gzf->ev);
-        event_free(gzf->ev);
-        close(gzf->fd_in);
-        close(gzf->fd_out);
-        free(gzf->zs);
-        free(gzf);
-    }
-    
-    void gzip_file_on_read(int fd, short events, void* arg)
-    {
-        if((events & IN_IGNORED) == IN_IGNORED)
-            return;
+/* Write all the buffers of iov to a descriptor. */
+inline ssize_t writevn(int fd, const struct iovec* iov, int iovcnt)
+{
+    ssize_t total = 0;
+    while(iovcnt > 0){
+        ssize_t nwritten = writev(fd, iov, std::min(iovcnt, IOV_MAX));
+        if(nwritten < 0){
+            if(errno == EINTR)
+                continue;/* and call writev() again */
+            else if(errno == EAGAIN || errno == EWOULDBLOCK){
+                wait_writable(fd);
+                continue;/* and call writev() again */
+            }
+            return(-1);/* error */
+        }
         
-        gzip_file* gzf = (gzip_file*)arg;
+        total += nwritten;
+        while(iovcnt > 0 && (size_t)nwritten >= iov->iov_len){
+            nwritten -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
         
-        char buf[EVMVC_READ_BUF_SIZE];
-        // try to read EVMVC_READ_BUF_SIZE bytes from the file pointer
-        do{
-            ssize_t bytes_read = read(gzf->fd_in, buf, sizeof(buf));
-            
-            if(bytes_read == -1){
-                int terr = errno;
-                if(terr == EAGAIN || terr == EWOULDBLOCK)
-                    return;
-                auto cb = gzf->cb;
-                free_gzip_file(gzf);
-                cb(EVMVC_ERR(
-                    "read function returned: '{}'",
-                    terr
-                ));
-            }
-            
-            if(bytes_read > 0){
-                gzf->zs->next_in = (Bytef*)buf;
-                gzf->zs->avail_in = bytes_read;
-                
-                // retrieve the compressed bytes blockwise.
-                int ret;
-                char zbuf[EVMVC_READ_BUF_SIZE];
-                bytes_read = 0;
-                
-                gzf->zs->next_out = reinterpret_cast<Bytef*>(zbuf);
-                gzf->zs->avail_out = sizeof(zbuf);
-                
-                ret = deflate(gzf->zs, Z_SYNC_FLUSH);
-                if(ret != Z_OK && ret != Z_STREAM_END){
-                    auto cb = gzf->cb;
-                    free_gzip_file(gzf);
-                    cb(EVMVC_ERR(
-                        "zlib deflate function returned: '{}'",
-                        ret
-                    ));
-                    return;
-                }
-                
-                if(gzf->zs_size < gzf->zs->total_out){
-                    bytes_read += gzf->zs->total_out - gzf->zs_size;
-                    writen(
-                        gzf->fd_out,
-                        zbuf,
-                        gzf->zs->total_out - gzf->zs_size
-                    );
-                    gzf->zs_size = gzf->zs->total_out;
-                }
-                
-            }else{
-                int ret = deflate(gzf->zs, Z_FINISH);
-                if(ret != Z_OK && ret != Z_STREAM_END){
-                    auto cb = gzf->cb;
-                    free_gzip_file(gzf);
-                    cb(EVMVC_ERR(
-                        "zlib deflate function returned: '{}'",
-                        ret
-                    ));
-                    return;
-                }
-                
-                if(gzf->zs_size < gzf->zs->total_out){
-                    bytes_read += gzf->zs->total_out - gzf->zs_size;
-                    writen(
-                        gzf->fd_out,
-                        gzf->zs->next_out,
-                        gzf->zs->total_out - gzf->zs_size
-                    );
-                    gzf->zs_size = gzf->zs->total_out;
-                }
-
-                auto cb = gzf->cb;
-                free_gzip_file(gzf);
-                cb(nullptr);
-                return;
-            }
-        }while(true);
-    }
-    
-}// _internal
-void gzip_file(
-    event_base* ev_base,
-    evmvc::string_view src,
-    evmvc::string_view dest,
-    evmvc::async_cb cb)
-{
-    cb(EVMVC_ERR(
-        "file async IO Not working with EPOLL!\n"
-        "Should be reimplement with aio or thread pool!"
-    ));
-    struct evmvc::_internal::gzip_file* gzf = _internal::new_gzip_file();
-    if(deflateInit2(
-        gzf->zs,
-        Z_DEFAULT_COMPRESSION,
-        Z_DEFLATED,
-        EVMVC_ZLIB_GZIP_WSIZE,
-        EVMVC_ZLIB_MEM_LEVEL,
-        EVMVC_ZLIB_STRATEGY
-        ) != Z_OK
-    ){
-        free(gzf->zs);
-        free(gzf);
-        cb(EVMVC_ERR("deflateInit2 failed!"));
-        return;
-    }
-    
-    gzf->fd_in = open(src.data(), O_NONBLOCK | O_RDONLY);
-    gzf->fd_out = open(
-        dest.data(),
-        O_CREAT | O_WRONLY, 
-        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP//ug+wr
-    );
-    gzf->cb = cb;
-    
-    gzf->ev = event_new(
-        ev_base, gzf->fd_in, EV_READ | EV_PERSIST,
-        _internal::gzip_file_on_read, gzf
-    );
-    if(event_add(gzf->ev, nullptr) == -1){
-        _internal::free_gzip_file(gzf);
-        cb(EVMVC_ERR("evmvc::gzip_file::event_add failed!"));
+        // finish the buffer partially written.
+        if(iovcnt > 0 && nwritten > 0){
+            size_t nleft = iov->iov_len - nwritten;
+            if(writen(fd, (const char*)iov->iov_base + nwritten, nleft) < 0)
+                return(-1);
+            total += nleft;
+            ++iov;
+            --iovcnt;
+        }
     }
+    return(total);
 }
-*/
 
+
+/*!
+ * compress src to dest in the gzip format, the file is streamed in
+ * small blocks and written to a temporary file renamed to dest once
+ * complete, src and dest can be the same file.
+ */
 inline void gzip_file(
     md::string_view src, md::string_view dest)
 {
+    std::string sp(src.data(), src.size());
+    std::string dp(dest.data(), dest.size());
+    std::string tp = dp + ".tmp";
+    
+    int fin = open(sp.c_str(), O_RDONLY);
+    if(fin < 0)
+        throw MD_ERR("Unable to open '{}'", sp);
+    int fout = open(
+        tp.c_str(),
+        O_CREAT | O_TRUNC | O_WRONLY,
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP//ug+wr
+    );
+    if(fout < 0){
+        close(fin);
+        throw MD_ERR("Unable to open '{}'", tp);
+    }
+    
     z_stream zs;
     memset(&zs, 0, sizeof(zs));
     if(deflateInit2(
@@ -259,52 +168,187 @@ inline void gzip_file(
         MD_ZLIB_STRATEGY
         ) != Z_OK
     ){
+        close(fin);
+        close(fout);
+        unlink(tp.c_str());
         throw MD_ERR(
             "deflateInit2 failed!"
         );
     }
-    std::ifstream fin(
-        src.data(), std::ios::binary
-    );
-    std::ostringstream ostrm;
-    ostrm << fin.rdbuf();
-    std::string inf_data = ostrm.str();
-    fin.close();
     
-    std::string def_data;
-    zs.next_in = (Bytef*)inf_data.data();
-    zs.avail_in = inf_data.size();
-    int ret;
+    char inbuffer[32768];
     char outbuffer[32768];
-    
-    do{
-        zs.next_out =
-            reinterpret_cast<Bytef*>(outbuffer);
-        zs.avail_out = sizeof(outbuffer);
-        ret = deflate(&zs, Z_FINISH);
-        if (def_data.size() < zs.total_out) {
-            // append the block to the output string
-            def_data.append(
-                outbuffer,
-                zs.total_out - def_data.size()
-            );
+    int ret = Z_OK;
+    int flush = Z_NO_FLUSH;
+    std::string err;
+    while(flush != Z_FINISH && err.empty()){
+        ssize_t n = read(fin, inbuffer, sizeof(inbuffer));
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            err = fmt::format("read failed: {}", strerror(errno));
+            break;
         }
-    }while(ret == Z_OK);
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = (Bytef*)inbuffer;
+        zs.avail_in = (uInt)n;
+    
+        do{
+            zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+            zs.avail_out = sizeof(outbuffer);
+            ret = deflate(&zs, flush);
+            if(ret == Z_STREAM_ERROR){
+                err = fmt::format("deflate failed: ({}) {}", ret, zs.msg);
+                break;
+            }
+            size_t sz = sizeof(outbuffer) - zs.avail_out;
+            if(sz > 0 && writen(fout, outbuffer, sz) < 0){
+                err = fmt::format("write failed: {}", strerror(errno));
+                break;
+            }
+        }while(zs.avail_out == 0);
+    }
     
     deflateEnd(&zs);
-    if(ret != Z_STREAM_END){
-        throw MD_ERR(
-            "Error while log compression: ({}) {}",
-            ret, zs.msg
-        );
+    close(fin);
+    if(err.empty() && ret != Z_STREAM_END)
+        err = fmt::format("({}) {}", ret, zs.msg ? zs.msg : "");
+    if(err.empty() && fsync(fout) != 0)
+        err = fmt::format("fsync failed: {}", strerror(errno));
+    close(fout);
+    
+    if(err.empty() && rename(tp.c_str(), dp.c_str()) != 0)
+        err = fmt::format("rename failed: {}", strerror(errno));
+    if(!err.empty()){
+        unlink(tp.c_str());
+        throw MD_ERR("Error while log compression: {}", err);
     }
+}
+
+namespace _internal{
     
-    std::ofstream fout(
-        dest.data(), std::ios::binary
-    );
-    fout.write(def_data.c_str(), def_data.size());
-    fout.flush();
-    fout.close();
+    /*!
+     * a single background thread running the slow file jobs in order,
+     * started by the first job. the pending jobs are completed before
+     * the process exits.
+     */
+    class file_worker_t
+    {
+    public:
+        file_worker_t()
+            : _stop(false), _busy(false)
+        {
+        }
+        
+        ~file_worker_t()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+                _cv.notify_all();
+            }
+            if(_thread.joinable())
+                _thread.join();
+        }
+        
+        void push(std::function<void()> job)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _jobs.emplace_back(std::move(job));
+            if(!_thread.joinable())
+                _thread = std::thread(&file_worker_t::_run, this);
+            _cv.notify_all();
+        }
+        
+        /// wait until the jobs pushed so far are done.
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _idle_cv.wait(lock, [this](){ return _jobs.empty() && !_busy;});
+        }
+        
+    private:
+        void _run()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while(true){
+                _cv.wait(lock, [this](){ return _stop || !_jobs.empty();});
+                if(_jobs.empty())
+                    break;
+                
+                auto job = std::move(_jobs.front());
+                _jobs.pop_front();
+                _busy = true;
+                lock.unlock();
+                job();
+                job = nullptr;
+                lock.lock();
+                _busy = false;
+                if(_jobs.empty())
+                    _idle_cv.notify_all();
+            }
+        }
+        
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::condition_variable _idle_cv;
+        std::deque<std::function<void()>> _jobs;
+        bool _stop;
+        bool _busy;
+        std::thread _thread;
+    };
+    
+    inline file_worker_t& file_worker()
+    {
+        static file_worker_t worker;
+        return worker;
+    }
+    
+}// _internal
+
+/*!
+ * run job on the background file thread, the jobs run one at a time in
+ * the order they are pushed.
+ */
+inline void async_job(std::function<void()> job)
+{
+    _internal::file_worker().push(std::move(job));
+}
+
+/// wait for the background jobs pushed so far.
+inline void wait_async_jobs()
+{
+    _internal::file_worker().wait();
+}
+
+/*!
+ * compress src to dest on the background file thread, cb is called
+ * from that thread once done.
+ * 
+ *	example:
+ *      md::files::gzip_file("app.log.2", "app.log.2.gz",
+ *      [](const md::callback::cb_error& err){
+ *          if(err)
+ *              md::log::warn(err.c_str());
+ *      });
+ */
+inline void gzip_file(
+    md::string_view src, md::string_view dest,
+    std::function<void(const md::callback::cb_error& err)> cb)
+{
+    std::string sp(src.data(), src.size());
+    std::string dp(dest.data(), dest.size());
+    async_job([sp, dp, cb](){
+        try{
+            gzip_file(sp, dp);
+        }catch(const std::exception& err){
+            if(cb)
+                cb(md::callback::cb_error(err));
+            return;
+        }
+        if(cb)
+            cb(nullptr);
+    });
 }
     
     
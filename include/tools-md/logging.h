@@ -34,155 +34,1582 @@ SOFTWARE.
 
 #include <sstream>
 #include <iomanip>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <array>
+
+/*!
+ * the log levels kept by the MD_LOG_* macros, the calls of a more verbose
+ * level are removed by the preprocessor with their arguments. it must be
+ * the same for the whole program, defined by the build.
+ * 
+ *	example:
+ *      // -DMD_LOG_ACTIVE_LEVEL=MD_LOG_LEVEL_INFO
+ *      MD_LOG_DEBUG(log, "state: {}", dump_state()); // nothing is compiled.
+ */
+#define MD_LOG_LEVEL_OFF                0
+#define MD_LOG_LEVEL_AUDIT_FAILED       1
+#define MD_LOG_LEVEL_AUDIT_SUCCEEDED    2
+#define MD_LOG_LEVEL_FATAL              3
+#define MD_LOG_LEVEL_ERROR              4
+#define MD_LOG_LEVEL_WARNING            5
+#define MD_LOG_LEVEL_INFO               6
+#define MD_LOG_LEVEL_DEBUG              7
+#define MD_LOG_LEVEL_TRACE              8
+
+#ifndef MD_LOG_ACTIVE_LEVEL
+    #define MD_LOG_ACTIVE_LEVEL MD_LOG_LEVEL_TRACE
+#endif
+
+/*!
+ * log with a logger pointer when the level is compiled in and enabled,
+ * the arguments are only evaluated if the record is logged.
+ */
+#define MD_LOG_CALL(lvl, fn, lg, ...) \
+    do{ \
+        auto&& _md_log = (lg); \
+        if(_md_log->should_log(lvl)) \
+            _md_log->fn(__VA_ARGS__); \
+    }while(0)
+
+#if MD_LOG_ACTIVE_LEVEL >= MD_LOG_LEVEL_TRACE
+    #define MD_LOG_TRACE(lg, ...) \
+        MD_LOG_CALL(md::log::log_level::trace, trace, lg, __VA_ARGS__)
+#else
+    #define MD_LOG_TRACE(lg, ...) do{}while(0)
+#endif
+
+#if MD_LOG_ACTIVE_LEVEL >= MD_LOG_LEVEL_DEBUG
+    #define MD_LOG_DEBUG(lg, ...) \
+        MD_LOG_CALL(md::log::log_level::debug, debug, lg, __VA_ARGS__)
+#else
+    #define MD_LOG_DEBUG(lg, ...) do{}while(0)
+#endif
+
+#if MD_LOG_ACTIVE_LEVEL >= MD_LOG_LEVEL_INFO
+    #define MD_LOG_INFO(lg, ...) \
+        MD_LOG_CALL(md::log::log_level::info, info, lg, __VA_ARGS__)
+#else
+    #define MD_LOG_INFO(lg, ...) do{}while(0)
+#endif
+
+#if MD_LOG_ACTIVE_LEVEL >= MD_LOG_LEVEL_WARNING
+    #define MD_LOG_WARN(lg, ...) \
+        MD_LOG_CALL(md::log::log_level::warning, warn, lg, __VA_ARGS__)
+#else
+    #define MD_LOG_WARN(lg, ...) do{}while(0)
+#endif
+
+#if MD_LOG_ACTIVE_LEVEL >= MD_LOG_LEVEL_ERROR
+    #define MD_LOG_ERROR(lg, ...) \
+        MD_LOG_CALL(md::log::log_level::error, error, lg, __VA_ARGS__)
+#else
+    #define MD_LOG_ERROR(lg, ...) do{}while(0)
+#endif
 
 namespace md { namespace log{
 
-class logger_t;
-typedef std::shared_ptr<logger_t> logger;
-md::log::logger& default_logger();
+class logger_t;
+typedef std::shared_ptr<logger_t> logger;
+md::log::logger& default_logger();
+
+typedef std::chrono::system_clock log_clock;
+
+enum class log_level
+{
+    off             = 0,
+    audit_failed    = 1,
+    audit_succeeded = 2,
+    fatal           = 3,
+    error           = 4,
+    warning         = 5,
+    info            = 6,
+    debug           = 7,
+    trace           = 8
+};
+
+inline md::string_view to_string(log_level lvl)
+{
+    switch(lvl){
+        case log_level::audit_failed: return "AUDIT-FAILED";
+        case log_level::audit_succeeded: return "AUDIT-SUCCEEDED";
+        case log_level::fatal: return "FATAL";
+        case log_level::error: return "ERROR";
+        case log_level::warning: return "WARNING";
+        case log_level::info: return "INFO";
+        case log_level::debug: return "DEBUG";
+        case log_level::trace: return "TRACE";
+        case log_level::off: return "OFF";
+        default: return "N/A";
+    }
+}
+
+/// the most verbose level compiled in the MD_LOG_* macros.
+constexpr log_level active_level = (log_level)MD_LOG_ACTIVE_LEVEL;
+
+namespace _internal{
+    
+    inline std::string get_timestamp(log_clock::time_point time);
+    inline void get_timestamp(fmt::memory_buffer& buf, log_clock::time_point time);
+    
+    enum class arg_tag : uint8_t
+    {
+        i64     = 1,
+        u64     = 2,
+        f32     = 3,
+        f64     = 4,
+        boolean = 5,
+        ch      = 6,
+        str     = 7,
+    };
+    
+    template<typename T>
+    inline void put(fmt::memory_buffer& buf, const T& val)
+    {
+        const char* p = (const char*)&val;
+        buf.append(p, p + sizeof(T));
+    }
+    
+    template<typename T>
+    inline T get(const char*& p)
+    {
+        T val;
+        memcpy(&val, p, sizeof(T));
+        p += sizeof(T);
+        return val;
+    }
+    
+    inline void put_str(fmt::memory_buffer& buf, const char* s, size_t sz)
+    {
+        buf.push_back((char)arg_tag::str);
+        put(buf, (uint32_t)sz);
+        buf.append(s, s + sz);
+    }
+    
+    /*!
+     * the argument types a deferred record can hold, the value is copied
+     * with a one byte tag, the strings are copied with their size.
+     */
+    template<typename T, typename Enable = void>
+    struct deferred_arg : std::false_type {};
+    
+    template<typename T>
+    struct deferred_arg<T, typename std::enable_if<
+        std::is_integral<T>::value && std::is_signed<T>::value &&
+        !std::is_same<T, char>::value
+    >::type> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, T val)
+        {
+            buf.push_back((char)arg_tag::i64);
+            put(buf, (int64_t)val);
+        }
+    };
+    
+    template<typename T>
+    struct deferred_arg<T, typename std::enable_if<
+        std::is_integral<T>::value && std::is_unsigned<T>::value &&
+        !std::is_same<T, bool>::value && !std::is_same<T, char>::value
+    >::type> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, T val)
+        {
+            buf.push_back((char)arg_tag::u64);
+            put(buf, (uint64_t)val);
+        }
+    };
+    
+    template<typename T>
+    struct deferred_arg<T, typename std::enable_if<
+        std::is_enum<T>::value
+    >::type> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, T val)
+        {
+            typedef typename std::underlying_type<T>::type U;
+            deferred_arg<U>::encode(buf, (U)val);
+        }
+    };
+    
+    template<>
+    struct deferred_arg<bool> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, bool val)
+        {
+            buf.push_back((char)arg_tag::boolean);
+            buf.push_back(val ? 1 : 0);
+        }
+    };
+    
+    template<>
+    struct deferred_arg<char> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, char val)
+        {
+            buf.push_back((char)arg_tag::ch);
+            buf.push_back(val);
+        }
+    };
+    
+    template<>
+    struct deferred_arg<float> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, float val)
+        {
+            buf.push_back((char)arg_tag::f32);
+            put(buf, val);
+        }
+    };
+    
+    template<>
+    struct deferred_arg<double> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, double val)
+        {
+            buf.push_back((char)arg_tag::f64);
+            put(buf, val);
+        }
+    };
+    
+    template<>
+    struct deferred_arg<const char*> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, const char* val)
+        {
+            put_str(buf, val, strlen(val));
+        }
+    };
+    
+    template<>
+    struct deferred_arg<char*> : deferred_arg<const char*> {};
+    
+    template<>
+    struct deferred_arg<std::string> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, const std::string& val)
+        {
+            put_str(buf, val.data(), val.size());
+        }
+    };
+    
+    template<>
+    struct deferred_arg<md::string_view> : std::true_type
+    {
+        static void encode(fmt::memory_buffer& buf, md::string_view val)
+        {
+            put_str(buf, val.data(), val.size());
+        }
+    };
+    
+    template<typename... T>
+    struct all_deferred : std::true_type {};
+    
+    template<typename T, typename... R>
+    struct all_deferred<T, R...>
+        : std::integral_constant<bool,
+            deferred_arg<typename std::decay<T>::type>::value &&
+            all_deferred<R...>::value
+        >
+    {
+    };
+    
+    inline void encode_args(fmt::memory_buffer& /*buf*/)
+    {
+    }
+    
+    template<typename T, typename... R>
+    inline void encode_args(
+        fmt::memory_buffer& buf, const T& val, const R&... rest)
+    {
+        deferred_arg<typename std::decay<T>::type>::encode(buf, val);
+        encode_args(buf, rest...);
+    }
+    
+    // format one argument, spec is the replacement field, '{...}'.
+    inline const char* format_arg(
+        fmt::memory_buffer& buf, const char* spec, const char* p)
+    {
+        auto out = std::back_inserter(buf);
+        switch((arg_tag)*p++){
+            case arg_tag::i64:
+                fmt::format_to(out, spec, get<int64_t>(p));
+                break;
+            case arg_tag::u64:
+                fmt::format_to(out, spec, get<uint64_t>(p));
+                break;
+            case arg_tag::f32:
+                fmt::format_to(out, spec, get<float>(p));
+                break;
+            case arg_tag::f64:
+                fmt::format_to(out, spec, get<double>(p));
+                break;
+            case arg_tag::boolean:
+                fmt::format_to(out, spec, *p++ != 0);
+                break;
+            case arg_tag::ch:
+                fmt::format_to(out, spec, *p++);
+                break;
+            case arg_tag::str:{
+                uint32_t sz = get<uint32_t>(p);
+                fmt::format_to(out, spec, fmt::string_view(p, sz));
+                p += sz;
+                break;
+            }
+            default:
+                return nullptr;
+        }
+        return p;
+    }
+    
+    /*!
+     * format f with the arguments encoded in args, only the automatic
+     * and the numbered replacement fields are supported, '{}', '{0}',
+     * '{:>8}' or '{1:x}'. a spec that doesn't match its argument, only
+     * found once formatting, writes f and the error instead.
+     */
+    inline void format_deferred(
+        fmt::memory_buffer& buf, const char* f,
+        const char* args, size_t args_size)
+    {
+        const size_t start = buf.size();
+        const size_t max_args = 32;
+        const char* offsets[max_args];
+        size_t arg_count = 0;
+        const char* a = args;
+        const char* ae = args + args_size;
+        while(a < ae && arg_count < max_args){
+            offsets[arg_count++] = a;
+            switch((arg_tag)*a){
+                case arg_tag::boolean:
+                case arg_tag::ch:
+                    a += 2;
+                    break;
+                case arg_tag::f32:
+                    a += 1 + sizeof(float);
+                    break;
+                case arg_tag::str:{
+                    const char* sp = a + 1;
+                    a += 1 + sizeof(uint32_t) + get<uint32_t>(sp);
+                    break;
+                }
+                default:
+                    a += 1 + sizeof(uint64_t);
+                    break;
+            }
+        }
+        
+        size_t next_arg = 0;
+        const char* p = f;
+        while(*p){
+            const char* b = p;
+            while(*p && *p != '{' && *p != '}')
+                ++p;
+            buf.append(b, p);
+            if(!*p)
+                break;
+            
+            if(p[0] == p[1]){
+                buf.push_back(*p);
+                p += 2;
+                continue;
+            }
+            const char* e = strchr(p, '}');
+            if(*p == '}' || !e){
+                buf.push_back(*p++);
+                continue;
+            }
+            
+            size_t idx = next_arg;
+            const char* q = p +1;
+            if(*q >= '0' && *q <= '9'){
+                idx = 0;
+                while(*q >= '0' && *q <= '9')
+                    idx = idx * 10 + (*q++ - '0');
+            }else
+                ++next_arg;
+            
+            char spec[64] = "{}";
+            if(*q == ':' && (size_t)(e - q) + 2 < sizeof(spec)){
+                spec[0] = '{';
+                memcpy(spec +1, q, e - q);
+                spec[e - q +1] = '}';
+                spec[e - q +2] = 0;
+            }
+            
+            bool formatted;
+            try{
+                formatted = idx < arg_count &&
+                    format_arg(buf, spec, offsets[idx]);
+            }catch(const fmt::format_error& err){
+                // the sink thread formatting the record must not throw.
+                buf.resize(start);
+                fmt::format_to(
+                    std::back_inserter(buf), "{} [format error: {}]",
+                    f, err.what()
+                );
+                return;
+            }
+            if(!formatted)
+                buf.append(p, e +1);
+            p = e +1;
+        }
+    }
+    
+    enum : uint32_t { no_path_id = 0xffffffff };
+    
+    /*!
+     * the logger paths, interned once for the life of the process. the
+     * strings are never moved or freed, their ids and views stay valid.
+     */
+    class path_table_t
+    {
+    public:
+        uint32_t intern(md::string_view path)
+        {
+            std::string p(path.data(), path.size());
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _ids.find(p);
+            if(it != _ids.end())
+                return it->second;
+            
+            uint32_t id = (uint32_t)_paths.size();
+            _paths.emplace_back(p);
+            _ids.emplace(std::move(p), id);
+            return id;
+        }
+        
+        const std::string& path(uint32_t id) const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _paths[id];
+        }
+        
+        size_t size() const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _paths.size();
+        }
+        
+    private:
+        mutable std::mutex _mutex;
+        std::deque<std::string> _paths;
+        std::unordered_map<std::string, uint32_t> _ids;
+    };
+    
+    /// never destroyed, the loggers can still log during the static cleanup.
+    inline path_table_t& paths()
+    {
+        static path_table_t* table = new path_table_t();
+        return *table;
+    }
+    
+    /*!
+     * the counters of one rate limited call site, updated without locks.
+     * the window is reset by the first call of a new second, the calls
+     * racing with the reset may be counted in either window.
+     */
+    struct rate_site_t
+    {
+        std::atomic<uintptr_t> key;
+        std::atomic<int64_t> window;
+        std::atomic<uint32_t> count;
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> suppressed;
+        
+        /*!
+         * true if the record can be logged, dropped is then the number
+         * of records suppressed since the last logged one.
+         */
+        bool allow(
+            uint32_t per_second, uint32_t sample, int64_t sec,
+            uint64_t& dropped)
+        {
+            if(sample > 1 &&
+                calls.fetch_add(1, std::memory_order_relaxed) % sample != 0
+            ){
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            
+            if(per_second > 0){
+                int64_t w = window.load(std::memory_order_relaxed);
+                if(w != sec && window.compare_exchange_strong(w, sec))
+                    count.store(0, std::memory_order_relaxed);
+                if(count.fetch_add(1, std::memory_order_relaxed) >= per_second){
+                    suppressed.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+            }
+            
+            dropped = suppressed.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+    };
+    
+    /*!
+     * the site of a format string, an open addressing table keyed by the
+     * format address. the sites past the table size share the last slot.
+     */
+    inline rate_site_t& rate_site(const char* f)
+    {
+        enum : size_t { table_size = 1024 };
+        // zero initialized, static storage.
+        static rate_site_t sites[table_size +1];
+        
+        uintptr_t key = (uintptr_t)f;
+        size_t h = (size_t)((key >> 3) * 0x9E3779B97F4A7C15ULL);
+        for(size_t i = 0; i < table_size; ++i){
+            auto& site = sites[(h + i) % table_size];
+            uintptr_t k = site.key.load(std::memory_order_acquire);
+            if(k == 0 && site.key.compare_exchange_strong(k, key))
+                return site;
+            // k holds the current key after a failed exchange.
+            if(k == key)
+                return site;
+        }
+        return sites[table_size];
+    }
+    
+} // ns: md::_internal
+
+/*!
+ * log record with its arguments encoded instead of formatted, the
+ * message is only formatted when a sink needs the text.
+ * 
+ * the encoded record layout:
+ *  - uint64_t format string address
+ *  - int64_t time since epoch in nanoseconds
+ *  - uint32_t path size
+ *  - uint32_t arguments size
+ *  - uint32_t interned path id
+ *  - uint8_t log_level
+ *  - path bytes
+ *  - arguments, a one byte tag followed by the value
+ */
+class deferred_record_t
+{
+public:
+    static const size_t header_size = 29;
+    
+    const char* fmt_str;
+    log_clock::time_point time;
+    log_level lvl;
+    md::string_view path;
+    /// the id of path in _internal::paths().
+    uint32_t path_id;
+    const char* args;
+    size_t args_size;
+    
+    /// the encoded record.
+    const char* data;
+    size_t size;
+    
+    void format_msg(fmt::memory_buffer& buf) const
+    {
+        _internal::format_deferred(buf, fmt_str, args, args_size);
+    }
+    
+    template<typename... Args>
+    static void encode(
+        fmt::memory_buffer& buf, const char* f, log_clock::time_point time,
+        log_level lvl, md::string_view path, uint32_t path_id,
+        const Args&... args)
+    {
+        _internal::put(buf, (uint64_t)(uintptr_t)f);
+        _internal::put(buf, (int64_t)
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                time.time_since_epoch()
+            ).count()
+        );
+        _internal::put(buf, (uint32_t)path.size());
+        size_t args_pos = buf.size();
+        _internal::put(buf, (uint32_t)0);
+        _internal::put(buf, path_id);
+        buf.push_back((char)lvl);
+        buf.append(path.data(), path.data() + path.size());
+        
+        size_t args_start = buf.size();
+        _internal::encode_args(buf, args...);
+        uint32_t args_size = (uint32_t)(buf.size() - args_start);
+        memcpy(buf.data() + args_pos, &args_size, sizeof(args_size));
+    }
+    
+    static bool decode(const char* data, size_t size, deferred_record_t& rec)
+    {
+        if(size < header_size)
+            return false;
+        
+        const char* p = data;
+        rec.fmt_str = (const char*)(uintptr_t)_internal::get<uint64_t>(p);
+        rec.time = log_clock::time_point(
+            std::chrono::duration_cast<log_clock::duration>(
+                std::chrono::nanoseconds(_internal::get<int64_t>(p))
+            )
+        );
+        uint32_t path_size = _internal::get<uint32_t>(p);
+        rec.args_size = _internal::get<uint32_t>(p);
+        rec.path_id = _internal::get<uint32_t>(p);
+        rec.lvl = (log_level)*p++;
+        if(header_size + path_size + rec.args_size > size)
+            return false;
+        
+        rec.path = md::string_view(p, path_size);
+        rec.args = p + path_size;
+        rec.data = data;
+        rec.size = header_size + path_size + rec.args_size;
+        return true;
+    }
+};
+
+/// the value types of a field_t.
+enum class field_type : uint8_t
+{
+    i64     = 1,
+    u64     = 2,
+    f64     = 3,
+    boolean = 4,
+    str     = 5,
+    other   = 6, // formatted with fmt by the sinks.
+};
+
+/*!
+ * a key and value of a structured record, the field refers to the key
+ * and the value given to kv, it is only valid during the log call.
+ */
+struct field_t
+{
+    md::string_view key;
+    field_type type;
+    union{
+        int64_t i64;
+        uint64_t u64;
+        double f64;
+        bool boolean;
+    };
+    md::string_view str;
+    const void* obj;
+    void (*format)(fmt::memory_buffer& buf, const void* obj);
+};
+
+/// the fields of a structured record.
+struct fields_t
+{
+    fields_t(): data(nullptr), size(0) {}
+    fields_t(const field_t* d, size_t sz): data(d), size(sz) {}
+    
+    const field_t* begin() const { return data;}
+    const field_t* end() const { return data + size;}
+    bool empty() const { return size == 0;}
+    
+    const field_t* data;
+    size_t size;
+};
+
+template<typename T>
+struct kv_t
+{
+    md::string_view key;
+    const T& val;
+};
+
+/*!
+ * a field of a structured record. when all the arguments of the logger_t
+ * level functions are fields the message is logged as is and the fields
+ * are written by the sinks in their layout, see logger_sink_t::set_layout.
+ * 
+ *	example:
+ *      log->info("request done",
+ *          md::log::kv("user", user_id), md::log::kv("ms", elapsed)
+ *      );
+ */
+template<typename T>
+inline kv_t<T> kv(md::string_view key, const T& val)
+{
+    return kv_t<T>{key, val};
+}
+
+namespace _internal{
+    
+    /*!
+     * how the value of a kv is kept by a field_t, the types without a
+     * specialization are formatted with fmt by the sinks.
+     */
+    template<typename T, typename Enable = void>
+    struct field_arg
+    {
+        static void set(field_t& f, const T& val)
+        {
+            f.type = field_type::other;
+            f.obj = &val;
+            f.format = [](fmt::memory_buffer& buf, const void* obj){
+                fmt::format_to(
+                    std::back_inserter(buf), "{}", *(const T*)obj
+                );
+            };
+        }
+    };
+    
+    template<typename T>
+    struct field_arg<T, typename std::enable_if<
+        std::is_integral<T>::value && std::is_signed<T>::value &&
+        !std::is_same<T, char>::value
+    >::type>
+    {
+        static void set(field_t& f, T val)
+        {
+            f.type = field_type::i64;
+            f.i64 = val;
+        }
+    };
+    
+    template<typename T>
+    struct field_arg<T, typename std::enable_if<
+        std::is_integral<T>::value && std::is_unsigned<T>::value &&
+        !std::is_same<T, bool>::value && !std::is_same<T, char>::value
+    >::type>
+    {
+        static void set(field_t& f, T val)
+        {
+            f.type = field_type::u64;
+            f.u64 = val;
+        }
+    };
+    
+    template<typename T>
+    struct field_arg<T, typename std::enable_if<
+        std::is_floating_point<T>::value
+    >::type>
+    {
+        static void set(field_t& f, T val)
+        {
+            f.type = field_type::f64;
+            f.f64 = (double)val;
+        }
+    };
+    
+    template<typename T>
+    struct field_arg<T, typename std::enable_if<
+        std::is_enum<T>::value
+    >::type>
+    {
+        static void set(field_t& f, T val)
+        {
+            typedef typename std::underlying_type<T>::type U;
+            field_arg<U>::set(f, (U)val);
+        }
+    };
+    
+    template<>
+    struct field_arg<bool>
+    {
+        static void set(field_t& f, bool val)
+        {
+            f.type = field_type::boolean;
+            f.boolean = val;
+        }
+    };
+    
+    template<>
+    struct field_arg<char>
+    {
+        static void set(field_t& f, const char& val)
+        {
+            f.type = field_type::str;
+            f.str = md::string_view(&val, 1);
+        }
+    };
+    
+    template<>
+    struct field_arg<const char*>
+    {
+        static void set(field_t& f, const char* val)
+        {
+            f.type = field_type::str;
+            f.str = val ? md::string_view(val) : md::string_view();
+        }
+    };
+    
+    template<>
+    struct field_arg<char*> : field_arg<const char*> {};
+    
+    template<size_t N>
+    struct field_arg<char[N]>
+    {
+        static void set(field_t& f, const char (&val)[N])
+        {
+            f.type = field_type::str;
+            f.str = md::string_view(val, strnlen(val, N));
+        }
+    };
+    
+    template<>
+    struct field_arg<std::string>
+    {
+        static void set(field_t& f, const std::string& val)
+        {
+            f.type = field_type::str;
+            f.str = md::string_view(val.data(), val.size());
+        }
+    };
+    
+    template<>
+    struct field_arg<md::string_view>
+    {
+        static void set(field_t& f, md::string_view val)
+        {
+            f.type = field_type::str;
+            f.str = val;
+        }
+    };
+    
+    template<typename T>
+    inline field_t make_field(const kv_t<T>& kv)
+    {
+        field_t f;
+        f.key = kv.key;
+        field_arg<T>::set(f, kv.val);
+        return f;
+    }
+    
+    template<typename T>
+    struct is_field : std::false_type {};
+    
+    template<typename T>
+    struct is_field<kv_t<T>> : std::true_type {};
+    
+    // at least one argument, all of them fields.
+    template<typename... T>
+    struct all_fields : std::false_type {};
+    
+    template<typename T>
+    struct all_fields<T> : is_field<T> {};
+    
+    template<typename T, typename U, typename... R>
+    struct all_fields<T, U, R...>
+        : std::integral_constant<bool,
+            is_field<T>::value && all_fields<U, R...>::value
+        >
+    {
+    };
+    
+    template<typename... T>
+    struct any_field : std::false_type {};
+    
+    template<typename T, typename... R>
+    struct any_field<T, R...>
+        : std::integral_constant<bool,
+            is_field<T>::value || any_field<R...>::value
+        >
+    {
+    };
+    
+    inline void append(fmt::memory_buffer& buf, md::string_view s)
+    {
+        buf.append(s.data(), s.data() + s.size());
+    }
+    
+    /*!
+     * the bytes of w matching c, or lower than n, have their high bit
+     * set in the result, a non zero result is exact, the 8 bytes are
+     * tested at once.
+     */
+    inline uint64_t swar_eq(uint64_t w, uint8_t c)
+    {
+        const uint64_t ones = 0x0101010101010101ULL;
+        uint64_t x = w ^ (ones * c);
+        return (x - ones) & ~x & (ones * 0x80);
+    }
+    
+    inline uint64_t swar_lt(uint64_t w, uint8_t n)
+    {
+        const uint64_t ones = 0x0101010101010101ULL;
+        return (w - ones * n) & ~w & (ones * 0x80);
+    }
+    
+    /*!
+     * append s to buf with the json string escapes. the bytes are tested
+     * 8 at a time and the runs without an escape are appended at once,
+     * the utf-8 sequences are kept as is.
+     */
+    inline void escape_json(fmt::memory_buffer& buf, md::string_view s)
+    {
+        static const char hex[] = "0123456789abcdef";
+        const char* p = s.data();
+        const char* pe = p + s.size();
+        const char* run = p;
+        while(p < pe){
+            for(uint64_t w; pe - p >= 8; p += 8){
+                memcpy(&w, p, sizeof(w));
+                if(swar_lt(w, 0x20) | swar_eq(w, '"') | swar_eq(w, '\\'))
+                    break;
+            }
+            if(p == pe)
+                break;
+            
+            unsigned char c = (unsigned char)*p;
+            if(c >= 0x20 && c != '"' && c != '\\'){
+                ++p;
+                continue;
+            }
+            
+            buf.append(run, p);
+            char esc[6] = {'\\', (char)c, 0, 0, 0, 0};
+            size_t sz = 2;
+            switch(c){
+                case '"': case '\\': break;
+                case '\n': esc[1] = 'n'; break;
+                case '\r': esc[1] = 'r'; break;
+                case '\t': esc[1] = 't'; break;
+                case '\b': esc[1] = 'b'; break;
+                case '\f': esc[1] = 'f'; break;
+                default:
+                    esc[1] = 'u';
+                    esc[2] = '0';
+                    esc[3] = '0';
+                    esc[4] = hex[c >> 4];
+                    esc[5] = hex[c & 0xf];
+                    sz = 6;
+                    break;
+            }
+            buf.append(esc, esc + sz);
+            run = ++p;
+        }
+        buf.append(run, pe);
+    }
+    
+    /// true if the logfmt value s must be quoted.
+    inline bool logfmt_quoted(md::string_view s)
+    {
+        if(s.empty())
+            return true;
+        const char* p = s.data();
+        const char* pe = p + s.size();
+        for(uint64_t w; pe - p >= 8; p += 8){
+            memcpy(&w, p, sizeof(w));
+            if(swar_lt(w, 0x21) | swar_eq(w, '=') |
+                swar_eq(w, '"') | swar_eq(w, '\\')
+            )
+                return true;
+        }
+        for(; p < pe; ++p)
+            if((unsigned char)*p < 0x21 || *p == '=' || *p == '"' || *p == '\\')
+                return true;
+        return false;
+    }
+    
+    inline void format_str(
+        fmt::memory_buffer& buf, md::string_view s, bool json)
+    {
+        bool quoted = json || logfmt_quoted(s);
+        if(quoted)
+            buf.push_back('"');
+        escape_json(buf, s);
+        if(quoted)
+            buf.push_back('"');
+    }
+    
+    inline void format_value(
+        fmt::memory_buffer& buf, const field_t& f, bool json)
+    {
+        auto out = std::back_inserter(buf);
+        switch(f.type){
+            case field_type::i64:
+                fmt::format_to(out, "{}", f.i64);
+                break;
+            case field_type::u64:
+                fmt::format_to(out, "{}", f.u64);
+                break;
+            case field_type::f64:
+                if(json && !std::isfinite(f.f64))
+                    append(buf, "null");
+                else
+                    fmt::format_to(out, "{}", f.f64);
+                break;
+            case field_type::boolean:
+                append(buf, f.boolean ? "true" : "false");
+                break;
+            case field_type::str:
+                format_str(buf, f.str, json);
+                break;
+            default:{
+                // only the types without a field_arg are formatted first.
+                thread_local fmt::memory_buffer val;
+                val.clear();
+                f.format(val, f.obj);
+                format_str(buf, md::string_view(val.data(), val.size()), json);
+                break;
+            }
+        }
+    }
+    
+    /// append the ' key=value' logfmt pairs of the fields.
+    inline void format_fields(fmt::memory_buffer& buf, const fields_t& fields)
+    {
+        for(auto& f : fields){
+            buf.push_back(' ');
+            append(buf, f.key);
+            buf.push_back('=');
+            format_value(buf, f, false);
+        }
+    }
+    
+    /// a json object on one line.
+    inline void format_json(
+        fmt::memory_buffer& buf, log_clock::time_point time,
+        md::string_view log_path, log_level lvl, md::string_view msg,
+        const fields_t& fields)
+    {
+        append(buf, "{\"time\":\"");
+        get_timestamp(buf, time);
+        append(buf, "\",\"level\":\"");
+        append(buf, to_string(lvl));
+        append(buf, "\",\"path\":\"");
+        escape_json(buf, log_path);
+        append(buf, "\",\"msg\":\"");
+        escape_json(buf, msg);
+        buf.push_back('"');
+        for(auto& f : fields){
+            append(buf, ",\"");
+            escape_json(buf, f.key);
+            append(buf, "\":");
+            format_value(buf, f, true);
+        }
+        append(buf, "}\n");
+    }
+    
+    /// a logfmt line.
+    inline void format_logfmt(
+        fmt::memory_buffer& buf, log_clock::time_point time,
+        md::string_view log_path, log_level lvl, md::string_view msg,
+        const fields_t& fields)
+    {
+        append(buf, "time=\"");
+        get_timestamp(buf, time);
+        append(buf, "\" level=");
+        append(buf, to_string(lvl));
+        append(buf, " path=");
+        format_str(buf, log_path, false);
+        append(buf, " msg=");
+        format_str(buf, msg, false);
+        format_fields(buf, fields);
+        buf.push_back('\n');
+    }
+    
+} // ns: md::_internal
+
+namespace sinks{
+    
+    /*!
+     * a snapshot of the counters of a sink. latency[i] counts the log
+     * calls of the sink, or the batches written by an async_sink, which
+     * took between 2^i and 2^(i+1) nanoseconds, the last bucket holds
+     * the longer ones. the latencies are only measured once enabled by
+     * logger_sink_t::set_timing.
+     */
+    struct sink_stats_t
+    {
+        enum : size_t { latency_buckets = 32 };
+        
+        uint64_t records;
+        uint64_t bytes;
+        uint64_t dropped;
+        uint64_t errors;
+        std::array<uint64_t, latency_buckets> latency;
+        
+        /*!
+         * the upper bound of the bucket holding the p quantile of the
+         * latencies, p in [0, 1].
+         * 
+         *	example:
+         *      auto p99 = snk->stats().percentile(0.99);
+         */
+        std::chrono::nanoseconds percentile(double p) const
+        {
+            uint64_t total = 0;
+            for(auto n : latency)
+                total += n;
+            if(total == 0)
+                return std::chrono::nanoseconds(0);
+            
+            uint64_t rank = (uint64_t)std::ceil(p * (double)total);
+            uint64_t seen = 0;
+            for(size_t i = 0; i < latency_buckets; ++i){
+                seen += latency[i];
+                if(seen >= rank && latency[i] > 0)
+                    return std::chrono::nanoseconds(
+                        i +1 < latency_buckets ? (int64_t)1 << (i +1) :
+                            std::numeric_limits<int64_t>::max()
+                    );
+            }
+            return std::chrono::nanoseconds(
+                std::numeric_limits<int64_t>::max()
+            );
+        }
+    };
+    
+} // ns: md::log::sinks
 
-enum class log_level
+/// a snapshot of the counters of a logger, see logger_t::snapshot.
+struct logger_stats_t
 {
-    off             = 0,
-    audit_failed    = 1,
-    audit_succeeded = 2,
-    fatal           = 3,
-    error           = 4,
-    warning         = 5,
-    info            = 6,
-    debug           = 7,
-    trace           = 8
+    std::string path;
+    // the records logged by the logger, indexed by log_level.
+    std::array<uint64_t, (size_t)log_level::trace +1> records;
+    // the sinks of the logger, only set on the first snapshot entry.
+    std::vector<sinks::sink_stats_t> sinks;
 };
 
-inline md::string_view to_string(log_level lvl)
+namespace _internal{
+    
+    /// the counters of a sink, updated by the sink and its callers.
+    class sink_counters_t
+    {
+    public:
+        sink_counters_t(): timed(false)
+        {
+            reset();
+        }
+        
+        void reset()
+        {
+            records = 0;
+            bytes = 0;
+            dropped = 0;
+            errors = 0;
+            for(auto& n : _latency)
+                n = 0;
+        }
+        
+        /// count n records written.
+        void add(size_t n)
+        {
+            records.fetch_add(n, std::memory_order_relaxed);
+        }
+        
+        /// count n records written in latency.
+        void add(size_t n, std::chrono::nanoseconds latency)
+        {
+            add(n);
+            uint64_t ns = (uint64_t)std::max(latency.count(), (int64_t)0);
+            size_t i = ns < 2 ? 0 : std::min(
+                (size_t)(63 - __builtin_clzll(ns)),
+                (size_t)sinks::sink_stats_t::latency_buckets -1
+            );
+            _latency[i].fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        sinks::sink_stats_t snapshot() const
+        {
+            sinks::sink_stats_t st;
+            st.records = records.load(std::memory_order_relaxed);
+            st.bytes = bytes.load(std::memory_order_relaxed);
+            st.dropped = dropped.load(std::memory_order_relaxed);
+            st.errors = errors.load(std::memory_order_relaxed);
+            for(size_t i = 0; i < st.latency.size(); ++i)
+                st.latency[i] = _latency[i].load(std::memory_order_relaxed);
+            return st;
+        }
+        
+        std::atomic<uint64_t> records;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> dropped;
+        std::atomic<uint64_t> errors;
+        // measure the latencies, two clock reads per log call.
+        std::atomic<bool> timed;
+        
+    private:
+        std::atomic<uint64_t> _latency[sinks::sink_stats_t::latency_buckets];
+    };
+    
+    /// the records logged per level by a logger.
+    class level_counters_t
+    {
+    public:
+        level_counters_t()
+        {
+            for(auto& n : _records)
+                n = 0;
+        }
+        
+        void add(log_level lvl)
+        {
+            size_t i = (size_t)lvl;
+            if(i < _records.size())
+                _records[i].fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        uint64_t get(size_t i) const
+        {
+            return _records[i].load(std::memory_order_relaxed);
+        }
+        
+    private:
+        std::array<std::atomic<uint64_t>, (size_t)log_level::trace +1> _records;
+    };
+    
+    /// count one log call of a sink, with its duration if timed.
+    class sink_timer_t
+    {
+    public:
+        sink_timer_t(sink_counters_t& counters)
+            : _counters(counters),
+            _timed(counters.timed.load(std::memory_order_relaxed))
+        {
+            if(_timed)
+                _start = std::chrono::steady_clock::now();
+        }
+        
+        ~sink_timer_t()
+        {
+            if(_timed)
+                _counters.add(1, std::chrono::steady_clock::now() - _start);
+            else
+                _counters.add(1);
+        }
+        
+    private:
+        sink_counters_t& _counters;
+        bool _timed;
+        std::chrono::steady_clock::time_point _start;
+    };
+    
+} // ns: md::_internal
+
+/*!
+ * what a sink does with a record when its writer can't keep up, the
+ * ring of an async_sink or the pending queue of a console_sink is full.
+ */
+enum class overflow_policy
 {
-    switch(lvl){
-        case log_level::audit_failed: return "AUDIT-FAILED";
-        case log_level::audit_succeeded: return "AUDIT-SUCCEEDED";
-        case log_level::fatal: return "FATAL";
-        case log_level::error: return "ERROR";
-        case log_level::warning: return "WARNING";
-        case log_level::info: return "INFO";
-        case log_level::debug: return "DEBUG";
-        case log_level::trace: return "TRACE";
-        case log_level::off: return "OFF";
-        default: return "N/A";
-    }
-}
+    block   = 0, // wait for the writer.
+    drop    = 1, // discard the record.
+    count   = 2, // discard the record and log how many were discarded.
+};
 
 namespace sinks{
     
     class logger_sink_t;
     typedef std::shared_ptr<logger_sink_t> logger_sink;
     
+    /// the layout of the records formatted by logger_sink_t::format.
+    enum class record_layout
+    {
+        text    = 0, // [time] [LEVEL:path] message key=value
+        json    = 1, // a json object per line.
+        logfmt  = 2, // time="..." level=LEVEL path=... msg=... key=value
+    };
+    
     class logger_sink_t
     {
     public:
         logger_sink_t(log_level lvl)
-            : _lvl(lvl), _flush_on_lvl(md::log::log_level::warning)
+            : _lvl(lvl), _flush_on_lvl(md::log::log_level::warning),
+            _layout(record_layout::text)
         {
         }
         
         bool should_log(log_level lvl) const
         {
-            return lvl <= _lvl;
+            return lvl <= _lvl.load(std::memory_order_relaxed);
+        }
+        
+        /*!
+         * the records, bytes, dropped records, write errors and log call
+         * latencies of the sink. the records and latencies are counted by
+         * the loggers calling the sink, the bytes, drops and errors by
+         * the sinks reporting them.
+         */
+        sink_stats_t stats() const
+        {
+            return _counters.snapshot();
+        }
+        
+        void reset_stats()
+        {
+            _counters.reset();
+        }
+        
+        /*!
+         * measure the latency of the log calls, off by default, the
+         * other counters are always updated.
+         * 
+         *	example:
+         *      snk->set_timing(true);
+         *      ...
+         *      auto p99 = snk->stats().percentile(0.99);
+         */
+        void set_timing(bool enable)
+        {
+            _counters.timed.store(enable, std::memory_order_relaxed);
+        }
+        bool timing() const
+        {
+            return _counters.timed.load(std::memory_order_relaxed);
+        }
+        
+        _internal::sink_counters_t& counters() const
+        {
+            return _counters;
         }
         
         virtual void log(
             md::string_view log_path, log_level lvl,
             md::string_view msg) const = 0;
         
-        void set_level(log_level lvl)
+        virtual void set_level(log_level lvl)
         {
-            _lvl = lvl;
+            _lvl.store(lvl, std::memory_order_relaxed);
         }
         
         log_level level() const
         {
-            return _lvl;
+            return _lvl.load(std::memory_order_relaxed);
         }
         
         virtual void flush() const {}
         
+        /*!
+         * append one record to buf, the async sinks format the records
+         * on the caller thread and hand them to write on their writer
+         * thread.
+         */
+        virtual void format(
+            fmt::memory_buffer& buf, log_clock::time_point time,
+            md::string_view log_path, log_level lvl, md::string_view msg) const
+        {
+            format_fields(buf, time, log_path, lvl, msg, fields_t());
+        }
+        
+        /// append one record with its fields to buf in the sink layout.
+        virtual void format_fields(
+            fmt::memory_buffer& buf, log_clock::time_point time,
+            md::string_view log_path, log_level lvl, md::string_view msg,
+            const fields_t& fields) const
+        {
+            switch(_layout){
+                case record_layout::json:
+                    _internal::format_json(
+                        buf, time, log_path, lvl, msg, fields
+                    );
+                    break;
+                case record_layout::logfmt:
+                    _internal::format_logfmt(
+                        buf, time, log_path, lvl, msg, fields
+                    );
+                    break;
+                default:
+                    buf.push_back('[');
+                    _internal::get_timestamp(buf, time);
+                    fmt::format_to(
+                        std::back_inserter(buf), "] [{}:{}] {}",
+                        to_string(lvl), log_path, msg
+                    );
+                    _internal::format_fields(buf, fields);
+                    buf.push_back('\n');
+                    break;
+            }
+        }
+        
+        /*!
+         * log a record of the kv fields, the default implementation
+         * appends the fields to the message and calls log.
+         */
+        virtual void log_fields(
+            md::string_view log_path, log_level lvl,
+            md::string_view msg, const fields_t& fields) const
+        {
+            fmt::memory_buffer buf;
+            _internal::append(buf, msg);
+            _internal::format_fields(buf, fields);
+            log(log_path, lvl, md::string_view(buf.data(), buf.size()));
+        }
+        
+        /*!
+         * log a record of logger_t::defer, the default implementation
+         * formats the message and calls log.
+         */
+        virtual void log_deferred(const deferred_record_t& rec) const
+        {
+            fmt::memory_buffer msg;
+            rec.format_msg(msg);
+            log(rec.path, rec.lvl, md::string_view(msg.data(), msg.size()));
+        }
+        
+        /*!
+         * append a record of logger_t::defer to buf, the default
+         * implementation formats the message and calls format.
+         */
+        virtual void format_deferred(
+            fmt::memory_buffer& buf, const deferred_record_t& rec) const
+        {
+            thread_local fmt::memory_buffer msg;
+            msg.clear();
+            rec.format_msg(msg);
+            format(
+                buf, rec.time, rec.path, rec.lvl,
+                md::string_view(msg.data(), msg.size())
+            );
+        }
+        
+        /// write iovcnt records formatted by format.
+        virtual void write(const struct iovec* /*iov*/, int /*iovcnt*/) const
+        {
+        }
+        
+        /// true when format and write can be used in place of log.
+        virtual bool can_write() const { return false;}
+        
         void flush_on(log_level lvl)
         {
             _flush_on_lvl = lvl;
         }
         
+        /*!
+         * the layout of format, set it before the sink is used.
+         * 
+         *	example:
+         *      snk->set_layout(md::log::sinks::record_layout::json);
+         */
+        void set_layout(record_layout layout)
+        {
+            _layout = layout;
+        }
+        
+        record_layout layout() const
+        {
+            return _layout;
+        }
+        
     protected:
-        log_level   _lvl;
+        // changed by the loggers while other threads log through them.
+        std::atomic<log_level> _lvl;
         log_level   _flush_on_lvl;
+        record_layout _layout;
+        mutable _internal::sink_counters_t _counters;
     };
 } // ns: md::log::sinks
 
-namespace _internal{
-    
-    static std::string get_timestamp();
-    
-} // ns: md::_internal
-
-
+/*!
+ * the children made by add_child log to the sinks of the root logger.
+ * each logger keeps the resolved sinks, level and err-stack flag of its
+ * ancestors, register_sink, replace_sink, set_level and log_err_stack
+ * update the descendants so a log call never walks the parent chain.
+ * a child keeps the level of its parent until set_level is called on
+ * it, reset_level makes it follow its parent again.
+ * 
+ * the children are added and the settings changed while other threads
+ * log, the resolved settings are atomic and the children list of each
+ * logger is guarded by its mutex, locked from the root down.
+ */
 class logger_t
     : public std::enable_shared_from_this<logger_t>,
     public sinks::logger_sink_t
 {
 private:
+    typedef std::vector<sinks::logger_sink> sinks_t;
     
     logger_t(const std::shared_ptr<const logger_t>& parent, md::string_view path)
-        : sinks::logger_sink_t(parent->_lvl),
+        : sinks::logger_sink_t(parent->level()),
         _parent(parent),
-        _path(path.data()),
-        _log_err_stack(-1)
+        _path_id(_internal::paths().intern(path)),
+        _path(&_internal::paths().path(_path_id)),
+        _out(std::atomic_load(&parent->_out)),
+        _own_lvl(false),
+        _log_err_stack(-1),
+        _err_stack(parent->log_err_stack())
     {
     }
     
 public:
 
     logger_t(md::string_view path, log_level lvl = log_level::info)
-        : sinks::logger_sink_t(lvl), _parent(), _path(path.data())
+        : sinks::logger_sink_t(lvl), _parent(),
+        _path_id(_internal::paths().intern(path)),
+        _path(&_internal::paths().path(_path_id)),
+        _out(std::make_shared<sinks_t>()),
+        _own_lvl(true), _log_err_stack(-1), _err_stack(false)
     {
     }
 
     logger_t(md::string_view path, md::log::sinks::logger_sink snk,
         log_level lvl = log_level::info)
-        : sinks::logger_sink_t(lvl), _parent(), _path(path.data()),
-        _sinks{snk}
+        : sinks::logger_sink_t(lvl), _parent(),
+        _path_id(_internal::paths().intern(path)),
+        _path(&_internal::paths().path(_path_id)),
+        _sinks{snk}, _out(std::make_shared<sinks_t>(_sinks)),
+        _own_lvl(true), _log_err_stack(-1), _err_stack(false)
     {
     }
     
     template<class IT>
     logger_t(md::string_view path, IT _begin, IT _end,
         log_level lvl = log_level::info)
-        : sinks::logger_sink_t(lvl), _parent(), _path(path.data()),
-        _sinks(_begin, _end)
+        : sinks::logger_sink_t(lvl), _parent(),
+        _path_id(_internal::paths().intern(path)),
+        _path(&_internal::paths().path(_path_id)),
+        _sinks(_begin, _end), _out(std::make_shared<sinks_t>(_sinks)),
+        _own_lvl(true), _log_err_stack(-1), _err_stack(false)
     {
     }
     
     bool is_child() const { return (bool)_parent;}
     
-    std::string path() const
+    /// the interned path, valid for the life of the process.
+    const std::string& path() const
+    {
+        return *_path;
+    }
+    
+    /// the id of the path in the interned paths table.
+    uint32_t path_id() const
     {
-        return _path;
+        return _path_id;
     }
     
     //logger add_child(const std::string& path) const
     logger add_child(md::string_view path) const
     {
+        const std::string& cp = *_path;
         std::string np;
-        if(_path[_path.size() -1] != '/' && path[0] != '/')
-            np = _path + "/" + path.to_string();
-        else if(_path[_path.size() -1] == '/' && path[0] == '/')
-            np = _path + path.to_string().substr(1);
+        if(cp[cp.size() -1] != '/' && path[0] != '/')
+            np = cp + "/" + path.to_string();
+        else if(cp[cp.size() -1] == '/' && path[0] == '/')
+            np = cp + path.to_string().substr(1);
         else
-            np = _path + path.to_string();
+            np = cp + path.to_string();
         
+        // the child copies the settings it registers to get the updates of.
         auto p = this->shared_from_this();
-        return logger(new logger_t(p, np.c_str()));
+        std::unique_lock<std::mutex> lock(_children_mutex);
+        auto child = logger(new logger_t(p, np));
+        _children.erase(
+            std::remove_if(_children.begin(), _children.end(),
+                [](const std::weak_ptr<logger_t>& c){ return c.expired();}
+            ),
+            _children.end()
+        );
+        _children.emplace_back(child);
+        return child;
     }
     
     void register_sink(md::log::sinks::logger_sink sink)
     {
         _sinks.emplace_back(sink);
+        if(!_parent){
+            std::atomic_store(
+                &_out, std::shared_ptr<const sinks_t>(
+                    std::make_shared<sinks_t>(_sinks)
+                )
+            );
+            _update_children();
+        }
     }
     
     void replace_sink(md::log::sinks::logger_sink sink)
@@ -194,24 +1621,38 @@ public:
             register_sink(sink);
     }
     
+    void set_level(log_level lvl)
+    {
+        _own_lvl = true;
+        sinks::logger_sink_t::set_level(lvl);
+        _update_children();
+    }
+    
+    /// follow the level of the parent logger again.
+    void reset_level()
+    {
+        if(!_parent)
+            return;
+        _own_lvl = false;
+        sinks::logger_sink_t::set_level(_parent->level());
+        _update_children();
+    }
+    
     bool log_err_stack() const
     {
-        if(_log_err_stack == 1)
-            return true;
-        else if(_log_err_stack == 0)
-            return false;
-        else if(this->_parent)
-            return this->_parent->log_err_stack();
-        
-        return false;
+        return _err_stack.load(std::memory_order_relaxed);
     }
     void reset_err_stack()
     {
         _log_err_stack = -1;
+        _err_stack = _parent ? _parent->log_err_stack() : false;
+        _update_children();
     }
     void log_err_stack(bool log_stack)
     {
         _log_err_stack = log_stack ? 1 : 0;
+        _err_stack = log_stack;
+        _update_children();
     }
     
     void log(
@@ -219,12 +1660,13 @@ public:
         log_level lvl,
         md::string_view msg) const
     {
-        if(this->_parent)
-            return this->_parent->log(log_path, lvl, msg);
-        
-        for(auto& sink : _sinks){
-            if(sink->should_log(lvl))
+        _records.add(lvl);
+        auto out = std::atomic_load(&_out);
+        for(auto& sink : *out){
+            if(sink->should_log(lvl)){
+                _internal::sink_timer_t timer(sink->counters());
                 sink->log(log_path, lvl, msg);
+            }
         }
     }
     
@@ -233,196 +1675,715 @@ public:
         log_level lvl,
         md::callback::cb_error err) const
     {
-        std::string log_val = err.c_str();
-        if(err.has_stack() && log_err_stack())
-            log_val += fmt::format(
-                "\n\nAdditional info\n\n{}:{}\n{}\n\n{}\n",
-                err.file(), err.line(), err.func(), err.stack()
-            );
-        log(log_path, lvl, log_val);
+        if(!err.has_stack() || !log_err_stack())
+            return log(log_path, lvl, err.c_str());
+        
+        log_fmt(log_path, lvl,
+            "{}\n\nAdditional info\n\n{}:{}\n{}\n\n{}\n",
+            err.c_str(), err.file(), err.line(), err.func(), err.stack()
+        );
+    }
+    
+    /*!
+     * format the message in a stack buffer and log it, the messages
+     * shorter than the fmt::memory_buffer inline size don't allocate.
+     * when args are md::log::kv fields f is logged as is with them.
+     */
+    template<typename... Args>
+    void log_fmt(
+        md::string_view log_path, log_level lvl,
+        md::string_view f, const Args&... args) const
+    {
+        _log_fmt(_internal::all_fields<Args...>(), log_path, lvl, f, args...);
+    }
+    
+    void log_fields(
+        md::string_view log_path, log_level lvl,
+        md::string_view msg, const fields_t& fields) const
+    {
+        _records.add(lvl);
+        auto out = std::atomic_load(&_out);
+        for(auto& sink : *out){
+            if(sink->should_log(lvl)){
+                _internal::sink_timer_t timer(sink->counters());
+                sink->log_fields(log_path, lvl, msg, fields);
+            }
+        }
+    }
+    
+    void log_deferred(const deferred_record_t& rec) const
+    {
+        _records.add(rec.lvl);
+        auto out = std::atomic_load(&_out);
+        for(auto& sink : *out){
+            if(sink->should_log(rec.lvl)){
+                _internal::sink_timer_t timer(sink->counters());
+                sink->log_deferred(rec);
+            }
+        }
+    }
+    
+    /*!
+     * the counters of the logger and of its descendants, depth first.
+     * the first entry also holds the stats of the sinks they write to.
+     * 
+     *	example:
+     *      for(auto& st : md::log::default_logger()->snapshot())
+     *          std::cout << st.path << ": " <<
+     *              st.records[(size_t)md::log::log_level::error] <<
+     *              " errors" << std::endl;
+     */
+    std::vector<logger_stats_t> snapshot() const
+    {
+        std::vector<logger_stats_t> out;
+        _snapshot(out);
+        auto sinks = std::atomic_load(&_out);
+        for(auto& sink : *sinks)
+            out[0].sinks.emplace_back(sink->stats());
+        return out;
+    }
+    
+    /*!
+     * the arguments are copied in a binary record and formatted later
+     * by the sinks, an async_sink formats them on its writer thread.
+     * f must be a string literal, only its address is kept. the call
+     * falls back to an immediate format if an argument type can't be
+     * deferred.
+     * 
+     *	example:
+     *      log->defer(md::log::log_level::debug, "read {} bytes in {}us",
+     *          sz, elapsed
+     *      );
+     */
+    template<size_t N, typename... Args>
+    void defer(log_level lvl, const char (&f)[N], const Args&... args) const
+    {
+        if(should_log(lvl))
+            _defer(_internal::all_deferred<Args...>(), lvl, f, args...);
     }
     
     void flush() const
     {
-        if(this->_parent)
-            this->_parent->flush();
-        
-        for(auto& sink : _sinks)
+        auto out = std::atomic_load(&_out);
+        for(auto& sink : *out)
             sink->flush();
+        
+        if(this->_parent)
+            for(auto& sink : _sinks)
+                sink->flush();
     }
     
     void trace(md::string_view f) const
     {
         if(should_log(log_level::trace))
-            log(_path, log_level::trace, f);
+            log(*_path, log_level::trace, f);
     }
     template <typename... Args>
     void trace(md::string_view f, const Args&... args) const
     {
         if(should_log(log_level::trace))
-            log(_path, log_level::trace, fmt::format(f.data(), args...));
+            log_fmt(*_path, log_level::trace, f, args...);
     }
     void trace(md::callback::cb_error err)
     {
         if(should_log(log_level::trace))
-            log(_path, log_level::trace, err);
+            log(*_path, log_level::trace, err);
     }
     
     void debug(md::string_view f) const
     {
         if(should_log(log_level::debug))
-            log(_path, log_level::debug, f);
+            log(*_path, log_level::debug, f);
     }
     template <typename... Args>
     void debug(md::string_view f, const Args&... args) const
     {
         if(should_log(log_level::debug))
-            log(_path, log_level::debug, fmt::format(f.data(), args...));
+            log_fmt(*_path, log_level::debug, f, args...);
     }
     void debug(md::callback::cb_error err)
     {
         if(should_log(log_level::debug))
-            log(_path, log_level::debug, err);
+            log(*_path, log_level::debug, err);
     }
     
     void info(md::string_view f) const
     {
         if(should_log(log_level::info))
-            log(_path, log_level::info, f);
+            log(*_path, log_level::info, f);
     }
     template <typename... Args>
     void info(md::string_view f, const Args&... args) const
     {
         if(should_log(log_level::info))
-            log(_path, log_level::info, fmt::format(f.data(), args...));
+            log_fmt(*_path, log_level::info, f, args...);
     }
     void info(md::callback::cb_error err)
     {
         if(should_log(log_level::info))
-            log(_path, log_level::info, err);
+            log(*_path, log_level::info, err);
     }
     
     void warn(md::string_view f) const
     {
         if(should_log(log_level::warning))
-            log(_path, log_level::warning, f);
+            log(*_path, log_level::warning, f);
     }
     template <typename... Args>
     void warn(md::string_view f, const Args&... args) const
     {
         if(should_log(log_level::warning))
-            log(_path, log_level::warning, fmt::format(f.data(), args...));
+            log_fmt(*_path, log_level::warning, f, args...);
     }
     void warn(md::callback::cb_error err)
     {
         if(should_log(log_level::warning))
-            log(_path, log_level::warning, err);
+            log(*_path, log_level::warning, err);
     }
     
     void error(md::string_view f) const
     {
         if(should_log(log_level::error))
-            log(_path, log_level::error, f);
+            log(*_path, log_level::error, f);
     }
     template <typename... Args>
     void error(md::string_view f, const Args&... args) const
     {
         if(should_log(log_level::error))
-            log(_path, log_level::error, fmt::format(f.data(), args...));
+            log_fmt(*_path, log_level::error, f, args...);
     }
     void error(md::callback::cb_error err)
     {
         if(should_log(log_level::error))
-            log(_path, log_level::error, err);
+            log(*_path, log_level::error, err);
     }
     
     void fatal(md::string_view f) const
     {
         if(should_log(log_level::fatal))
-            log(_path, log_level::fatal, f);
+            log(*_path, log_level::fatal, f);
     }
     template <typename... Args>
     void fatal(md::string_view f, const Args&... args) const
     {
         if(should_log(log_level::fatal))
-            log(_path, log_level::fatal, fmt::format(f.data(), args...));
+            log_fmt(*_path, log_level::fatal, f, args...);
         
         std::exit(-1);
     }
     void fatal(md::callback::cb_error err)
     {
         if(should_log(log_level::fatal))
-            log(_path, log_level::fatal, err);
+            log(*_path, log_level::fatal, err);
     }
     
     void success(md::string_view f) const
     {
         if(should_log(log_level::audit_succeeded))
-            log(_path, log_level::audit_succeeded, f);
+            log(*_path, log_level::audit_succeeded, f);
     }
     template <typename... Args>
     void success(md::string_view f, const Args&... args) const
     {
         if(should_log(log_level::audit_succeeded))
-            log(
-                _path, log_level::audit_succeeded,
-                fmt::format(f.data(), args...)
-            );
+            log_fmt(*_path, log_level::audit_succeeded, f, args...);
     }
     void success(md::callback::cb_error err)
     {
         if(should_log(log_level::audit_succeeded))
-            log(_path, log_level::audit_succeeded, err);
+            log(*_path, log_level::audit_succeeded, err);
     }
 
     void fail(md::string_view f) const
     {
         if(should_log(log_level::audit_failed))
-            log(_path, log_level::audit_failed, f);
+            log(*_path, log_level::audit_failed, f);
+    }
+    template <typename... Args>
+    void fail(md::string_view f, const Args&... args) const
+    {
+        if(should_log(log_level::audit_failed))
+            log_fmt(*_path, log_level::audit_failed, f, args...);
+    }
+    void fail(md::callback::cb_error err)
+    {
+        if(should_log(log_level::audit_failed))
+            log(*_path, log_level::audit_failed, err);
+    }
+    
+    /// the limits of logger_t::limit, 0 or 1 disables a limit.
+    struct rate_limit_t
+    {
+        rate_limit_t(uint32_t ps = 0, uint32_t s = 1)
+            : per_second(ps), sample(s)
+        {
+        }
+        
+        uint32_t per_second;
+        uint32_t sample;
+    };
+    
+    /*!
+     * log at most per_second records per second from the call site of f,
+     * and only one call out of sample. the number of suppressed records
+     * is logged before the next record of the site. the sites are keyed
+     * by the address of f, which must be a string literal.
+     * 
+     *	example:
+     *      // up to 10 records per second.
+     *      log->limit(md::log::log_level::error, {10}, "io error: {}", err);
+     *      // one call out of 100.
+     *      log->limit(md::log::log_level::debug, {0, 100}, "got {}", id);
+     */
+    template<size_t N, typename... Args>
+    void limit(
+        log_level lvl, const rate_limit_t& rl,
+        const char (&f)[N], const Args&... args) const
+    {
+        if(!should_log(lvl))
+            return;
+        
+        int64_t sec = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+        uint64_t dropped = 0;
+        auto& site = _internal::rate_site(f);
+        if(!site.allow(rl.per_second, rl.sample, sec, dropped))
+            return;
+        
+        if(dropped > 0)
+            log_fmt(*_path, lvl,
+                "suppressed {} messages like \"{}\"", dropped, f
+            );
+        _defer(_internal::all_deferred<Args...>(), lvl, f, args...);
+    }
+    
+private:
+    template<typename... Args>
+    void _log_fmt(
+        std::false_type, md::string_view log_path, log_level lvl,
+        md::string_view f, const Args&... args) const
+    {
+        static_assert(!_internal::any_field<Args...>::value,
+            "the kv fields can't be mixed with format arguments"
+        );
+        fmt::memory_buffer buf;
+        fmt::format_to(std::back_inserter(buf), f.data(), args...);
+        log(log_path, lvl, md::string_view(buf.data(), buf.size()));
+    }
+    
+    // a structured record, msg is not a format string.
+    template<typename... Args>
+    void _log_fmt(
+        std::true_type, md::string_view log_path, log_level lvl,
+        md::string_view msg, const Args&... args) const
+    {
+        field_t fields[] = {_internal::make_field(args)...};
+        log_fields(log_path, lvl, msg, fields_t(fields, sizeof...(Args)));
+    }
+    
+    template<typename... Args>
+    void _defer(
+        std::true_type, log_level lvl, const char* f,
+        const Args&... args) const
+    {
+        thread_local fmt::memory_buffer buf;
+        buf.clear();
+        deferred_record_t::encode(
+            buf, f, log_clock::now(), lvl, *_path, _path_id, args...
+        );
+        deferred_record_t rec;
+        deferred_record_t::decode(buf.data(), buf.size(), rec);
+        log_deferred(rec);
     }
-    template <typename... Args>
-    void fail(md::string_view f, const Args&... args) const
+    
+    template<typename... Args>
+    void _defer(
+        std::false_type, log_level lvl, const char* f,
+        const Args&... args) const
     {
-        if(should_log(log_level::audit_failed))
-            log(_path, log_level::audit_failed, fmt::format(f.data(), args...));
+        log_fmt(*_path, lvl, f, args...);
     }
-    void fail(md::callback::cb_error err)
+    
+    void _snapshot(std::vector<logger_stats_t>& out) const
     {
-        if(should_log(log_level::audit_failed))
-            log(_path, log_level::audit_failed, err);
+        logger_stats_t st;
+        st.path = *_path;
+        for(size_t i = 0; i < st.records.size(); ++i)
+            st.records[i] = _records.get(i);
+        out.emplace_back(std::move(st));
+        
+        std::unique_lock<std::mutex> lock(_children_mutex);
+        for(auto& wc : _children)
+            if(auto c = wc.lock())
+                c->_snapshot(out);
     }
     
-private:
+    // copy the resolved state of this logger to its descendants.
+    void _update_children()
+    {
+        std::unique_lock<std::mutex> lock(_children_mutex);
+        for(auto& wc : _children){
+            auto c = wc.lock();
+            if(!c)
+                continue;
+            std::atomic_store(&c->_out, std::atomic_load(&_out));
+            if(!c->_own_lvl)
+                c->sinks::logger_sink_t::set_level(level());
+            if(c->_log_err_stack == -1)
+                c->_err_stack = log_err_stack();
+            c->_update_children();
+        }
+    }
     
     std::shared_ptr<const logger_t>       _parent;
-    std::string                         _path;
-    std::vector<sinks::logger_sink>  _sinks;
-    int32_t                             _log_err_stack;
+    uint32_t                            _path_id;
+    const std::string*                  _path;
+    sinks_t                             _sinks;
+    // the sinks of the root logger, shared by all its descendants. it is
+    // replaced while the loggers log, std::atomic_load/store.
+    std::shared_ptr<const sinks_t>      _out;
+    mutable std::mutex                  _children_mutex;
+    mutable std::vector<std::weak_ptr<logger_t>> _children;
+    std::atomic<bool>                   _own_lvl;
+    std::atomic<int32_t>                _log_err_stack;
+    std::atomic<bool>                   _err_stack;
+    mutable _internal::level_counters_t _records;
 
 };
 
 namespace sinks{
+    
+    /*!
+     * write the records to stderr, each record is assembled in one
+     * buffer and written by a single call.
+     * 
+     * a pipe or a terminal is written through a non-blocking descriptor
+     * of its own. the records a slow reader can't take are queued, up to
+     * max_pending bytes, and written in writev batches by the next
+     * records or by a thread of the sink, started the first time stderr
+     * is full. the policy tells what happens to the records once the
+     * queue is full, overflow_policy::block waits for the queue.
+     * 
+     *	example:
+     *      auto snk = std::make_shared<md::log::sinks::console_sink>(
+     *          false, 256 * 1024, md::log::overflow_policy::count
+     *      );
+     */
     class console_sink
         : public logger_sink_t
     {
     public:
-        console_sink(bool enable_color)
-            : logger_sink_t(log_level::info), color(enable_color)
+        console_sink(
+            bool enable_color, size_t max_pending = 1024 * 1024,
+            overflow_policy policy = overflow_policy::block)
+            : logger_sink_t(log_level::info), color(enable_color),
+            _fd(STDERR_FILENO), _own_fd(false),
+            _max_pending(max_pending), _policy(policy),
+            _pending(0), _front_off(0), _dropped(0), _reported(0),
+            _stop(false)
+        {
+            // O_NONBLOCK is shared by the descriptors of an open file,
+            // the file is opened again to keep stderr as it is.
+            struct stat sb;
+            if(fstat(STDERR_FILENO, &sb) == 0 &&
+                (S_ISFIFO(sb.st_mode) || S_ISCHR(sb.st_mode))
+            ){
+                int fd = open(
+                    "/proc/self/fd/2",
+                    O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC
+                );
+                if(fd > -1){
+                    _fd = fd;
+                    _own_fd = true;
+                }
+            }
+        }
+        
+        ~console_sink()
         {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+                _cv.notify_all();
+            }
+            if(_drainer.joinable())
+                _drainer.join();
+            if(_own_fd)
+                close(_fd);
         }
         
         void log(
             md::string_view log_path,
             log_level lvl, md::string_view msg) const
         {
-            std::clog <<
-                _gen_header(color, log_path, lvl) <<
-                md::replace_substring_copy(msg.to_string(), "\n", "\n  ")
-                << _gen_footer(color, lvl) << "\n";
+            log_fields(log_path, lvl, msg, fields_t());
+        }
+        
+        void log_fields(
+            md::string_view log_path, log_level lvl,
+            md::string_view msg, const fields_t& fields) const
+        {
+            thread_local fmt::memory_buffer buf;
+            buf.clear();
+            format_fields(buf, log_clock::now(), log_path, lvl, msg, fields);
+            struct iovec iov = {buf.data(), buf.size()};
+            write(&iov, 1);
+        }
+        
+        /// the text layout is a block with a header and a footer.
+        void format_fields(
+            fmt::memory_buffer& buf, log_clock::time_point time,
+            md::string_view log_path, log_level lvl, md::string_view msg,
+            const fields_t& fields) const
+        {
+            if(_layout != record_layout::text)
+                return logger_sink_t::format_fields(
+                    buf, time, log_path, lvl, msg, fields
+                );
+            
+            auto out = std::back_inserter(buf);
+            if(color)
+                fmt::format_to(out, "\x1b[{}m", _level_color(lvl));
+            buf.push_back('[');
+            _internal::get_timestamp(buf, time);
+            fmt::format_to(out, "] [{}:{}]", to_string(lvl), log_path);
+            if(color)
+                fmt::format_to(out, "\x1b[0m");
+            buf.push_back('\n');
+            
+            // indent the following lines of the message.
+            static const char line_sep[] = "\n  ";
+            size_t b = 0, e;
+            while((e = msg.find('\n', b)) != md::string_view::npos){
+                buf.append(msg.data() + b, msg.data() + e);
+                buf.append(line_sep, line_sep + 3);
+                b = e +1;
+            }
+            buf.append(msg.data() + b, msg.data() + msg.size());
+            _internal::format_fields(buf, fields);
+            
+            static const md::string_view footer =
+                "\n¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯";
+            if(color)
+                fmt::format_to(out, "\n\x1b[{}m{}\x1b[0m\n",
+                    _level_color(lvl), footer.substr(1)
+                );
+            else{
+                buf.append(footer.data(), footer.data() + footer.size());
+                buf.push_back('\n');
+            }
+        }
+        
+        /*!
+         * write the records, each iovec is a record, the records which
+         * can't be written now are queued.
+         */
+        void write(const struct iovec* iov, int iovcnt) const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if(!_queue.empty())
+                _drain();
+            if(_queue.empty()){
+                ssize_t sz = _writev(iov, iovcnt);
+                if(sz < 0)
+                    return;
+                
+                // the rest of a record partially written is always kept.
+                for(; iovcnt > 0 && (size_t)sz >= iov->iov_len; ++iov, --iovcnt)
+                    sz -= iov->iov_len;
+                if(iovcnt == 0)
+                    return;
+                if(sz > 0){
+                    _enqueue(md::string_view(
+                        (const char*)iov->iov_base + sz, iov->iov_len - sz
+                    ));
+                    ++iov;
+                    --iovcnt;
+                }
+            }
+            
+            for(; iovcnt > 0; ++iov, --iovcnt){
+                md::string_view rec((const char*)iov->iov_base, iov->iov_len);
+                if(!_reserve(lock, rec.size()))
+                    continue;
+                _enqueue(rec);
+            }
+        }
+        
+        bool can_write() const { return true;}
+        
+        /// wait for the queued records to be written.
+        void flush() const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while(!_queue.empty()){
+                lock.unlock();
+                md::files::wait_writable(_fd);
+                lock.lock();
+                _drain();
+            }
+        }
+        
+        /// the number of records discarded by the overflow policy.
+        size_t dropped() const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _dropped;
+        }
+        
+        /// the bytes waiting to be written.
+        size_t pending() const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _pending;
         }
         
         bool color;
     private:
+        static const int max_batch = 64;
+        
+        ssize_t _writev(const struct iovec* iov, int iovcnt) const
+        {
+            ssize_t sz;
+            while((sz = ::writev(_fd, iov, std::min(iovcnt, IOV_MAX))) < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                if(errno != EINTR){
+                    ++_counters.errors;
+                    return -1;
+                }
+            }
+            _counters.bytes.fetch_add((uint64_t)sz, std::memory_order_relaxed);
+            return sz;
+        }
+        
+        /*!
+         * write the queue in writev batches until stderr is full, called
+         * with _mutex locked. a closed stderr discards the queue.
+         */
+        void _drain() const
+        {
+            struct iovec iov[max_batch];
+            while(!_queue.empty()){
+                int n = 0;
+                for(auto it = _queue.begin();
+                    it != _queue.end() && n < max_batch; ++it, ++n
+                ){
+                    size_t off = n == 0 ? _front_off : 0;
+                    iov[n].iov_base = (void*)(it->data() + off);
+                    iov[n].iov_len = it->size() - off;
+                }
+                
+                ssize_t sz = _writev(iov, n);
+                if(sz < 0){
+                    _counters.dropped += _queue.size();
+                    _queue.clear();
+                    _pending = 0;
+                    _front_off = 0;
+                    break;
+                }
+                if(sz == 0)
+                    break;
+                
+                _pending -= (size_t)sz;
+                while(sz > 0){
+                    size_t left = _queue.front().size() - _front_off;
+                    if((size_t)sz < left){
+                        _front_off += (size_t)sz;
+                        break;
+                    }
+                    sz -= (ssize_t)left;
+                    _queue.pop_front();
+                    _front_off = 0;
+                }
+            }
+            
+            if(_queue.empty() && _dropped != _reported){
+                size_t dropped = _dropped - _reported;
+                _reported = _dropped;
+                if(_policy == overflow_policy::count){
+                    fmt::memory_buffer buf;
+                    format(buf, log_clock::now(), "/", log_level::warning,
+                        fmt::format("{} log records were dropped", dropped)
+                    );
+                    _enqueue(md::string_view(buf.data(), buf.size()));
+                    _drain();
+                }
+            }
+            _cv.notify_all();
+        }
+        
+        /*!
+         * make room for sz bytes in the queue, called with _mutex locked,
+         * false if the record is discarded.
+         */
+        bool _reserve(std::unique_lock<std::mutex>& lock, size_t sz) const
+        {
+            // a record larger than the queue is taken by an empty queue.
+            while(!_queue.empty() && _pending + sz > _max_pending){
+                if(_policy != overflow_policy::block){
+                    ++_dropped;
+                    ++_counters.dropped;
+                    return false;
+                }
+                _start_drainer();
+                _cv.wait(lock);
+            }
+            return true;
+        }
+        
+        void _enqueue(md::string_view rec) const
+        {
+            _queue.emplace_back(rec.data(), rec.size());
+            _pending += rec.size();
+            _start_drainer();
+            _cv.notify_all();
+        }
+        
+        void _start_drainer() const
+        {
+            if(!_drainer.joinable())
+                _drainer = std::thread(&console_sink::_run, this);
+        }
+        
+        /// the thread writing the queue once stderr accepts more data.
+        void _run() const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            int idle = 0;
+            while(!_stop || (!_queue.empty() && idle < 10)){
+                if(_queue.empty()){
+                    _cv.wait(lock);
+                    continue;
+                }
+                
+                lock.unlock();
+                struct pollfd pfd = {_fd, POLLOUT, 0};
+                int ready = poll(&pfd, 1, 100);
+                lock.lock();
+                size_t pending = _pending;
+                _drain();
+                // the destructor waits up to a second for a stuck reader.
+                idle = ready > 0 || _pending < pending ? 0 : idle +1;
+            }
+        }
+        
+        int _fd;
+        bool _own_fd;
+        size_t _max_pending;
+        overflow_policy _policy;
+        mutable std::mutex _mutex;
+        mutable std::condition_variable _cv;
+        mutable std::thread _drainer;
+        // the state below is guarded by _mutex.
+        mutable std::deque<std::string> _queue;
+        mutable size_t _pending;
+        // the bytes of the queue front already written.
+        mutable size_t _front_off;
+        mutable size_t _dropped;
+        mutable size_t _reported;
+        bool _stop;
         
         static md::string_view _level_color(log_level lvl)
         {
@@ -447,139 +2408,459 @@ namespace sinks{
                     return "37";
             }
         }
-        
-        static std::string _gen_header(
-            bool color, md::string_view log_path, log_level lvl)
-        {
-            if(color)
-                return fmt::format(
-                    "\x1b[{}m[{}] [{}:{}]\x1b[0m\n",
-                    _level_color(lvl).data(),
-                    _internal::get_timestamp(),
-                    to_string(lvl).data(),
-                    log_path.to_string()
-                );
-            else
-                return fmt::format(
-                    "[{}] [{}:{}]\n",
-                    _internal::get_timestamp(),
-                    to_string(lvl).data(),
-                    log_path.to_string()
-                );
-        }
-        
-        static std::string _gen_footer(bool color, log_level lvl)
-        {
-            if(color)
-                return fmt::format(
-                    "\n\x1b[{}m¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯\x1b[0m",
-                    _level_color(lvl).data()
-                );
-            else
-                return "\n¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯";
-        }
     };
     
+    /// the time based rotations of rotating_file_sink.
+    enum class rotation_schedule
+    {
+        none    = 0,
+        hourly  = 1, // at the start of each hour.
+        daily   = 2, // at local midnight.
+    };
+    
+    /*!
+     * when rotating_file_sink syncs the records to disk, a sync covers
+     * everything written before it so the writers waiting for one share
+     * a single fdatasync.
+     */
+    enum class sync_mode
+    {
+        none            = 0, // left to the kernel and flush.
+        periodic        = 1, // every interval when records were written.
+        group_commit    = 2, // each record, the concurrent writers share a sync.
+        per_level       = 3, // the records at or above the flush_on level.
+    };
+    
+    /*!
+     * append the records to base_filename and rotate it when it grows past
+     * max_size or on the schedule, keeping backlog_size files, the oldest
+     * half compressed.
+     * 
+     * the sink counts the bytes it writes, the size and the schedule are
+     * checked by the writes. with watch_file the file is also watched
+     * with inotify on ev_base to catch an external truncation, removal or
+     * rename, md::error is thrown if ev_base is null. ev_base can be null
+     * otherwise.
+     * 
+     * the rotation only renames the file and swaps the descriptor, the
+     * writers keep using the previous descriptor until they are done
+     * with it. the backlog is renamed and compressed in order on the
+     * background file thread of md::files::async_job.
+     * 
+     * the records are not synced to disk by default, see set_sync.
+     * 
+     *	example:
+     *      auto snk = std::make_shared<md::log::sinks::rotating_file_sink>(
+     *          nullptr, "/var/log/app.log", 100 * 1024 * 1024, 10,
+     *          md::log::sinks::rotation_schedule::daily
+     *      );
+     *      snk->flush_on(md::log::log_level::error);
+     *      snk->set_sync(md::log::sinks::sync_mode::per_level);
+     */
     class rotating_file_sink
         : public logger_sink_t
     {
     public:
+        //! seconds before a failed rotation is attempted again.
+        static const int rotation_retry_delay = 10;
+        
         rotating_file_sink(
             event_base* ev_base,
             bfs::path base_filename,
-            size_t max_size, size_t backlog_size)
+            size_t max_size, size_t backlog_size,
+            rotation_schedule schedule = rotation_schedule::none,
+            bool watch_file = false)
             : logger_sink_t(log_level::info),
             _ev_base(ev_base),
-            _ifd(-1), _wfd(-1), _fd(-1), _wev(nullptr),
+            _ifd(-1), _wfd(-1), _wev(nullptr),
             _base_filename(base_filename),
             _max_size(max_size),
             _backlog_size(backlog_size),
-            _rotating(false)
+            _schedule(schedule),
+            _rotating(false),
+            _rotations(0),
+            _size(0),
+            _next_rotation(0),
+            _retry_rotation(0),
+            _sync_mode(sync_mode::none),
+            _sync_interval(0),
+            _sync_stop(false),
+            _dirty(false),
+            _syncs(0)
         {
+            if(watch_file && !ev_base)
+                throw MD_ERR("watch_file requires an event_base!");
+            
             _open_log();
+            _next_rotation = _next_rotation_time();
+            if(watch_file)
+                _notify_start();
         }
         
         ~rotating_file_sink()
         {
             if(_ifd > -1){
-                close(_ifd);
+                _notify_close();
             }
             
-            if(_fd > -1){
-                flush();
-                close(_fd);
-            }
+            _stop_sync_thread();
+            flush();
         }
         
         void log(
             md::string_view log_path,
             log_level lvl, md::string_view msg) const
         {
-            if(_fd < 0)
+            log_fields(log_path, lvl, msg, fields_t());
+        }
+        
+        void log_fields(
+            md::string_view log_path, log_level lvl,
+            md::string_view msg, const fields_t& fields) const
+        {
+            thread_local fmt::memory_buffer buf;
+            buf.clear();
+            format_fields(buf, log_clock::now(), log_path, lvl, msg, fields);
+            
+            auto f = _before_write();
+            if(f->fd < 0 ||
+                md::files::writen(f->fd, buf.data(), buf.size()) < 0
+            ){
+                ++_counters.errors;
+                return;
+            }
+            _after_write(buf.size());
+            
+            if(_sync_mode == sync_mode::group_commit ||
+                (_sync_mode == sync_mode::per_level && lvl <= _flush_on_lvl)
+            )
+                f->commit(_syncs);
+        }
+        
+        /*!
+         * the batches of the async sinks are only committed by
+         * sync_mode::group_commit, their records have no level here.
+         */
+        void write(const struct iovec* iov, int iovcnt) const
+        {
+            auto f = _before_write();
+            ssize_t sz = -1;
+            if(f->fd > -1)
+                sz = md::files::writevn(f->fd, iov, iovcnt);
+            if(sz < 0){
+                ++_counters.errors;
                 return;
+            }
+            _after_write((size_t)sz);
             
-            std::string log_str =
-                _gen_header(log_path, lvl) + msg.to_string() + "\n";
-            md::files::writen(_fd, log_str.c_str(), log_str.size());
+            if(_sync_mode == sync_mode::group_commit)
+                f->commit(_syncs);
         }
         
+        bool can_write() const { return true;}
+        
+        /// sync the current file, the concurrent flushes share a sync.
         void flush() const
         {
-            if(_fd < 0)
+            auto f = _current();
+            if(f->fd < 0)
                 return;
-            fsync(_fd);
+            f->commit(_syncs);
         }
-
-    private:
         
-        static void _on_inotify(int fd, short events, void* arg)
+        /*!
+         * set when the records are synced to disk, interval is the delay
+         * between two syncs of sync_mode::periodic, done on a thread of
+         * the sink. set it before the sink is used.
+         * 
+         *	example:
+         *      snk->set_sync(
+         *          md::log::sinks::sync_mode::periodic,
+         *          std::chrono::milliseconds(200)
+         *      );
+         */
+        void set_sync(
+            sync_mode mode,
+            std::chrono::milliseconds interval = std::chrono::seconds(1))
         {
-            // clear the notify flag.
-            struct inotify_event ie;
-            while(true){
-                ssize_t l = read(fd, &ie, sizeof(ie));
-                if(l == -1)
-                    break;
+            _stop_sync_thread();
+            _sync_mode = mode;
+            _sync_interval = interval;
+            if(mode == sync_mode::periodic){
+                _sync_stop = false;
+                _sync_thread = std::thread(&rotating_file_sink::_sync_run, this);
             }
+        }
+        
+        /// the number of syncs done by the sink.
+        size_t syncs() const
+        {
+            return _syncs.load(std::memory_order_relaxed);
+        }
+        
+        /// the bytes written to the current file.
+        size_t size() const
+        {
+            return _size.load(std::memory_order_relaxed);
+        }
+        
+        /*!
+         * rotate the log now, the backlog is updated in the background,
+         * see md::files::wait_async_jobs. after a failed rename the
+         * rotations are skipped for rotation_retry_delay seconds, the
+         * records are appended to the current file meanwhile.
+         */
+        void rotate() const
+        {
+            bool expected = false;
+            if(!_rotating.compare_exchange_strong(expected, true))
+                return;
             
-            if((events & IN_IGNORED) == IN_IGNORED)
+            time_t now = time(nullptr);
+            if(now < _retry_rotation.load(std::memory_order_relaxed)){
+                _rotating = false;
                 return;
+            }
             
-            rotating_file_sink* self = (rotating_file_sink*)arg;
-
-            if(self->_rotating)
+            // the unique name keeps the rotations queued on the file
+            // thread apart.
+            std::string rotated = fmt::format(
+                "{}.rotating.{}", _base_filename.string(), ++_rotations
+            );
+            _next_rotation = _next_rotation_time();
+            if(::rename(_base_filename.c_str(), rotated.c_str()) != 0){
+                // the writes past max_size would retry it on every record.
+                _retry_rotation = now + rotation_retry_delay;
+                md::log::default_logger()->warn(
+                    "Unable to rotate '{}': {}, retrying in {}s",
+                    _base_filename.string(), strerror(errno),
+                    (int)rotation_retry_delay
+                );
+                _rotating = false;
                 return;
+            }
+            
+            _size = 0;
+            auto prev = std::atomic_exchange(&_file, _open_file());
+            _rotating = false;
+            
+            auto base = _base_filename;
+            size_t backlog_size = _backlog_size;
+            md::files::async_job([prev, base, backlog_size, rotated](){
+                fsync(prev->fd);
+                try{
+                    _shift_backlog(base, backlog_size, rotated);
+                }catch(const std::exception& err){
+                    md::log::default_logger()->warn(
+                        md::callback::cb_error(err)
+                    );
+                }
+            });
+        }
+
+    private:
+        /*!
+         * a log file descriptor shared by the writers, closed when the
+         * last one releases it after a rotation.
+         */
+        struct log_file_t
+        {
+            log_file_t(int f): fd(f), written(0), synced(0), syncing(false)
+            {
+            }
+            
+            ~log_file_t()
+            {
+                if(fd > -1)
+                    close(fd);
+            }
+            
+            /*!
+             * return once the data written before the call is on disk,
+             * the first caller syncs and the callers arriving meanwhile
+             * wait for the next sync which covers all of them.
+             */
+            void commit(std::atomic<size_t>& syncs)
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                uint64_t ticket = ++written;
+                while(synced < ticket){
+                    if(syncing){
+                        cv.wait(lk);
+                        continue;
+                    }
+                    
+                    syncing = true;
+                    uint64_t target = written;
+                    lk.unlock();
+                    fdatasync(fd);
+                    syncs.fetch_add(1, std::memory_order_relaxed);
+                    lk.lock();
+                    synced = target;
+                    syncing = false;
+                    cv.notify_all();
+                }
+            }
+            
+            int fd;
+            std::mutex mtx;
+            std::condition_variable cv;
+            uint64_t written;
+            uint64_t synced;
+            bool syncing;
+        };
+        typedef std::shared_ptr<log_file_t> log_file;
+        
+        log_file _before_write() const
+        {
+            if(_schedule != rotation_schedule::none &&
+                std::chrono::system_clock::to_time_t(
+                    std::chrono::system_clock::now()
+                ) >= _next_rotation.load(std::memory_order_relaxed)
+            )
+                rotate();
+            return _current();
+        }
+        
+        void _after_write(size_t sz) const
+        {
+            _counters.bytes.fetch_add(sz, std::memory_order_relaxed);
+            if(_sync_mode == sync_mode::periodic)
+                _dirty.store(true, std::memory_order_relaxed);
+            if(_size.fetch_add(sz, std::memory_order_relaxed) + sz > _max_size)
+                rotate();
+        }
+        
+        time_t _next_rotation_time() const
+        {
+            if(_schedule == rotation_schedule::none)
+                return std::numeric_limits<time_t>::max();
+            
+            time_t now = time(nullptr);
+            struct tm t;
+            localtime_r(&now, &t);
+            t.tm_sec = 0;
+            t.tm_min = 0;
+            if(_schedule == rotation_schedule::hourly)
+                t.tm_hour += 1;
+            else{
+                t.tm_hour = 0;
+                t.tm_mday += 1;
+            }
+            t.tm_isdst = -1;
+            return mktime(&t);
+        }
+        
+        static void _on_inotify(int fd, short /*events*/, void* arg)
+        {
+            rotating_file_sink* self = (rotating_file_sink*)arg;
+            
+            // the watched file was renamed or removed, the base file is
+            // watched again, recreated if needed.
+            bool rewatch = false;
+            char buf[4096]
+                __attribute__ ((aligned(__alignof__(struct inotify_event))));
+            ssize_t l;
+            while((l = read(fd, buf, sizeof(buf))) > 0){
+                for(char* p = buf; p < buf + l;){
+                    auto ie = (const struct inotify_event*)p;
+                    if(ie->wd == self->_wfd &&
+                        (ie->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                    )
+                        rewatch = true;
+                    p += sizeof(struct inotify_event) + ie->len;
+                }
+            }
             
             struct stat sb;
-            fstat(self->_fd, &sb);
-            if((size_t)sb.st_size > self->_max_size)
-                self->_rotate_log();
+            if(fstat(self->_current()->fd, &sb) == 0){
+                if(sb.st_nlink == 0){
+                    // removed.
+                    self->_reopen();
+                    rewatch = true;
+                }else if((size_t)sb.st_size < self->_size.load())
+                    // an external truncation.
+                    self->_size = (size_t)sb.st_size;
+            }
+            
+            if(rewatch){
+                if(!bfs::exists(self->_base_filename))
+                    self->_reopen();
+                self->_watch();
+            }
+        }
+
+        void _sync_run()
+        {
+            std::unique_lock<std::mutex> lk(_sync_mtx);
+            while(!_sync_stop){
+                _sync_cv.wait_for(lk, _sync_interval);
+                if(_sync_stop || !_dirty.exchange(false))
+                    continue;
+                
+                lk.unlock();
+                auto f = _current();
+                if(f->fd > -1)
+                    f->commit(_syncs);
+                lk.lock();
+            }
         }
         
-        void _open_log()
+        void _stop_sync_thread()
+        {
+            if(!_sync_thread.joinable())
+                return;
+            {
+                std::lock_guard<std::mutex> lk(_sync_mtx);
+                _sync_stop = true;
+            }
+            _sync_cv.notify_one();
+            _sync_thread.join();
+        }
+
+        void _reopen()
+        {
+            _size = 0;
+            std::atomic_store(&_file, _open_file());
+        }
+        
+        log_file _current() const
+        {
+            return std::atomic_load(&_file);
+        }
+        
+        log_file _open_file() const
         {
-            _fd = open(
+            return std::make_shared<log_file_t>(open(
                 _base_filename.c_str(),
                 O_APPEND | O_CREAT | O_WRONLY,
                 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP//ug+wr
-            );
-            _notify_start();
+            ));
         }
         
-        void _rotate_log()
+        void _open_log()
+        {
+            auto f = _open_file();
+            struct stat sb;
+            if(f->fd > -1 && fstat(f->fd, &sb) == 0)
+                _size = (size_t)sb.st_size;
+            std::atomic_store(&_file, f);
+        }
+        
+        /*!
+         * run on the file thread, shift the backlog by one and move the
+         * rotated file to '.1'. the files past half the backlog are
+         * compressed once.
+         */
+        static void _shift_backlog(
+            const bfs::path& pp, size_t backlog_size,
+            const std::string& rotated)
         {
-            if(_rotating)
-                return;
-            _rotating = true;
-            
-            _notify_close();
-            
-            auto pp = _base_filename;
             size_t gz_backlog_size = std::max(
-                (size_t)std::floor((float)_backlog_size / 2.0f),
+                (size_t)std::floor((float)backlog_size / 2.0f),
                 (size_t)2
             );
-            for(size_t i = _backlog_size -1; i > 0; --i){
+            for(size_t i = backlog_size -1; i > 0; --i){
                 bool is_gz = false;
                 std::string cur_ext = ("." + md::num_to_str(i, false));
                 
@@ -591,82 +2872,40 @@ namespace sinks{
                     is_gz = true;
                 }
                 
-                if(i == _backlog_size -1)
+                if(i == backlog_size -1){
                     bfs::remove(blf);
-                else{
-                    std::string new_ext = ("." + md::num_to_str(i+1, false));
-                    if(i < gz_backlog_size)
-                        bfs::rename(
-                            blf,
-                            pp.string() + new_ext + (is_gz ? ".gz" : "")
-                        );
-                    else{
-                        auto new_blf = pp.string() + new_ext + ".gz";
-                        bfs::rename(
-                            blf,
-                            pp.string() + new_ext + ".gz"
-                        );
+                    continue;
+                }
                         
-                        try{
-                            md::files::gzip_file(new_blf, new_blf);
-                            /*
-                            std::string tmp_log = 
-                                (pp.parent_path()/bfs::unique_path()).string();
+                std::string new_blf =
+                    pp.string() + "." + md::num_to_str(i+1, false);
+                if(is_gz){
+                    bfs::rename(blf, new_blf + ".gz");
+                    continue;
+                }
                             
-                            md::gzip_file(
-                                this->_ev_base,
-                                new_blf, tmp_log,
-                            [new_blf, tmp_log](md::callback::cb_error err){
-                                if(err){
-                                    bfs::remove(tmp_log);
-                                    bfs::remove(new_blf);
-                                    _internal::default_logger()->warn(
-                                        err.c_str()
-                                    );
-                                    return;
-                                }
+                bfs::rename(blf, new_blf);
+                if(i < gz_backlog_size)
+                    continue;
                                 
-                                bfs::remove(new_blf);
-                                bfs::rename(tmp_log, new_blf);
-                            });
-                            */
-                        }catch(const std::exception& err){
-                            md::log::default_logger()->warn(
-                                md::callback::cb_error(err)
-                            );
-                        }
-                    }
+                try{
+                    md::files::gzip_file(new_blf, new_blf + ".gz");
+                    bfs::remove(new_blf);
+                }catch(const std::exception& err){
+                    md::log::default_logger()->warn(
+                        md::callback::cb_error(err)
+                    );
                 }
             }
-            bfs::rename(_base_filename, pp.string() + ".1");
-            
-            int tfd = _fd;
-            _fd = open(
-                _base_filename.c_str(),
-                O_APPEND | O_CREAT | O_WRONLY,
-                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP//ug+wr
-            );
-            
-            fsync(tfd);
-            close(tfd);
-            
-            _notify_start();
-            _rotating = false;
-        }
-        
-        void _close_log()
-        {
-            _notify_close();
-            fsync(_fd);
-            close(_fd);
+            bfs::rename(rotated, pp.string() + ".1");
         }
         
         void _notify_start()
         {
             _ifd = inotify_init1(IN_NONBLOCK);
-            _wfd = inotify_add_watch(
-                _ifd, _base_filename.c_str(), IN_ATTRIB | IN_MODIFY
-            );
+            if(_ifd < 0)
+                throw MD_ERR("inotify_init1 failed: {}", strerror(errno));
+            _watch();
             
             _wev = event_new(
                 _ev_base, _ifd,
@@ -674,14 +2913,25 @@ namespace sinks{
                 this
             );
             
-            struct timeval tv = {10,0};
-            if(event_add(_wev, &tv) == -1){
+            if(event_add(_wev, nullptr) == -1){
                 event_free(_wev);
                 _wev = nullptr;
                 throw MD_ERR("event_add failed!");
             }
         }
         
+        void _watch()
+        {
+            if(_wfd > -1)
+                inotify_rm_watch(_ifd, _wfd);
+            // IN_MODIFY is the only event of a truncation, IN_ATTRIB of
+            // an unlink.
+            _wfd = inotify_add_watch(
+                _ifd, _base_filename.c_str(),
+                IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF
+            );
+        }
+        
         void _notify_close()
         {
             if(_wev){
@@ -693,61 +2943,95 @@ namespace sinks{
             inotify_rm_watch(_ifd, _wfd);
             _wfd = -1;
             close(_ifd);
-        }
-        
-        static std::string _gen_header(
-            md::string_view log_path, log_level lvl)
-        {
-            return fmt::format(
-                "[{}] [{}:{}] ",
-                _internal::get_timestamp(),
-                to_string(lvl).data(),
-                log_path.to_string()
-            );
+            _ifd = -1;
         }
         
         event_base* _ev_base;
         int _ifd;
         int _wfd;
-        int _fd;
         event* _wev;
         bfs::path _base_filename;
         size_t _max_size;
         size_t _backlog_size;
-        bool _rotating;
+        rotation_schedule _schedule;
+        mutable std::atomic<bool> _rotating;
+        mutable size_t _rotations;
+        mutable std::atomic<size_t> _size;
+        mutable std::atomic<time_t> _next_rotation;
+        mutable std::atomic<time_t> _retry_rotation;
+        // swapped by the rotation, std::atomic_load/store.
+        mutable log_file _file;
+        
+        sync_mode _sync_mode;
+        std::chrono::milliseconds _sync_interval;
+        std::thread _sync_thread;
+        std::mutex _sync_mtx;
+        std::condition_variable _sync_cv;
+        bool _sync_stop;
+        mutable std::atomic<bool> _dirty;
+        mutable std::atomic<size_t> _syncs;
     };
     
 } // ns: md::log::sinks
 
 namespace _internal{
     
-    static std::string get_timestamp()
+    inline std::string get_timestamp(log_clock::time_point currentTime)
     {
-        const auto currentTime = std::chrono::system_clock::now();
-        time_t time = std::chrono::system_clock::to_time_t(currentTime);
-        auto currentTimeRounded = std::chrono::system_clock::from_time_t(time);
-        if( currentTimeRounded > currentTime ) {
-            --time;
-            currentTimeRounded -= std::chrono::seconds( 1 );
-        }
-        //const tm *values = localtime( &time );
-        struct tm t;
-        localtime_r(&time, &t);
-        int hours = t.tm_hour;
-        int minutes = t.tm_min;
-        int seconds = t.tm_sec;
-        // etc.
-        int milliseconds =
-            std::chrono::duration_cast<std::chrono::duration<int,std::milli>>(
-                currentTime - currentTimeRounded
+        fmt::memory_buffer buf;
+        get_timestamp(buf, currentTime);
+        return std::string(buf.data(), buf.size());
+    }
+    
+    /*!
+     * append the 'YYYY-MM-DD HH:MM:SS.mmm' local time of currentTime to
+     * buf. the date and time part is kept per thread and only refreshed
+     * when the second changes, localtime_r is called once per second.
+     */
+    inline void get_timestamp(
+        fmt::memory_buffer& buf, log_clock::time_point currentTime)
+    {
+        struct ts_cache_t
+        {
+            time_t sec;
+            char prefix[32];
+            size_t size;
+        };
+        thread_local ts_cache_t cache = {
+            std::numeric_limits<time_t>::min(), {0}, 0
+        };
+        
+        int64_t ms =
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                currentTime.time_since_epoch()
             ).count();
+        time_t time = (time_t)(ms / 1000);
+        int milliseconds = (int)(ms % 1000);
+        if(milliseconds < 0){
+            --time;
+            milliseconds += 1000;
+        }
         
-        return fmt::format(
-            "{0:04}-{1:02}-{2:02} "
-            "{3:02}:{4:02}:{5:02}.{6:03}",
-            t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
-            hours, minutes, seconds, milliseconds
-        );
+        if(time != cache.sec){
+            struct tm t;
+            localtime_r(&time, &t);
+            cache.size = fmt::format_to_n(
+                cache.prefix, sizeof(cache.prefix),
+                "{0:04}-{1:02}-{2:02} {3:02}:{4:02}:{5:02}.",
+                t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+                t.tm_hour, t.tm_min, t.tm_sec
+            ).size;
+            cache.size = std::min(cache.size, sizeof(cache.prefix));
+            cache.sec = time;
+        }
+        
+        char msec[3] = {
+            (char)('0' + milliseconds / 100),
+            (char)('0' + milliseconds / 10 % 10),
+            (char)('0' + milliseconds % 10)
+        };
+        buf.append(cache.prefix, cache.prefix + cache.size);
+        buf.append(msec, msec + 3);
     }
 
 } // ns: md::_internal
@@ -772,8 +3056,8 @@ template <typename... Args>
 void trace(md::string_view f, const Args&... args)
 {
     if(log::default_logger()->should_log(log_level::trace))
-        log::default_logger()->log(
-            "/", log_level::trace, fmt::format(f.data(), args...)
+        log::default_logger()->log_fmt(
+            "/", log_level::trace, f, args...
         );
 }
 
@@ -786,8 +3070,8 @@ template <typename... Args>
 void debug(md::string_view f, const Args&... args)
 {
     if(log::default_logger()->should_log(log_level::debug))
-        log::default_logger()->log(
-            "/", log_level::debug, fmt::format(f.data(), args...)
+        log::default_logger()->log_fmt(
+            "/", log_level::debug, f, args...
         );
 }
 
@@ -800,8 +3084,8 @@ template <typename... Args>
 void info(md::string_view f, const Args&... args)
 {
     if(log::default_logger()->should_log(log_level::info))
-        log::default_logger()->log(
-            "/", log_level::info, fmt::format(f.data(), args...)
+        log::default_logger()->log_fmt(
+            "/", log_level::info, f, args...
         );
 }
 
@@ -814,8 +3098,8 @@ template <typename... Args>
 void warn(md::string_view f, const Args&... args)
 {
     if(log::default_logger()->should_log(log_level::warning))
-        log::default_logger()->log(
-            "/", log_level::warning, fmt::format(f.data(), args...)
+        log::default_logger()->log_fmt(
+            "/", log_level::warning, f, args...
         );
 }
 
@@ -828,8 +3112,8 @@ template <typename... Args>
 void error(md::string_view f, const Args&... args)
 {
     if(log::default_logger()->should_log(log_level::error))
-        log::default_logger()->log(
-            "/", log_level::error, fmt::format(f.data(), args...)
+        log::default_logger()->log_fmt(
+            "/", log_level::error, f, args...
         );
 }
 
@@ -842,8 +3126,8 @@ template <typename... Args>
 void fatal(md::string_view f, const Args&... args)
 {
     if(log::default_logger()->should_log(log_level::fatal))
-        log::default_logger()->log(
-            "/", log_level::fatal, fmt::format(f.data(), args...)
+        log::default_logger()->log_fmt(
+            "/", log_level::fatal, f, args...
         );
     
     std::exit(-1);
@@ -858,9 +3142,8 @@ template <typename... Args>
 void success(md::string_view f, const Args&... args)
 {
     if(log::default_logger()->should_log(log_level::audit_succeeded))
-        log::default_logger()->log(
-            "/", log_level::audit_succeeded,
-            fmt::format(f.data(), args...)
+        log::default_logger()->log_fmt(
+            "/", log_level::audit_succeeded, f, args...
         );
 }
 
@@ -873,9 +3156,8 @@ template <typename... Args>
 void fail(md::string_view f, const Args&... args)
 {
     if(log::default_logger()->should_log(log_level::audit_failed))
-        log::default_logger()->log(
-            "/", log_level::audit_failed,
-            fmt::format(f.data(), args...)
+        log::default_logger()->log_fmt(
+            "/", log_level::audit_failed, f, args...
         );
 }
 
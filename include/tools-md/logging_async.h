@@ -0,0 +1,373 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _tools_md_logging_async_h
+#define _tools_md_logging_async_h
+
+#include "logging.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace md { namespace log{
+
+namespace _internal{
+    
+    /*!
+     * bounded multi producers ring, D. Vyukov's design. the producers
+     * claim a cell, fill its buffer and publish it, the single consumer
+     * reads the published cells in order. the cell buffers keep their
+     * capacity from one record to the next.
+     */
+    class log_ring_t
+    {
+    public:
+        log_ring_t(size_t capacity)
+            : _head(0), _tail(0)
+        {
+            size_t sz = 2;
+            while(sz < capacity)
+                sz <<= 1;
+            _mask = sz -1;
+            _cells.reset(new cell_t[sz]);
+            for(size_t i = 0; i < sz; ++i)
+                _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        
+        size_t capacity() const { return _mask +1;}
+        
+        /// false if the ring is full.
+        bool claim(size_t& pos)
+        {
+            pos = _head.load(std::memory_order_relaxed);
+            while(true){
+                cell_t& c = _cells[pos & _mask];
+                size_t seq = c.seq.load(std::memory_order_acquire);
+                intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+                if(dif == 0){
+                    if(_head.compare_exchange_weak(
+                        pos, pos +1, std::memory_order_relaxed
+                    ))
+                        return true;
+                }else if(dif < 0)
+                    return false;
+                else
+                    pos = _head.load(std::memory_order_relaxed);
+            }
+        }
+        
+        fmt::memory_buffer& buffer(size_t pos)
+        {
+            return _cells[pos & _mask].buf;
+        }
+        
+        void publish(size_t pos)
+        {
+            _cells[pos & _mask].seq.store(pos +1, std::memory_order_release);
+        }
+        
+        /// consumer only, number of published cells following the tail.
+        size_t ready(size_t max) const
+        {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            size_t n = 0;
+            for(; n < max; ++n){
+                size_t pos = tail + n;
+                if(_cells[pos & _mask].seq.load(std::memory_order_acquire)
+                    != pos +1
+                )
+                    break;
+            }
+            return n;
+        }
+        
+        /// consumer only, buffer of the idx ready cell.
+        fmt::memory_buffer& at(size_t idx)
+        {
+            return _cells[
+                (_tail.load(std::memory_order_relaxed) + idx) & _mask
+            ].buf;
+        }
+        
+        /// consumer only, give the first n ready cells back to producers.
+        void release(size_t n)
+        {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            for(size_t i = 0; i < n; ++i)
+                _cells[(tail + i) & _mask].seq.store(
+                    tail + i + _mask +1, std::memory_order_release
+                );
+            _tail.store(tail + n, std::memory_order_release);
+        }
+        
+        size_t head() const { return _head.load(std::memory_order_acquire);}
+        size_t tail() const { return _tail.load(std::memory_order_acquire);}
+        
+    private:
+        class cell_t
+        {
+        public:
+            std::atomic<size_t> seq;
+            fmt::memory_buffer buf;
+        };
+        
+        std::unique_ptr<cell_t[]> _cells;
+        size_t _mask;
+        alignas(64) std::atomic<size_t> _head;
+        alignas(64) std::atomic<size_t> _tail;
+    };
+    
+} // ns: md::log::_internal
+
+namespace sinks{
+    
+    /*!
+     * format the records on the caller thread into a lock free ring, a
+     * dedicated thread writes them with one write call per batch using
+     * the write method of sink.
+     * 
+     *	example:
+     *      auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+     *          ev_base, "app.log", 10 * 1024 * 1024, 8
+     *      );
+     *      auto asnk = std::make_shared<md::log::sinks::async_sink>(
+     *          fsnk, 8192, md::log::overflow_policy::count
+     *      );
+     *      md::log::default_logger()->replace_sink(asnk);
+     */
+    class async_sink
+        : public logger_sink_t
+    {
+    public:
+        async_sink(
+            logger_sink sink, size_t capacity = 4096,
+            overflow_policy policy = overflow_policy::block)
+            : logger_sink_t(sink->level()),
+            _sink(sink), _ring(capacity), _policy(policy),
+            _dropped(0), _reported(0), _stop(false), _sleeping(false)
+        {
+            if(!sink->can_write())
+                throw MD_ERR("The sink can't be used by an async_sink!");
+            
+            _thread = std::thread(&async_sink::_run, this);
+        }
+        
+        ~async_sink()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+                _cv.notify_one();
+            }
+            if(_thread.joinable())
+                _thread.join();
+        }
+        
+        void log(
+            md::string_view log_path,
+            log_level lvl, md::string_view msg) const
+        {
+            size_t pos;
+            if(!_claim(pos))
+                return;
+            
+            auto& buf = _ring.buffer(pos);
+            buf.clear();
+            buf.push_back(text_record);
+            _sink->format(buf, log_clock::now(), log_path, lvl, msg);
+            _ring.publish(pos);
+            _wake();
+        }
+        
+        void log_fields(
+            md::string_view log_path, log_level lvl,
+            md::string_view msg, const fields_t& fields) const
+        {
+            size_t pos;
+            if(!_claim(pos))
+                return;
+            
+            auto& buf = _ring.buffer(pos);
+            buf.clear();
+            buf.push_back(text_record);
+            _sink->format_fields(
+                buf, log_clock::now(), log_path, lvl, msg, fields
+            );
+            _ring.publish(pos);
+            _wake();
+        }
+        
+        /// the record is copied as is and formatted by the writer thread.
+        void log_deferred(const deferred_record_t& rec) const
+        {
+            size_t pos;
+            if(!_claim(pos))
+                return;
+            
+            auto& buf = _ring.buffer(pos);
+            buf.clear();
+            buf.push_back(deferred_record);
+            buf.append(rec.data, rec.data + rec.size);
+            _ring.publish(pos);
+            _wake();
+        }
+        
+        /// wait for the records logged so far to be written.
+        void flush() const
+        {
+            size_t head = _ring.head();
+            while(_ring.tail() < head){
+                _wake();
+                std::this_thread::yield();
+            }
+            _sink->flush();
+        }
+        
+        size_t dropped() const { return _dropped.load();}
+        
+    private:
+        // the first byte of a ring cell tells how to write it.
+        enum : char
+        {
+            text_record = 0,
+            deferred_record = 1,
+        };
+        static const size_t max_batch = 64;
+        
+        bool _claim(size_t& pos) const
+        {
+            while(!_ring.claim(pos)){
+                if(_policy != overflow_policy::block){
+                    ++_dropped;
+                    ++_counters.dropped;
+                    return false;
+                }
+                _wake();
+                std::this_thread::yield();
+            }
+            return true;
+        }
+        
+        void _wake() const
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(!_sleeping.load(std::memory_order_relaxed))
+                return;
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.notify_one();
+        }
+        
+        void _run()
+        {
+            struct iovec iov[max_batch];
+            
+            while(true){
+                size_t n = _ring.ready(max_batch);
+                if(n == 0){
+                    _report_dropped();
+                    
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _sleeping = true;
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if(_ring.ready(1) == 0){
+                        if(_stop)
+                            break;
+                        _cv.wait_for(lock, std::chrono::milliseconds(100));
+                    }
+                    _sleeping = false;
+                    continue;
+                }
+                
+                for(size_t i = 0; i < n; ++i){
+                    auto& buf = _ring.at(i);
+                    if(buf[0] == text_record){
+                        iov[i].iov_base = buf.data() +1;
+                        iov[i].iov_len = buf.size() -1;
+                        continue;
+                    }
+                    
+                    auto& fbuf = _deferred[i];
+                    fbuf.clear();
+                    deferred_record_t rec;
+                    if(deferred_record_t::decode(
+                        buf.data() +1, buf.size() -1, rec
+                    ))
+                        _sink->format_deferred(fbuf, rec);
+                    iov[i].iov_base = fbuf.data();
+                    iov[i].iov_len = fbuf.size();
+                }
+                // the sink counts the records and the batch latency.
+                auto& counters = _sink->counters();
+                if(counters.timed.load(std::memory_order_relaxed)){
+                    auto start = std::chrono::steady_clock::now();
+                    _sink->write(iov, (int)n);
+                    counters.add(n, std::chrono::steady_clock::now() - start);
+                }else{
+                    _sink->write(iov, (int)n);
+                    counters.add(n);
+                }
+                _ring.release(n);
+            }
+        }
+        
+        void _report_dropped()
+        {
+            if(_policy != overflow_policy::count)
+                return;
+            size_t dropped = _dropped.load();
+            if(dropped == _reported)
+                return;
+            
+            fmt::memory_buffer buf;
+            _sink->format(
+                buf, log_clock::now(), "/", log_level::warning, fmt::format(
+                    "{} log records were dropped", dropped - _reported
+                )
+            );
+            struct iovec iov = {buf.data(), buf.size()};
+            _sink->write(&iov, 1);
+            _reported = dropped;
+        }
+        
+        logger_sink _sink;
+        mutable _internal::log_ring_t _ring;
+        overflow_policy _policy;
+        mutable std::atomic<size_t> _dropped;
+        size_t _reported;
+        // writer thread buffers for the deferred records.
+        fmt::memory_buffer _deferred[max_batch];
+        
+        mutable std::mutex _mutex;
+        mutable std::condition_variable _cv;
+        bool _stop;
+        std::atomic<bool> _sleeping;
+        std::thread _thread;
+    };
+    
+} // ns: md::log::sinks
+
+}}//::md::log
+#endif//_tools_md_logging_async_h
@@ -0,0 +1,572 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _tools_md_logging_binary_h
+#define _tools_md_logging_binary_h
+
+#include "logging.h"
+
+#include <istream>
+#include <mutex>
+#include <unordered_map>
+
+namespace md { namespace log{
+
+/*!
+ * binary log files, written by sinks::binary_file_sink and decoded by
+ * binary::reader_t or the md-logcat tool.
+ * 
+ * the file starts with the 8 bytes magic and a uint32_t version, then
+ * a sequence of entries, a uint8_t entry_type, the varint payload size
+ * and the payload:
+ *  - format: varint id, the format string
+ *  - path: varint id (the interned path id), the logger path
+ *  - time: int64_t time in nanoseconds, the base of the next record
+ *  - record: zigzag varint nanoseconds since the previous record or
+ *      time entry, uint8_t log_level, varint path id, varint format id,
+ *      the compact arguments
+ *  - text: int64_t time in nanoseconds, uint8_t log_level,
+ *      varint path size, the path, the message
+ * 
+ * the compact arguments keep the deferred_record_t tags, the integers
+ * are varints (zigzag for the signed ones) and the string sizes too.
+ * 
+ * the format and path entries are written once, before the first record
+ * using their id. a file can be appended to by several runs, a later
+ * definition replaces the previous one with the same id.
+ */
+namespace binary{
+    
+    static const char magic[8] = {'M', 'D', 'L', 'O', 'G', 'B', 'I', 'N'};
+    static const uint32_t version = 1;
+    static const size_t file_header_size = sizeof(magic) + sizeof(version);
+    
+    enum class entry_type : uint8_t
+    {
+        format  = 1,
+        path    = 2,
+        time    = 3,
+        record  = 4,
+        text    = 5,
+    };
+    
+    inline void put_varint(fmt::memory_buffer& buf, uint64_t val)
+    {
+        while(val >= 0x80){
+            buf.push_back((char)(val | 0x80));
+            val >>= 7;
+        }
+        buf.push_back((char)val);
+    }
+    
+    /// false if the varint doesn't end before pe.
+    inline bool get_varint(const char*& p, const char* pe, uint64_t& val)
+    {
+        val = 0;
+        for(int shift = 0; p < pe && shift < 64; shift += 7){
+            uint8_t b = (uint8_t)*p++;
+            val |= (uint64_t)(b & 0x7f) << shift;
+            if(!(b & 0x80))
+                return true;
+        }
+        return false;
+    }
+    
+    inline uint64_t zigzag(int64_t val)
+    {
+        return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+    }
+    
+    inline int64_t unzigzag(uint64_t val)
+    {
+        return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+    }
+    
+    /// append the compact form of the deferred_record_t arguments.
+    inline void compact_args(
+        fmt::memory_buffer& buf, const char* p, const char* pe)
+    {
+        using _internal::arg_tag;
+        while(p < pe){
+            arg_tag tag = (arg_tag)*p;
+            buf.push_back(*p++);
+            switch(tag){
+                case arg_tag::i64:
+                    put_varint(buf, zigzag(_internal::get<int64_t>(p)));
+                    break;
+                case arg_tag::u64:
+                    put_varint(buf, _internal::get<uint64_t>(p));
+                    break;
+                case arg_tag::str:{
+                    uint32_t sz = _internal::get<uint32_t>(p);
+                    put_varint(buf, sz);
+                    buf.append(p, p + sz);
+                    p += sz;
+                    break;
+                }
+                case arg_tag::f32:
+                    buf.append(p, p + sizeof(float));
+                    p += sizeof(float);
+                    break;
+                case arg_tag::f64:
+                    buf.append(p, p + sizeof(double));
+                    p += sizeof(double);
+                    break;
+                default:
+                    buf.push_back(*p++);
+                    break;
+            }
+        }
+    }
+    
+    /// the reverse of compact_args, false on a truncated argument.
+    inline bool expand_args(
+        fmt::memory_buffer& buf, const char* p, const char* pe)
+    {
+        using _internal::arg_tag;
+        uint64_t v;
+        while(p < pe){
+            arg_tag tag = (arg_tag)*p;
+            buf.push_back(*p++);
+            size_t fixed = 1;
+            switch(tag){
+                case arg_tag::i64:
+                    if(!get_varint(p, pe, v))
+                        return false;
+                    _internal::put(buf, unzigzag(v));
+                    continue;
+                case arg_tag::u64:
+                    if(!get_varint(p, pe, v))
+                        return false;
+                    _internal::put(buf, v);
+                    continue;
+                case arg_tag::str:
+                    if(!get_varint(p, pe, v) || v > (uint64_t)(pe - p))
+                        return false;
+                    _internal::put(buf, (uint32_t)v);
+                    buf.append(p, p + v);
+                    p += v;
+                    continue;
+                case arg_tag::f32:
+                    fixed = sizeof(float);
+                    break;
+                case arg_tag::f64:
+                    fixed = sizeof(double);
+                    break;
+                case arg_tag::boolean:
+                case arg_tag::ch:
+                    break;
+                default:
+                    return false;
+            }
+            if(fixed > (size_t)(pe - p))
+                return false;
+            buf.append(p, p + fixed);
+            p += fixed;
+        }
+        return true;
+    }
+    
+    /// a decoded record, the views are valid until the next read.
+    struct record_t
+    {
+        log_clock::time_point time;
+        log_level lvl;
+        md::string_view path;
+        md::string_view msg;
+    };
+    
+    /*!
+     * read the records of a binary log file.
+     * 
+     *	example:
+     *      std::ifstream in("app.mdlog", std::ios::binary);
+     *      md::log::binary::reader_t rd(in);
+     *      md::log::binary::record_t rec;
+     *      while(rd.next(rec))
+     *          std::cout << rec.msg << std::endl;
+     */
+    class reader_t
+    {
+    public:
+        reader_t(std::istream& in)
+            : _in(in), _last_ns(0)
+        {
+            char hdr[file_header_size];
+            if(!_in.read(hdr, sizeof(hdr)) ||
+                memcmp(hdr, magic, sizeof(magic)) != 0
+            )
+                throw MD_ERR("Not a binary log file!");
+            
+            const char* p = hdr + sizeof(magic);
+            uint32_t ver = _internal::get<uint32_t>(p);
+            if(ver != version)
+                throw MD_ERR("Unsupported binary log version: {}", ver);
+        }
+        
+        /*!
+         * read up to the next record, false at the end of the file or on
+         * a truncated entry.
+         */
+        bool next(record_t& rec)
+        {
+            char type;
+            while(_in.get(type)){
+                uint64_t sz = 0;
+                for(int shift = 0; shift < 64; shift += 7){
+                    char b;
+                    if(!_in.get(b))
+                        return false;
+                    sz |= (uint64_t)(b & 0x7f) << shift;
+                    if(!(b & 0x80))
+                        break;
+                }
+                _payload.resize(sz);
+                if(sz > 0 && !_in.read(&_payload[0], sz))
+                    return false;
+                
+                const char* p = _payload.data();
+                const char* pe = p + sz;
+                uint64_t v;
+                switch((entry_type)type){
+                    case entry_type::format:
+                    case entry_type::path:{
+                        if(!get_varint(p, pe, v))
+                            break;
+                        auto& dict = (entry_type)type == entry_type::format ?
+                            _formats : _paths;
+                        dict[(uint32_t)v].assign(p, pe);
+                        break;
+                    }
+                    case entry_type::time:
+                        if(sz >= sizeof(int64_t))
+                            _last_ns = _internal::get<int64_t>(p);
+                        break;
+                    case entry_type::record:{
+                        uint64_t path_id, fmt_id;
+                        if(!get_varint(p, pe, v) || p == pe)
+                            break;
+                        _last_ns += unzigzag(v);
+                        _set_time(rec, _last_ns);
+                        rec.lvl = (log_level)*p++;
+                        if(!get_varint(p, pe, path_id) ||
+                            !get_varint(p, pe, fmt_id)
+                        )
+                            break;
+                        
+                        auto pit = _paths.find((uint32_t)path_id);
+                        rec.path = pit == _paths.end() ?
+                            md::string_view("?") : md::string_view(pit->second);
+                        
+                        _msg.clear();
+                        _args.clear();
+                        auto fit = _formats.find((uint32_t)fmt_id);
+                        if(fit == _formats.end() || !expand_args(_args, p, pe))
+                            fmt::format_to(
+                                std::back_inserter(_msg),
+                                "<undecodable record, format {}>", fmt_id
+                            );
+                        else
+                            _internal::format_deferred(
+                                _msg, fit->second.c_str(),
+                                _args.data(), _args.size()
+                            );
+                        rec.msg = md::string_view(_msg.data(), _msg.size());
+                        return true;
+                    }
+                    case entry_type::text:{
+                        if(sz < sizeof(int64_t) +1)
+                            break;
+                        _set_time(rec, _internal::get<int64_t>(p));
+                        rec.lvl = (log_level)*p++;
+                        if(!get_varint(p, pe, v) || v > (uint64_t)(pe - p))
+                            break;
+                        rec.path = md::string_view(p, v);
+                        p += v;
+                        rec.msg = md::string_view(p, pe - p);
+                        return true;
+                    }
+                    default:
+                        // unknown entries are skipped.
+                        break;
+                }
+            }
+            return false;
+        }
+        
+    private:
+        static void _set_time(record_t& rec, int64_t ns)
+        {
+            rec.time = log_clock::time_point(
+                std::chrono::duration_cast<log_clock::duration>(
+                    std::chrono::nanoseconds(ns)
+                )
+            );
+        }
+        
+        std::istream& _in;
+        std::string _payload;
+        int64_t _last_ns;
+        fmt::memory_buffer _args;
+        fmt::memory_buffer _msg;
+        std::unordered_map<uint32_t, std::string> _formats;
+        std::unordered_map<uint32_t, std::string> _paths;
+    };
+    
+} // ns: md::log::binary
+
+namespace sinks{
+    
+    /*!
+     * write the records in the binary format of md::log::binary, the
+     * records of logger_t::defer only keep their arguments, the format
+     * strings and the paths are written once. md-logcat decodes the
+     * file to the rotating_file_sink text layout.
+     * 
+     *	example:
+     *      auto snk = std::make_shared<md::log::sinks::binary_file_sink>(
+     *          "/var/log/app.mdlog"
+     *      );
+     *      md::log::logger_t log("/app", snk);
+     *      log.defer(md::log::log_level::info, "read {} bytes", sz);
+     */
+    class binary_file_sink
+        : public logger_sink_t
+    {
+    public:
+        binary_file_sink(bfs::path filename)
+            : logger_sink_t(log_level::info), _last_ns(0)
+        {
+            _fd = open(
+                filename.c_str(),
+                O_APPEND | O_CREAT | O_WRONLY,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP//ug+wr
+            );
+            if(_fd < 0)
+                throw MD_ERR("Unable to open '{}'", filename.string());
+            
+            struct stat sb;
+            if(fstat(_fd, &sb) == 0 && sb.st_size == 0){
+                char hdr[binary::file_header_size];
+                memcpy(hdr, binary::magic, sizeof(binary::magic));
+                memcpy(
+                    hdr + sizeof(binary::magic),
+                    &binary::version, sizeof(binary::version)
+                );
+                md::files::writen(_fd, hdr, sizeof(hdr));
+            }
+        }
+        
+        ~binary_file_sink()
+        {
+            if(_fd > -1){
+                flush();
+                close(_fd);
+            }
+        }
+        
+        void log(
+            md::string_view log_path,
+            log_level lvl, md::string_view msg) const
+        {
+            thread_local fmt::memory_buffer buf;
+            buf.clear();
+            format(buf, log_clock::now(), log_path, lvl, msg);
+            _count(md::files::writen(_fd, buf.data(), buf.size()));
+        }
+        
+        void log_deferred(const deferred_record_t& rec) const
+        {
+            thread_local fmt::memory_buffer buf;
+            buf.clear();
+            // the dictionary entries must reach the file before the
+            // records of another thread using them.
+            std::unique_lock<std::mutex> lock(_mutex);
+            _format_deferred(buf, rec);
+            _count(md::files::writen(_fd, buf.data(), buf.size()));
+        }
+        
+        /// a text entry, the path is written in full.
+        void format(
+            fmt::memory_buffer& buf, log_clock::time_point time,
+            md::string_view log_path, log_level lvl, md::string_view msg) const
+        {
+            thread_local fmt::memory_buffer payload;
+            payload.clear();
+            _internal::put(payload, _ns(time));
+            payload.push_back((char)lvl);
+            binary::put_varint(payload, log_path.size());
+            payload.append(log_path.data(), log_path.data() + log_path.size());
+            payload.append(msg.data(), msg.data() + msg.size());
+            _entry(buf, binary::entry_type::text, payload);
+        }
+        
+        /// a text entry, the fields are appended to the message.
+        void format_fields(
+            fmt::memory_buffer& buf, log_clock::time_point time,
+            md::string_view log_path, log_level lvl, md::string_view msg,
+            const fields_t& fields) const
+        {
+            thread_local fmt::memory_buffer text;
+            text.clear();
+            _internal::append(text, msg);
+            _internal::format_fields(text, fields);
+            format(
+                buf, time, log_path, lvl,
+                md::string_view(text.data(), text.size())
+            );
+        }
+        
+        /*!
+         * a record entry, preceded by the dictionary entries it needs.
+         * an async_sink calls it from its single writer thread, in the
+         * order the records are written. the record times are relative
+         * to the previous record, a sink is either used directly or by a
+         * single async_sink.
+         */
+        void format_deferred(
+            fmt::memory_buffer& buf, const deferred_record_t& rec) const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _format_deferred(buf, rec);
+        }
+        
+        void write(const struct iovec* iov, int iovcnt) const
+        {
+            _count(md::files::writevn(_fd, iov, iovcnt));
+        }
+        
+        bool can_write() const { return true;}
+        
+        void flush() const
+        {
+            fsync(_fd);
+        }
+        
+    private:
+        
+        void _count(ssize_t written) const
+        {
+            if(written < 0)
+                ++_counters.errors;
+            else
+                _counters.bytes.fetch_add(
+                    (uint64_t)written, std::memory_order_relaxed
+                );
+        }
+        
+        void _format_deferred(
+            fmt::memory_buffer& buf, const deferred_record_t& rec) const
+        {
+            uint32_t fmt_id = _format_id(buf, rec.fmt_str);
+            uint32_t path_id = _path_id(buf, rec);
+            
+            int64_t ns = _ns(rec.time);
+            _payload.clear();
+            if(_last_ns == 0){
+                _internal::put(_payload, ns);
+                _entry(buf, binary::entry_type::time, _payload);
+                _payload.clear();
+                _last_ns = ns;
+            }
+            
+            binary::put_varint(_payload, binary::zigzag(ns - _last_ns));
+            _last_ns = ns;
+            _payload.push_back((char)rec.lvl);
+            binary::put_varint(_payload, path_id);
+            binary::put_varint(_payload, fmt_id);
+            binary::compact_args(_payload, rec.args, rec.args + rec.args_size);
+            _entry(buf, binary::entry_type::record, _payload);
+        }
+        
+        uint32_t _format_id(fmt::memory_buffer& buf, const char* f) const
+        {
+            auto it = _formats.find(f);
+            if(it != _formats.end())
+                return it->second;
+            
+            uint32_t id = (uint32_t)_formats.size();
+            _formats[f] = id;
+            _define(buf, binary::entry_type::format, id, f);
+            return id;
+        }
+        
+        uint32_t _path_id(
+            fmt::memory_buffer& buf, const deferred_record_t& rec) const
+        {
+            // the records of logger_t carry their interned path id.
+            uint32_t id = rec.path_id;
+            if(id == _internal::no_path_id)
+                id = _internal::paths().intern(rec.path);
+            
+            if(id >= _paths.size())
+                _paths.resize(id +1, false);
+            if(!_paths[id]){
+                _paths[id] = true;
+                _define(buf, binary::entry_type::path, id, rec.path);
+            }
+            return id;
+        }
+        
+        void _define(
+            fmt::memory_buffer& buf, binary::entry_type type,
+            uint32_t id, md::string_view val) const
+        {
+            _payload.clear();
+            binary::put_varint(_payload, id);
+            _payload.append(val.data(), val.data() + val.size());
+            _entry(buf, type, _payload);
+        }
+        
+        static void _entry(
+            fmt::memory_buffer& buf, binary::entry_type type,
+            const fmt::memory_buffer& payload)
+        {
+            buf.push_back((char)type);
+            binary::put_varint(buf, payload.size());
+            buf.append(payload.data(), payload.data() + payload.size());
+        }
+        
+        static int64_t _ns(log_clock::time_point time)
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                time.time_since_epoch()
+            ).count();
+        }
+        
+        int _fd;
+        mutable std::mutex _mutex;
+        // the state below is guarded by _mutex.
+        mutable int64_t _last_ns;
+        mutable fmt::memory_buffer _payload;
+        mutable std::unordered_map<const char*, uint32_t> _formats;
+        // the interned path ids already defined in the file.
+        mutable std::vector<bool> _paths;
+    };
+    
+} // ns: md::log::sinks
+
+}}//::md::log
+#endif//_tools_md_logging_binary_h
@@ -0,0 +1,464 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _tools_md_logging_ring_h
+#define _tools_md_logging_ring_h
+
+#include "logging_binary.h"
+
+#include <sys/mman.h>
+#include <atomic>
+#include <mutex>
+
+namespace md { namespace log{
+
+/*!
+ * memory mapped ring log files, written by sinks::mmap_ring_sink and
+ * read by ring::reader_t or md-logcat while the process runs or after
+ * it died, the pages of a MAP_SHARED mapping are written back by the
+ * kernel.
+ * 
+ * the file is a header_t followed by capacity bytes of records. head
+ * and tail are byte positions since the creation of the file, the data
+ * offset of a position is position % capacity. the records between
+ * tail and head are kept, a record reserves its place by moving head
+ * and moves tail past the oldest records it overwrites.
+ * 
+ * a record is a record_header_t, the path and the message, padded to 8
+ * bytes. its end is stored last, a record is complete once end is the
+ * position after it. a record doesn't wrap around, the space left at
+ * the end of the data is skipped, by a padding record when a
+ * record_header_t fits in it.
+ */
+namespace ring{
+    
+    static const char magic[8] = {'M', 'D', 'L', 'O', 'G', 'R', 'N', 'G'};
+    static const uint32_t version = 1;
+    static const size_t data_offset = 64;
+    
+    struct header_t
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t data_offset;
+        uint64_t capacity;
+        std::atomic<uint64_t> head;
+        std::atomic<uint64_t> tail;
+    };
+    
+    enum class record_type : uint8_t
+    {
+        record  = 1,
+        padding = 2,
+    };
+    
+    struct record_header_t
+    {
+        std::atomic<uint64_t> end;
+        int64_t time;// in nanoseconds.
+        uint32_t size;// the path and the message.
+        record_type type;
+        uint8_t lvl;
+        uint16_t path_size;
+    };
+    
+    static_assert(
+        sizeof(header_t) <= data_offset && sizeof(record_header_t) == 24,
+        "unexpected ring log layout"
+    );
+    static_assert(
+        ATOMIC_LLONG_LOCK_FREE == 2,
+        "the ring log cursors must be lock free to be shared"
+    );
+    
+    inline uint64_t record_size(size_t size)
+    {
+        return (sizeof(record_header_t) + size + 7) & ~(uint64_t)7;
+    }
+    
+    /*!
+     * read the records of a ring log file, from the oldest one kept.
+     * the reader doesn't block the writer, the records overwritten while
+     * read are skipped and counted by overruns.
+     * 
+     *	example:
+     *      md::log::ring::reader_t rd("/var/log/app.mdring");
+     *      md::log::binary::record_t rec;
+     *      for(;;){
+     *          while(rd.next(rec))
+     *              std::cout << rec.msg << std::endl;
+     *          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+     *      }
+     */
+    class reader_t
+    {
+    public:
+        reader_t(bfs::path filename)
+            : _map(nullptr), _map_size(0), _overruns(0)
+        {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if(fd < 0)
+                throw MD_ERR("Unable to open '{}'", filename.string());
+            
+            struct stat sb;
+            if(fstat(fd, &sb) == 0 && (size_t)sb.st_size > data_offset){
+                _map_size = (size_t)sb.st_size;
+                _map = mmap(
+                    nullptr, _map_size, PROT_READ, MAP_SHARED, fd, 0
+                );
+            }
+            close(fd);
+            if(_map == nullptr || _map == MAP_FAILED){
+                _map = nullptr;
+                throw MD_ERR("Not a ring log file!");
+            }
+            
+            _hdr = (const header_t*)_map;
+            if(memcmp(_hdr->magic, magic, sizeof(magic)) != 0 ||
+                _hdr->data_offset != data_offset ||
+                _hdr->capacity != _map_size - data_offset
+            ){
+                munmap(_map, _map_size);
+                throw MD_ERR("Not a ring log file!");
+            }
+            if(_hdr->version != version){
+                uint32_t ver = _hdr->version;
+                munmap(_map, _map_size);
+                throw MD_ERR("Unsupported ring log version: {}", ver);
+            }
+            
+            _data = (const char*)_map + data_offset;
+            _cap = _hdr->capacity;
+            _pos = _hdr->tail.load(std::memory_order_acquire);
+        }
+        
+        ~reader_t()
+        {
+            if(_map)
+                munmap(_map, _map_size);
+        }
+        
+        reader_t(const reader_t&) = delete;
+        reader_t& operator=(const reader_t&) = delete;
+        
+        /*!
+         * read the next complete record, false once the reader caught up
+         * with the writers, next can be called again later to follow the
+         * file.
+         */
+        bool next(binary::record_t& rec)
+        {
+            for(;;){
+                uint64_t tail = _hdr->tail.load(std::memory_order_acquire);
+                if(_pos < tail){
+                    ++_overruns;
+                    _pos = tail;
+                }
+                if(_pos >= _hdr->head.load(std::memory_order_acquire))
+                    return false;
+                
+                size_t off = (size_t)(_pos % _cap);
+                if(_cap - off < sizeof(record_header_t)){
+                    _pos += _cap - off;
+                    continue;
+                }
+                
+                auto rh = (const record_header_t*)(_data + off);
+                uint64_t end = rh->end.load(std::memory_order_acquire);
+                if(end <= _pos || end - _pos > _cap){
+                    // not complete yet, unless it was overwritten.
+                    if(_hdr->tail.load(std::memory_order_acquire) > _pos)
+                        continue;
+                    return false;
+                }
+                
+                record_type type = rh->type;
+                uint32_t size = rh->size;
+                uint16_t path_size = rh->path_size;
+                if(type == record_type::record &&
+                    record_size(size) == end - _pos && path_size <= size
+                ){
+                    const char* p = (const char*)(rh + 1);
+                    rec.time = log_clock::time_point(
+                        std::chrono::duration_cast<log_clock::duration>(
+                            std::chrono::nanoseconds(rh->time)
+                        )
+                    );
+                    rec.lvl = (log_level)rh->lvl;
+                    _buf.assign(p, size);
+                }else
+                    type = record_type::padding;
+                
+                // the copy is valid if the record wasn't overwritten.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(_hdr->tail.load(std::memory_order_relaxed) > _pos)
+                    continue;
+                
+                _pos = end;
+                if(type != record_type::record)
+                    continue;
+                rec.path = md::string_view(_buf.data(), path_size);
+                rec.msg = md::string_view(
+                    _buf.data() + path_size, _buf.size() - path_size
+                );
+                return true;
+            }
+        }
+        
+        /// the number of times the writers overwrote unread records.
+        size_t overruns() const { return _overruns;}
+        
+    private:
+        void* _map;
+        size_t _map_size;
+        const header_t* _hdr;
+        const char* _data;
+        uint64_t _cap;
+        uint64_t _pos;
+        size_t _overruns;
+        std::string _buf;
+    };
+    
+} // ns: md::log::ring
+
+namespace sinks{
+    
+    /*!
+     * write the records to the memory mapped ring of md::log::ring, a
+     * record is copied to the mapping without any syscall and the oldest
+     * records are overwritten once the ring is full. the file keeps the
+     * records of a crashed process, flush syncs it to disk.
+     * 
+     * the capacity is rounded up to the page size, a record is cut to a
+     * quarter of it. an existing ring of the same capacity is appended
+     * to, its incomplete records are dropped. the writers hold a mutex
+     * through the copy of a record, a slow writer can't be lapped by the
+     * others and overwrite a newer record. a single process writes to a
+     * ring.
+     * 
+     *	example:
+     *      auto snk = std::make_shared<md::log::sinks::mmap_ring_sink>(
+     *          "/var/log/app.mdring", 16 * 1024 * 1024
+     *      );
+     *      md::log::logger_t log("/app", snk);
+     *      log.info("started");
+     *      // md-logcat -f /var/log/app.mdring
+     */
+    class mmap_ring_sink
+        : public logger_sink_t
+    {
+    public:
+        mmap_ring_sink(bfs::path filename, size_t capacity)
+            : logger_sink_t(log_level::info), _map(nullptr)
+        {
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            _cap = std::max(
+                (capacity + page -1) / page * page, page
+            );
+            _map_size = ring::data_offset + _cap;
+            
+            int fd = open(
+                filename.c_str(), O_RDWR | O_CREAT,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP//ug+wr
+            );
+            if(fd < 0)
+                throw MD_ERR("Unable to open '{}'", filename.string());
+            
+            struct stat sb;
+            bool reuse = fstat(fd, &sb) == 0 &&
+                (size_t)sb.st_size == _map_size;
+            // the blocks are allocated now, not on a page fault of a
+            // write to the mapping.
+            int err = reuse ? 0 : ftruncate(fd, 0);
+            if(err == 0 && !reuse)
+                err = posix_fallocate(fd, 0, (off_t)_map_size);
+            if(err == 0){
+                _map = mmap(
+                    nullptr, _map_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0
+                );
+                if(_map == MAP_FAILED)
+                    _map = nullptr;
+            }
+            close(fd);
+            if(_map == nullptr)
+                throw MD_ERR(
+                    "Unable to map '{}': {}",
+                    filename.string(), strerror(err ? err : errno)
+                );
+            
+            _hdr = (ring::header_t*)_map;
+            _data = (char*)_map + ring::data_offset;
+            if(!reuse ||
+                memcmp(_hdr->magic, ring::magic, sizeof(ring::magic)) != 0 ||
+                _hdr->version != ring::version ||
+                _hdr->data_offset != ring::data_offset ||
+                _hdr->capacity != _cap
+            )
+                _init();
+            else
+                _recover();
+        }
+        
+        ~mmap_ring_sink()
+        {
+            if(_map)
+                munmap(_map, _map_size);
+        }
+        
+        void log(
+            md::string_view log_path,
+            log_level lvl, md::string_view msg) const
+        {
+            // a record takes at most a quarter of the ring, the path is
+            // cut first so the message size can't wrap around.
+            size_t max_size = _cap / 4 - sizeof(ring::record_header_t);
+            size_t path_size = std::min(
+                std::min(
+                    log_path.size(),
+                    (size_t)std::numeric_limits<uint16_t>::max()
+                ),
+                max_size
+            );
+            size_t msg_size = std::min(msg.size(), max_size - path_size);
+            size_t size = path_size + msg_size;
+            uint64_t need = ring::record_size(size);
+            int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                log_clock::now().time_since_epoch()
+            ).count();
+            
+            {
+                // the record is copied with the lock held, the writers
+                // reserving after it would otherwise lap a preempted one.
+                std::unique_lock<std::mutex> lock(_mutex);
+                uint64_t pos = _hdr->head.load(std::memory_order_relaxed);
+                uint64_t skip = 0;
+                size_t off = (size_t)(pos % _cap);
+                if(_cap - off < need)
+                    skip = _cap - off;
+                _release(pos + skip + need);
+                
+                ring::record_header_t* rh;
+                if(skip >= sizeof(ring::record_header_t)){
+                    rh = (ring::record_header_t*)(_data + off);
+                    rh->type = ring::record_type::padding;
+                    rh->size = (uint32_t)(skip - sizeof(ring::record_header_t));
+                    rh->end.store(pos + skip, std::memory_order_release);
+                }
+                pos += skip;
+                
+                rh = (ring::record_header_t*)(_data + (size_t)(pos % _cap));
+                rh->type = ring::record_type::record;
+                rh->size = (uint32_t)size;
+                _hdr->head.store(pos + need, std::memory_order_release);
+                
+                rh->time = now;
+                rh->lvl = (uint8_t)lvl;
+                rh->path_size = (uint16_t)path_size;
+                char* p = (char*)(rh + 1);
+                memcpy(p, log_path.data(), path_size);
+                memcpy(p + path_size, msg.data(), msg_size);
+                rh->end.store(pos + need, std::memory_order_release);
+            }
+            _counters.bytes.fetch_add(size, std::memory_order_relaxed);
+        }
+        
+        /// sync the mapping to disk.
+        void flush() const
+        {
+            msync(_map, _map_size, MS_SYNC);
+        }
+        
+        /// the size of the records ring.
+        size_t capacity() const { return _cap;}
+        
+    private:
+        void _init()
+        {
+            memset(_map, 0, _map_size);
+            memcpy(_hdr->magic, ring::magic, sizeof(ring::magic));
+            _hdr->version = ring::version;
+            _hdr->data_offset = ring::data_offset;
+            _hdr->capacity = _cap;
+            _hdr->head.store(0);
+            _hdr->tail.store(0);
+        }
+        
+        /// drop the records left incomplete by a previous writer.
+        void _recover()
+        {
+            uint64_t pos = _hdr->tail.load();
+            uint64_t head = _hdr->head.load();
+            while(pos < head){
+                size_t off = (size_t)(pos % _cap);
+                if(_cap - off < sizeof(ring::record_header_t)){
+                    pos += _cap - off;
+                    continue;
+                }
+                auto rh = (ring::record_header_t*)(_data + off);
+                uint64_t end = rh->end.load();
+                if(end != pos + ring::record_size(rh->size))
+                    break;
+                pos = end;
+            }
+            _hdr->head.store(std::min(pos, head));
+        }
+        
+        /*!
+         * move tail past the records overwritten up to end, called with
+         * _mutex locked. the sizes of the reserved records are set with
+         * it too.
+         */
+        void _release(uint64_t end) const
+        {
+            uint64_t tail = _hdr->tail.load(std::memory_order_relaxed);
+            if(end - tail <= _cap)
+                return;
+            while(end - tail > _cap){
+                size_t off = (size_t)(tail % _cap);
+                if(_cap - off < sizeof(ring::record_header_t)){
+                    tail += _cap - off;
+                    continue;
+                }
+                auto rh = (ring::record_header_t*)(_data + off);
+                tail += ring::record_size(rh->size);
+            }
+            _hdr->tail.store(tail, std::memory_order_release);
+            // the readers see the new tail before the overwritten data.
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+        
+        void* _map;
+        size_t _map_size;
+        size_t _cap;
+        ring::header_t* _hdr;
+        char* _data;
+        mutable std::mutex _mutex;
+    };
+    
+} // ns: md::log::sinks
+
+}}//::md::log
+#endif//_tools_md_logging_ring_h
@@ -105,7 +105,9 @@ namespace fmt {
         
         template <typename FormatContext>
         auto format(const md::string_view &s, FormatContext &ctx) {
-            return format_to(ctx.out(), "{}", s.data());
+            return format_to(
+                ctx.out(), "{}", fmt::string_view(s.data(), s.size())
+            );
         }
     };
 }
@@ -29,12 +29,18 @@ SOFTWARE.
 #include "enums.h"
 #include "errors.h"
 #include "logging.h"
+#include "logging_async.h"
+#include "logging_binary.h"
+#include "logging_ring.h"
 #include "date_time.h"
 #include "traits.h"
 #include "callbacks.h"
 #include "text.h"
 #include "event_queue.h"
 #include "event_strand.h"
+#include "virtual_event_queue.h"
+#include "event_queue_pool.h"
+#include "channel.h"
 #include "async.h"
 #include "delegate.h"
 #include "jagged_vector.h"
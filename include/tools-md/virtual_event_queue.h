@@ -0,0 +1,144 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _tools_md_virtual_event_queue_h
+#define _tools_md_virtual_event_queue_h
+
+#include "event_queue.h"
+
+#include <map>
+#include <mutex>
+
+namespace md{
+
+#ifdef MD_THREAD_SAFE
+#define MD_LOCK_VIRTUAL_QUEUE std::unique_lock<std::mutex> lock(_vmutex)
+#define MD_UNLOCK_VIRTUAL_QUEUE lock.unlock()
+#else
+#define MD_LOCK_VIRTUAL_QUEUE
+#define MD_UNLOCK_VIRTUAL_QUEUE
+#endif
+
+class virtual_event_queue_t;
+typedef std::shared_ptr< md::virtual_event_queue_t > virtual_event_queue;
+
+/*!
+ * event_queue_t with a virtual clock, the delayed tasks are kept in a
+ * timer list and only become due when the clock is moved forward with
+ * advance or run_until_idle. the tasks run in the same order on every
+ * run and without any real wait.
+ * 
+ *	example:
+ *      auto vq = std::make_shared<md::virtual_event_queue_t>();
+ *      md::async::retry(vq, 3, 100, task, end_cb);
+ *      vq->run_until_idle();
+ *      // vq->now() == 300 if the first two attempts failed.
+ */
+class virtual_event_queue_t
+    : public event_queue_t
+{
+public:
+    virtual_event_queue_t()
+        : event_queue_t(), _now(0)
+    {
+    }
+    
+    /// virtual time in milliseconds since the queue was created.
+    uint64_t now() const
+    {
+        MD_LOCK_VIRTUAL_QUEUE;
+        return _now;
+    }
+    
+    size_t timer_count() const
+    {
+        MD_LOCK_VIRTUAL_QUEUE;
+        return _timers.size();
+    }
+    
+    virtual void push_back_delayed(uint32_t delay_ms, event_task_fn task)
+    {
+        if(delay_ms == 0){
+            this->push_back(task);
+            return;
+        }
+        
+        MD_LOCK_VIRTUAL_QUEUE;
+        // equal deadlines keep their insertion order.
+        _timers.emplace(_now + delay_ms, task);
+    }
+    
+    /*!
+     * move the clock forward by ms, the timers due are pushed in
+     * deadline order and the queue is run after each one of them.
+     */
+    void advance(uint64_t ms)
+    {
+        uint64_t target = this->now() + ms;
+        this->run(0);
+        while(_fire_next(target))
+            this->run(0);
+        
+        MD_LOCK_VIRTUAL_QUEUE;
+        _now = target;
+    }
+    
+    /*!
+     * run the queue until no task nor timer is left, the clock jumps
+     * to the next deadline each time the queue is empty.
+     */
+    void run_until_idle()
+    {
+        this->run(0);
+        while(_fire_next(UINT64_MAX))
+            this->run(0);
+    }
+    
+private:
+    bool _fire_next(uint64_t target)
+    {
+        MD_LOCK_VIRTUAL_QUEUE;
+        auto it = _timers.begin();
+        if(it == _timers.end() || it->first > target)
+            return false;
+        
+        event_task_fn task = it->second;
+        _now = it->first;
+        _timers.erase(it);
+        MD_UNLOCK_VIRTUAL_QUEUE;
+        
+        this->push_back(task);
+        return true;
+    }
+    
+    #ifdef MD_THREAD_SAFE
+    mutable std::mutex _vmutex;
+    #endif
+    uint64_t _now;
+    std::multimap<uint64_t, event_task_fn> _timers;
+};
+
+}//::md
+#endif //_tools_md_virtual_event_queue_h
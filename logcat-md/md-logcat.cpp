@@ -0,0 +1,187 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "tools-md/tools-md.h"
+
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+/*
+ * decode the files of md::log::sinks::binary_file_sink and
+ * md::log::sinks::mmap_ring_sink to the rotating_file_sink text layout.
+ * 
+ *  md-logcat [-l level] [-p path] [-f] file...
+ */
+
+static void usage(std::ostream& out)
+{
+    out << "Usage: md-logcat [options] file...\n"
+        "  -h, --help          produce help message\n"
+        "  -l, --level LEVEL   only the records up to LEVEL, a name or a number\n"
+        "  -p, --path PATH     only the records of the loggers under PATH\n"
+        "  -f, --follow        wait for the new records of a ring log file\n";
+}
+
+static bool parse_level(const std::string& val, md::log::log_level& lvl)
+{
+    if(!val.empty() && std::all_of(val.begin(), val.end(), ::isdigit)){
+        int l = std::stoi(val);
+        if(l > (int)md::log::log_level::trace)
+            return false;
+        lvl = (md::log::log_level)l;
+        return true;
+    }
+    
+    for(int l = 0; l <= (int)md::log::log_level::trace; ++l){
+        auto name = md::log::to_string((md::log::log_level)l);
+        if(name.size() == val.size() &&
+            std::equal(val.begin(), val.end(), name.begin(),
+                [](char a, char b){ return ::toupper(a) == b;}
+            )
+        ){
+            lvl = (md::log::log_level)l;
+            return true;
+        }
+    }
+    return false;
+}
+
+static md::log::log_level max_lvl = md::log::log_level::trace;
+static std::string path_prefix;
+
+static void print(const md::log::binary::record_t& rec)
+{
+    static fmt::memory_buffer buf;
+    if(rec.lvl > max_lvl ||
+        rec.path.substr(0, path_prefix.size()) != path_prefix
+    )
+        return;
+    
+    buf.clear();
+    buf.push_back('[');
+    md::log::_internal::get_timestamp(buf, rec.time);
+    fmt::format_to(
+        std::back_inserter(buf), "] [{}:{}] {}\n",
+        md::log::to_string(rec.lvl), rec.path, rec.msg
+    );
+    std::cout.write(buf.data(), buf.size());
+}
+
+static bool is_ring(std::istream& in)
+{
+    char hdr[sizeof(md::log::ring::magic)];
+    bool ring = in.read(hdr, sizeof(hdr)) &&
+        memcmp(hdr, md::log::ring::magic, sizeof(hdr)) == 0;
+    in.clear();
+    in.seekg(0);
+    return ring;
+}
+
+static void cat_ring(const std::string& f, bool follow)
+{
+    md::log::ring::reader_t rd(f);
+    md::log::binary::record_t rec;
+    size_t overruns = 0;
+    for(;;){
+        while(rd.next(rec))
+            print(rec);
+        if(rd.overruns() != overruns){
+            std::cerr << f << ": " << rd.overruns() - overruns <<
+                " overwritten while read" << std::endl;
+            overruns = rd.overruns();
+        }
+        if(!follow)
+            return;
+        std::cout.flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool follow = false;
+    std::vector<std::string> files;
+    
+    for(int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if(arg == "-h" || arg == "--help"){
+            usage(std::cout);
+            return 0;
+        }
+        if(arg == "-f" || arg == "--follow"){
+            follow = true;
+            continue;
+        }
+        if(arg == "-l" || arg == "--level" || arg == "-p" || arg == "--path"){
+            if(i + 1 >= argc){
+                usage(std::cerr);
+                return 1;
+            }
+            std::string val = argv[++i];
+            if(arg[1] == 'p' || arg == "--path")
+                path_prefix = val;
+            else if(!parse_level(val, max_lvl)){
+                std::cerr << "Invalid log level: " << val << std::endl;
+                return 1;
+            }
+            continue;
+        }
+        files.emplace_back(arg);
+    }
+    
+    if(files.empty()){
+        usage(std::cerr);
+        return 1;
+    }
+    
+    int ret = 0;
+    for(auto& f : files){
+        std::ifstream in(f, std::ios::binary);
+        if(!in){
+            std::cerr << "Unable to open '" << f << "'" << std::endl;
+            ret = 1;
+            continue;
+        }
+        
+        try{
+            if(is_ring(in)){
+                // only the last ring file can be followed.
+                cat_ring(f, follow && &f == &files.back());
+                continue;
+            }
+            
+            md::log::binary::reader_t rd(in);
+            md::log::binary::record_t rec;
+            while(rd.next(rec))
+                print(rec);
+        }catch(const std::exception& err){
+            std::cerr << f << ": " << err.what() << std::endl;
+            ret = 1;
+        }
+    }
+    
+    return ret;
+}
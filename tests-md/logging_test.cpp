@@ -0,0 +1,1147 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gmock/gmock.h>
+#include "md_test_base.h"
+
+#include <fstream>
+
+namespace md{ namespace tests{
+
+class logging_test
+    : public md_test_base
+{
+public:
+    void SetUp() override
+    {
+        md_test_base::SetUp();
+        
+    }
+    
+    void TearDown() override
+    {
+        md_test_base::TearDown();
+        
+    }
+};
+
+// keep the records written by the sinks under test.
+class memory_sink
+    : public md::log::sinks::logger_sink_t
+{
+public:
+    memory_sink()
+        : md::log::sinks::logger_sink_t(md::log::log_level::trace),
+        writes(0)
+    {
+    }
+    
+    void log(
+        md::string_view log_path,
+        md::log::log_level lvl, md::string_view msg) const
+    {
+        fmt::memory_buffer buf;
+        format(buf, md::log::log_clock::now(), log_path, lvl, msg);
+        struct iovec iov = {buf.data(), buf.size()};
+        write(&iov, 1);
+    }
+    
+    void format(
+        fmt::memory_buffer& buf, md::log::log_clock::time_point /*time*/,
+        md::string_view log_path,
+        md::log::log_level /*lvl*/, md::string_view msg) const
+    {
+        fmt::format_to(std::back_inserter(buf), "{}:{}", log_path, msg);
+    }
+    
+    void write(const struct iovec* iov, int iovcnt) const
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++writes;
+        for(int i = 0; i < iovcnt; ++i)
+            records.emplace_back((const char*)iov[i].iov_base, iov[i].iov_len);
+    }
+    
+    bool can_write() const { return true;}
+    
+    mutable std::mutex mutex;
+    mutable std::vector<std::string> records;
+    mutable size_t writes;
+};
+
+
+TEST_F(logging_test, async_sink_test)
+{
+    try{
+        auto msnk = std::make_shared<memory_sink>();
+        auto asnk = std::make_shared<md::log::sinks::async_sink>(msnk, 64);
+        md::log::logger_t log("/async", asnk);
+        
+        std::vector<std::thread> threads;
+        for(int t = 0; t < 4; ++t)
+            threads.emplace_back([&log, t](){
+                for(int i = 0; i < 1000; ++i)
+                    log.info("{}-{}", t, i);
+            });
+        for(auto& t : threads)
+            t.join();
+        log.flush();
+        
+        ASSERT_THAT(msnk->records.size(), testing::Eq(4000U));
+        ASSERT_THAT(msnk->writes, testing::Le(msnk->records.size()));
+        
+        // the records of a thread keep their order.
+        int last = -1;
+        for(auto& r : msnk->records){
+            if(r.compare(0, 9, "/async:0-") != 0)
+                continue;
+            int i = std::stoi(r.substr(9));
+            ASSERT_THAT(i, testing::Gt(last));
+            last = i;
+        }
+        ASSERT_THAT(last, testing::Eq(999));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, async_sink_overflow_test)
+{
+    try{
+        auto msnk = std::make_shared<memory_sink>();
+        std::unique_lock<std::mutex> lock(msnk->mutex);
+        size_t dropped = 0;
+        {
+            // the writer is blocked by the lock, the ring fills up.
+            auto asnk = std::make_shared<md::log::sinks::async_sink>(
+                msnk, 8, md::log::overflow_policy::count
+            );
+            for(int i = 0; i < 100; ++i)
+                asnk->log("/", md::log::log_level::info, "overflow");
+            dropped = asnk->dropped();
+            ASSERT_THAT(dropped, testing::Ge(100U - 8 - 64));
+            lock.unlock();
+        }
+        
+        ASSERT_THAT(msnk->records.size(), testing::Eq(100 - dropped + 1));
+        ASSERT_THAT(
+            msnk->records.back(),
+            testing::HasSubstr("log records were dropped")
+        );
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, deferred_format_test)
+{
+    try{
+        enum class color { red = 2 };
+        auto msnk = std::make_shared<memory_sink>();
+        md::log::logger_t log("/defer", msnk, md::log::log_level::trace);
+        
+        std::string name = "disk";
+        log.defer(md::log::log_level::info,
+            "{} {:>4}|{:x}|{:.2f}|{}|{}|{}|{1}|{{}}",
+            name, 42, 255U, 1.5, true, 'c', color::red
+        );
+        log.defer(md::log::log_level::trace, "no args");
+        ASSERT_THAT(msnk->records, testing::ElementsAre(
+            "/defer:disk   42|ff|1.50|true|c|2|42|{}",
+            "/defer:no args"
+        ));
+        
+        msnk->records.clear();
+        auto asnk = std::make_shared<md::log::sinks::async_sink>(msnk, 64);
+        md::log::logger_t alog("/async", asnk, md::log::log_level::trace);
+        for(int i = 0; i < 100; ++i){
+            alog.defer(md::log::log_level::debug, "deferred {}", i);
+            alog.info("text {}", i);
+        }
+        alog.flush();
+        
+        ASSERT_THAT(msnk->records.size(), testing::Eq(200U));
+        ASSERT_THAT(msnk->records[198], testing::Eq("/async:deferred 99"));
+        ASSERT_THAT(msnk->records[199], testing::Eq("/async:text 99"));
+        
+        // a bad spec is only found by the writer thread.
+        msnk->records.clear();
+        alog.defer(md::log::log_level::info, "{:d}", std::string("x"));
+        alog.flush();
+        ASSERT_THAT(msnk->records.size(), testing::Eq(1U));
+        ASSERT_THAT(
+            msnk->records[0].find("/async:{:d} [format error: "),
+            testing::Eq(0U)
+        );
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, binary_sink_test)
+{
+    try{
+        std::string fn = fmt::format("/tmp/md_binary_sink_{}.mdlog", getpid());
+        {
+            auto bsnk = std::make_shared<md::log::sinks::binary_file_sink>(fn);
+            bsnk->set_level(md::log::log_level::trace);
+            auto log = std::make_shared<md::log::logger_t>(
+                "/bin", bsnk, md::log::log_level::trace
+            );
+            auto child = log->add_child("child");
+            for(int i = 0; i < 3; ++i){
+                log->defer(md::log::log_level::info, "value {} {}", i, "s");
+                child->defer(md::log::log_level::debug, "child {:.1f}", 0.5);
+            }
+            log->warn("text {}", 1);
+            
+            auto asnk = std::make_shared<md::log::sinks::async_sink>(bsnk);
+            md::log::logger_t alog("/async", asnk, md::log::log_level::trace);
+            alog.defer(md::log::log_level::error, "async {}", 2U);
+            alog.flush();
+        }
+        
+        std::vector<std::string> lines;
+        {
+            std::ifstream in(fn, std::ios::binary);
+            md::log::binary::reader_t rd(in);
+            md::log::binary::record_t rec;
+            while(rd.next(rec))
+                lines.emplace_back(fmt::format(
+                    "{}:{}:{}", md::log::to_string(rec.lvl), rec.path, rec.msg
+                ));
+        }
+        unlink(fn.c_str());
+        
+        ASSERT_THAT(lines, testing::ElementsAre(
+            "INFO:/bin:value 0 s", "DEBUG:/bin/child:child 0.5",
+            "INFO:/bin:value 1 s", "DEBUG:/bin/child:child 0.5",
+            "INFO:/bin:value 2 s", "DEBUG:/bin/child:child 0.5",
+            "WARNING:/bin:text 1",
+            "ERROR:/async:async 2"
+        ));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, timestamp_test)
+{
+    try{
+        auto base = md::log::log_clock::now();
+        fmt::memory_buffer buf;
+        // across second boundaries and back in time.
+        for(int64_t ms : {0, 1, 999, 1000, 1001, 61500, 999, -1, 3600000}){
+            auto t = base + std::chrono::milliseconds(ms);
+            buf.clear();
+            md::log::_internal::get_timestamp(buf, t);
+            
+            time_t sec = md::log::log_clock::to_time_t(t);
+            if(md::log::log_clock::from_time_t(sec) > t)
+                --sec;
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            auto expected = fmt::format(
+                "{:04}-{:02}-{:02} {:02}:{:02}:{:02}.{:03}",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                tm.tm_hour, tm.tm_min, tm.tm_sec,
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    t - md::log::log_clock::from_time_t(sec)
+                ).count()
+            );
+            ASSERT_THAT(
+                std::string(buf.data(), buf.size()), testing::Eq(expected)
+            );
+            ASSERT_THAT(
+                md::log::_internal::get_timestamp(t), testing::Eq(expected)
+            );
+        }
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, level_macros_test)
+{
+    try{
+        auto msnk = std::make_shared<memory_sink>();
+        auto log = std::make_shared<md::log::logger_t>(
+            "/macro", msnk, md::log::log_level::info
+        );
+        int evaluated = 0;
+        auto arg = [&evaluated](){ return ++evaluated;};
+        
+        MD_LOG_TRACE(log, "trace {}", arg());
+        MD_LOG_DEBUG(log, "debug {}", arg());
+        MD_LOG_INFO(log, "info {}", arg());
+        MD_LOG_WARN(log, "warn {}", arg());
+        MD_LOG_ERROR(log, "error");
+        
+        ASSERT_THAT(evaluated, testing::Eq(2));
+        ASSERT_THAT(msnk->records, testing::ElementsAre(
+            "/macro:info 1", "/macro:warn 2", "/macro:error"
+        ));
+        static_assert(
+            md::log::active_level == md::log::log_level::trace,
+            "the tests are built with every level"
+        );
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, hierarchy_test)
+{
+    try{
+        auto a = std::make_shared<memory_sink>();
+        auto b = std::make_shared<memory_sink>();
+        auto c = std::make_shared<memory_sink>();
+        auto root = std::make_shared<md::log::logger_t>("/", a);
+        auto child = root->add_child("child");
+        auto leaf = child->add_child("leaf");
+        
+        leaf->info("1");
+        root->register_sink(b);
+        leaf->info("2");
+        ASSERT_THAT(a->records, testing::ElementsAre(
+            "/child/leaf:1", "/child/leaf:2"
+        ));
+        ASSERT_THAT(b->records, testing::ElementsAre("/child/leaf:2"));
+        
+        // the levels follow the closest ancestor with its own level.
+        root->set_level(md::log::log_level::warning);
+        ASSERT_FALSE(leaf->should_log(md::log::log_level::info));
+        child->set_level(md::log::log_level::debug);
+        ASSERT_TRUE(leaf->should_log(md::log::log_level::debug));
+        ASSERT_FALSE(root->should_log(md::log::log_level::info));
+        child->reset_level();
+        ASSERT_FALSE(leaf->should_log(md::log::log_level::info));
+        
+        ASSERT_FALSE(leaf->log_err_stack());
+        root->log_err_stack(true);
+        ASSERT_TRUE(leaf->log_err_stack());
+        child->log_err_stack(false);
+        ASSERT_FALSE(leaf->log_err_stack());
+        child->reset_err_stack();
+        ASSERT_TRUE(leaf->log_err_stack());
+        
+        leaf->replace_sink(c);
+        leaf->warn("3");
+        ASSERT_THAT(a->records.size(), testing::Eq(2U));
+        ASSERT_THAT(c->records, testing::ElementsAre("/child/leaf:3"));
+        
+        // children added and settings changed while other threads log.
+        std::vector<std::thread> threads;
+        std::vector<md::log::logger> kept[2];
+        for(int t = 0; t < 2; ++t)
+            threads.emplace_back([&root, &kept, t](){
+                for(int i = 0; i < 200; ++i){
+                    auto l = root->add_child(fmt::format("t{}", t));
+                    l->warn("{}", i);
+                    if(i % 20 == 0)
+                        kept[t].emplace_back(l);
+                }
+            });
+        threads.emplace_back([&root](){
+            for(int i = 0; i < 200; ++i){
+                root->set_level(i % 2 ?
+                    md::log::log_level::info : md::log::log_level::error
+                );
+                root->log_err_stack(i % 2 == 0);
+                ASSERT_THAT(root->snapshot().size(), testing::Ge(3U));
+            }
+        });
+        for(auto& t : threads)
+            t.join();
+        
+        root->set_level(md::log::log_level::trace);
+        for(auto& k : kept)
+            for(auto& l : k)
+                ASSERT_TRUE(l->should_log(md::log::log_level::trace));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, interned_path_test)
+{
+    try{
+        auto msnk = std::make_shared<memory_sink>();
+        auto a = std::make_shared<md::log::logger_t>("/interned", msnk);
+        md::log::logger_t b("/interned", msnk);
+        auto child = a->add_child("child");
+        
+        ASSERT_THAT(&a->path(), testing::Eq(&b.path()));
+        ASSERT_THAT(a->path_id(), testing::Eq(b.path_id()));
+        ASSERT_THAT(child->path_id(), testing::Ne(a->path_id()));
+        ASSERT_THAT(
+            md::log::_internal::paths().path(child->path_id()),
+            testing::Eq("/interned/child")
+        );
+        
+        fmt::memory_buffer buf;
+        md::log::deferred_record_t::encode(
+            buf, "{}", md::log::log_clock::now(), md::log::log_level::info,
+            child->path(), child->path_id(), 1
+        );
+        md::log::deferred_record_t rec;
+        ASSERT_TRUE(md::log::deferred_record_t::decode(
+            buf.data(), buf.size(), rec
+        ));
+        ASSERT_THAT(rec.path_id, testing::Eq(child->path_id()));
+        ASSERT_THAT(rec.path.to_string(), testing::Eq("/interned/child"));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, rate_limit_test)
+{
+    try{
+        md::log::_internal::rate_site_t site = {};
+        uint64_t dropped = 0;
+        size_t allowed = 0;
+        for(int i = 0; i < 20; ++i)
+            if(site.allow(5, 1, 100, dropped))
+                ++allowed;
+        ASSERT_THAT(allowed, testing::Eq(5U));
+        
+        // the next second logs again and reports the suppressed records.
+        ASSERT_TRUE(site.allow(5, 1, 101, dropped));
+        ASSERT_THAT(dropped, testing::Eq(15U));
+        
+        auto msnk = std::make_shared<memory_sink>();
+        auto log = std::make_shared<md::log::logger_t>("/limit", msnk);
+        for(int i = 0; i < 30; ++i)
+            log->limit(md::log::log_level::info, {0, 10}, "sampled {}", i);
+        ASSERT_THAT(msnk->records, testing::ElementsAre(
+            "/limit:sampled 0",
+            "/limit:suppressed 9 messages like \"sampled {}\"",
+            "/limit:sampled 10",
+            "/limit:suppressed 9 messages like \"sampled {}\"",
+            "/limit:sampled 20"
+        ));
+        
+        msnk->records.clear();
+        for(int i = 0; i < 1000; ++i)
+            log->limit(md::log::log_level::error, {10}, "storm {}", i);
+        ASSERT_THAT(msnk->records.size(), testing::Ge(10U));
+        ASSERT_THAT(msnk->records.size(), testing::Lt(100U));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, rotation_test)
+{
+    try{
+        char dir_tpl[] = "/tmp/md_rotation_XXXXXX";
+        std::string dir = mkdtemp(dir_tpl);
+        std::string fn = dir + "/test.log";
+        event_base* ev_base = event_base_new();
+        {
+            auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+                ev_base, fn, 1024 * 1024, 4
+            );
+            md::log::logger_t log("/rotation", fsnk);
+            for(int r = 0; r < 4; ++r){
+                for(int i = 0; i < 50; ++i)
+                    log.info("rotation {} record {}", r, i);
+                fsnk->rotate();
+            }
+            log.info("current");
+        }
+        event_base_free(ev_base);
+        md::files::wait_async_jobs();
+        
+        auto exists = [](const std::string& f){
+            struct stat sb;
+            return stat(f.c_str(), &sb) == 0;
+        };
+        ASSERT_TRUE(exists(fn));
+        ASSERT_TRUE(exists(fn + ".1"));
+        ASSERT_TRUE(exists(fn + ".2"));
+        ASSERT_TRUE(exists(fn + ".3.gz"));
+        ASSERT_FALSE(exists(fn + ".3"));
+        ASSERT_FALSE(exists(fn + ".4.gz"));
+        
+        // .3 holds the second rotation, compressed once.
+        gzFile gz = gzopen((fn + ".3.gz").c_str(), "rb");
+        ASSERT_TRUE(gz != nullptr);
+        char buf[4096];
+        int n = gzread(gz, buf, sizeof(buf) -1);
+        gzclose(gz);
+        ASSERT_THAT(n, testing::Gt(0));
+        buf[n] = 0;
+        ASSERT_THAT(buf, testing::HasSubstr("rotation 1 record 0"));
+        
+        for(auto f : {"", ".1", ".2", ".3.gz"})
+            unlink((fn + f).c_str());
+        rmdir(dir.c_str());
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, size_rotation_test)
+{
+    try{
+        char dir_tpl[] = "/tmp/md_rotation_XXXXXX";
+        std::string dir = mkdtemp(dir_tpl);
+        std::string fn = dir + "/test.log";
+        event_base* ev_base = event_base_new();
+        {
+            auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+                ev_base, fn, 1000, 3, md::log::sinks::rotation_schedule::none,
+                true
+            );
+            md::log::logger_t log("/size", fsnk);
+            for(int i = 0; i < 30; ++i)
+                log.info("record {}", i);
+            ASSERT_THAT(fsnk->size(), testing::Lt(1000U));
+            
+            struct stat sb;
+            ASSERT_THAT(stat(fn.c_str(), &sb), testing::Eq(0));
+            ASSERT_THAT((size_t)sb.st_size, testing::Eq(fsnk->size()));
+            
+            // an external truncation is caught by the watch.
+            ASSERT_THAT(truncate(fn.c_str(), 0), testing::Eq(0));
+            event_base_loop(ev_base, EVLOOP_NONBLOCK);
+            ASSERT_THAT(fsnk->size(), testing::Eq(0U));
+            
+            // and a removal, the file is created again.
+            unlink(fn.c_str());
+            event_base_loop(ev_base, EVLOOP_NONBLOCK);
+            log.info("after removal");
+            ASSERT_THAT(stat(fn.c_str(), &sb), testing::Eq(0));
+            ASSERT_THAT((size_t)sb.st_size, testing::Eq(fsnk->size()));
+            ASSERT_THAT(fsnk->size(), testing::Gt(0U));
+            
+            // the watch needs an event_base.
+            ASSERT_THROW(
+                md::log::sinks::rotating_file_sink(
+                    nullptr, fn, 1000, 3,
+                    md::log::sinks::rotation_schedule::none, true
+                ),
+                std::runtime_error
+            );
+        }
+        event_base_free(ev_base);
+        md::files::wait_async_jobs();
+        
+        struct stat sb;
+        ASSERT_THAT(stat((fn + ".1").c_str(), &sb), testing::Eq(0));
+        ASSERT_THAT((size_t)sb.st_size, testing::Gt(1000U));
+        ASSERT_THAT((size_t)sb.st_size, testing::Lt(1100U));
+        
+        for(auto f : {"", ".1", ".2"})
+            unlink((fn + f).c_str());
+        rmdir(dir.c_str());
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, rotation_failure_test)
+{
+    try{
+        char dir_tpl[] = "/tmp/md_rotation_XXXXXX";
+        std::string dir = mkdtemp(dir_tpl);
+        std::string fn = dir + "/test.log";
+        auto warn_count = []() -> uint64_t {
+            return md::log::default_logger()->snapshot()[0].records[
+                (size_t)md::log::log_level::warning
+            ];
+        };
+        {
+            auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+                nullptr, fn, 1000, 3
+            );
+            md::log::logger_t log("/failure", fsnk);
+            log.info("first record");
+            
+            // the rename fails in a read only directory, root ignores the
+            // permissions so a directory is put in place of the target.
+            ASSERT_THAT(chmod(dir.c_str(), 0555), testing::Eq(0));
+            if(access(dir.c_str(), W_OK) == 0){
+                ASSERT_THAT(
+                    mkdir((fn + ".rotating.1").c_str(), 0755), testing::Eq(0)
+                );
+            }
+            
+            // the failed rotation is only warned once, not per record.
+            auto def_lvl = md::log::default_logger()->level();
+            md::log::default_logger()->set_level(md::log::log_level::warning);
+            uint64_t warns = warn_count();
+            for(int i = 0; i < 50; ++i)
+                log.info("record {}", i);
+            md::log::default_logger()->set_level(def_lvl);
+            ASSERT_THAT(warn_count() - warns, testing::Eq(1U));
+            ASSERT_THAT(fsnk->size(), testing::Gt(1000U));
+            
+            struct stat sb;
+            ASSERT_THAT(stat(fn.c_str(), &sb), testing::Eq(0));
+            ASSERT_THAT((size_t)sb.st_size, testing::Eq(fsnk->size()));
+            
+            ASSERT_THAT(chmod(dir.c_str(), 0755), testing::Eq(0));
+        }
+        md::files::wait_async_jobs();
+        
+        rmdir((fn + ".rotating.1").c_str());
+        unlink(fn.c_str());
+        rmdir(dir.c_str());
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, sync_policy_test)
+{
+    try{
+        char dir_tpl[] = "/tmp/md_sync_XXXXXX";
+        std::string dir = mkdtemp(dir_tpl);
+        std::string fn = dir + "/test.log";
+        
+        // only the records at or above the flush_on level are synced.
+        {
+            auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+                nullptr, fn, 1024 * 1024, 3
+            );
+            fsnk->set_sync(md::log::sinks::sync_mode::per_level);
+            md::log::logger_t log("/sync", fsnk);
+            for(int i = 0; i < 100; ++i)
+                log.info("record {}", i);
+            ASSERT_THAT(fsnk->syncs(), testing::Eq(0U));
+            log.warn("warning");
+            ASSERT_THAT(fsnk->syncs(), testing::Eq(1U));
+        }
+        
+        // a burst costs a sync per interval.
+        {
+            auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+                nullptr, fn, 1024 * 1024, 3
+            );
+            fsnk->set_sync(
+                md::log::sinks::sync_mode::periodic,
+                std::chrono::milliseconds(20)
+            );
+            md::log::logger_t log("/sync", fsnk);
+            for(int i = 0; i < 200; ++i)
+                log.warn("warning {}", i);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            ASSERT_THAT(fsnk->syncs(), testing::Ge(1U));
+            ASSERT_THAT(fsnk->syncs(), testing::Lt(20U));
+        }
+        
+        // every record is on disk when log returns, the concurrent
+        // writers share the syncs.
+        {
+            auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+                nullptr, fn, 1024 * 1024, 3
+            );
+            fsnk->set_sync(md::log::sinks::sync_mode::group_commit);
+            md::log::logger_t log("/sync", fsnk);
+            std::vector<std::thread> threads;
+            for(int t = 0; t < 4; ++t)
+                threads.emplace_back([&log, t](){
+                    for(int i = 0; i < 50; ++i)
+                        log.info("thread {} record {}", t, i);
+                });
+            for(auto& t : threads)
+                t.join();
+            ASSERT_THAT(fsnk->syncs(), testing::Ge(1U));
+            ASSERT_THAT(fsnk->syncs(), testing::Le(200U));
+        }
+        
+        std::ifstream in(fn);
+        size_t lines = 0;
+        for(std::string l; std::getline(in, l);)
+            ++lines;
+        ASSERT_THAT(lines, testing::Eq(501U));
+        
+        unlink(fn.c_str());
+        rmdir(dir.c_str());
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, mmap_ring_sink_test)
+{
+    try{
+        std::string fn = fmt::format("/tmp/md_ring_sink_{}.mdring", getpid());
+        auto read_all = [](md::log::ring::reader_t& rd){
+            std::vector<std::string> lines;
+            md::log::binary::record_t rec;
+            while(rd.next(rec))
+                lines.emplace_back(fmt::format(
+                    "{}:{}:{}", md::log::to_string(rec.lvl), rec.path, rec.msg
+                ));
+            return lines;
+        };
+        
+        {
+            auto rsnk = std::make_shared<md::log::sinks::mmap_ring_sink>(
+                fn, 100
+            );
+            ASSERT_THAT(rsnk->capacity(), testing::Ge(4096U));
+            md::log::logger_t log("/ring", rsnk);
+            log.info("first {}", 1);
+            log.warn("second");
+            
+            md::log::ring::reader_t rd(fn);
+            ASSERT_THAT(read_all(rd), testing::ElementsAre(
+                "INFO:/ring:first 1", "WARNING:/ring:second"
+            ));
+            
+            // the reader follows the writes.
+            log.error("third");
+            ASSERT_THAT(read_all(rd), testing::ElementsAre(
+                "ERROR:/ring:third"
+            ));
+            ASSERT_THAT(rd.overruns(), testing::Eq(0U));
+        }
+        
+        // the records are kept by the file and appended to.
+        {
+            auto rsnk = std::make_shared<md::log::sinks::mmap_ring_sink>(
+                fn, 100
+            );
+            md::log::logger_t log("/ring", rsnk);
+            log.info("fourth");
+            
+            md::log::ring::reader_t rd(fn);
+            ASSERT_THAT(read_all(rd), testing::ElementsAre(
+                "INFO:/ring:first 1", "WARNING:/ring:second",
+                "ERROR:/ring:third", "INFO:/ring:fourth"
+            ));
+        }
+        
+        // the oldest records are overwritten.
+        {
+            auto rsnk = std::make_shared<md::log::sinks::mmap_ring_sink>(
+                fn, 100
+            );
+            md::log::logger_t log("/ring", rsnk);
+            md::log::ring::reader_t lagging(fn);
+            for(int i = 0; i < 1000; ++i)
+                log.info("record {}", i);
+            
+            md::log::ring::reader_t rd(fn);
+            auto lines = read_all(rd);
+            ASSERT_THAT(lines.size(), testing::Gt(10U));
+            ASSERT_THAT(lines.size(), testing::Lt(1000U));
+            for(size_t i = 0; i < lines.size(); ++i)
+                ASSERT_THAT(lines[i], testing::Eq(fmt::format(
+                    "INFO:/ring:record {}", 1000 - lines.size() + i
+                )));
+            
+            ASSERT_THAT(read_all(lagging), testing::Eq(lines));
+            ASSERT_THAT(lagging.overruns(), testing::Eq(1U));
+            
+            // a message is cut to a quarter of the ring.
+            log.info(std::string(rsnk->capacity(), 'x'));
+            auto big = read_all(rd);
+            ASSERT_THAT(big.size(), testing::Eq(1U));
+            ASSERT_THAT(big[0].size(), testing::Lt(rsnk->capacity() / 4));
+            
+            // and so is a path.
+            rsnk->log(
+                std::string(rsnk->capacity(), 'p'),
+                md::log::log_level::info, "msg"
+            );
+            big = read_all(rd);
+            ASSERT_THAT(big.size(), testing::Eq(1U));
+            ASSERT_THAT(big[0].size(), testing::Lt(rsnk->capacity() / 4));
+        }
+        unlink(fn.c_str());
+        
+        // a larger ring for concurrent writers.
+        {
+            auto rsnk = std::make_shared<md::log::sinks::mmap_ring_sink>(
+                fn, 1024 * 1024
+            );
+            md::log::logger_t log("/ring", rsnk);
+            std::vector<std::thread> threads;
+            for(int t = 0; t < 4; ++t)
+                threads.emplace_back([&log, t](){
+                    for(int i = 0; i < 100; ++i)
+                        log.info("thread {} record {}", t, i);
+                });
+            for(auto& t : threads)
+                t.join();
+            
+            md::log::ring::reader_t rd(fn);
+            ASSERT_THAT(read_all(rd).size(), testing::Eq(400U));
+        }
+        unlink(fn.c_str());
+        
+        // and a small one, the writers lap each other but the records
+        // left are intact.
+        {
+            auto rsnk = std::make_shared<md::log::sinks::mmap_ring_sink>(
+                fn, 100
+            );
+            md::log::logger_t log("/ring", rsnk);
+            std::vector<std::thread> threads;
+            for(int t = 0; t < 4; ++t)
+                threads.emplace_back([&log, t](){
+                    std::string fill(700, (char)('a' + t));
+                    for(int i = 0; i < 2000; ++i)
+                        log.info("{} {}", fill, i);
+                });
+            for(auto& t : threads)
+                t.join();
+            
+            md::log::ring::reader_t rd(fn);
+            auto lines = read_all(rd);
+            ASSERT_THAT(lines.size(), testing::Gt(0U));
+            for(auto& l : lines){
+                std::string prefix = "INFO:/ring:";
+                ASSERT_THAT(
+                    l.compare(0, prefix.size(), prefix), testing::Eq(0)
+                );
+                std::string msg = l.substr(prefix.size());
+                ASSERT_THAT(msg.size(), testing::Gt(701U));
+                ASSERT_THAT(
+                    msg.substr(0, 700), testing::Eq(std::string(700, msg[0]))
+                );
+            }
+        }
+        unlink(fn.c_str());
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, structured_fields_test)
+{
+    // keep the records in the layout of the base sink at a fixed time.
+    class layout_sink
+        : public md::log::sinks::logger_sink_t
+    {
+    public:
+        layout_sink()
+            : md::log::sinks::logger_sink_t(md::log::log_level::trace),
+            time(std::chrono::seconds(1500000000))
+        {
+        }
+        
+        void log(
+            md::string_view log_path,
+            md::log::log_level lvl, md::string_view msg) const
+        {
+            log_fields(log_path, lvl, msg, md::log::fields_t());
+        }
+        
+        void log_fields(
+            md::string_view log_path, md::log::log_level lvl,
+            md::string_view msg, const md::log::fields_t& fields) const
+        {
+            fmt::memory_buffer buf;
+            format_fields(buf, time, log_path, lvl, msg, fields);
+            records.emplace_back(buf.data(), buf.size());
+        }
+        
+        md::log::log_clock::time_point time;
+        mutable std::vector<std::string> records;
+    };
+    
+    try{
+        using md::log::kv;
+        auto snk = std::make_shared<layout_sink>();
+        md::log::logger_t log("/kv", snk);
+        std::string ts = md::log::_internal::get_timestamp(snk->time);
+        std::string user = "bob smith";
+        
+        log.info("done", kv("user", user), kv("id", 42), kv("ok", true));
+        snk->set_layout(md::log::sinks::record_layout::logfmt);
+        log.warn("a \"quoted\" msg", kv("empty", ""), kv("eq", "a=b"),
+            kv("ms", 1.5), kv("n", -3), kv("c", 'x')
+        );
+        snk->set_layout(md::log::sinks::record_layout::json);
+        log.error("line\nbreak", kv("s", "tab\there \\ \x01"),
+            kv("u", 7U), kv("nan", std::nan("")),
+            kv("other", fmt::string_view("v"))
+        );
+        // the format strings are still formatted.
+        log.info("{} + {}", 1, 2);
+        MD_LOG_INFO(&log, "macro", kv("k", "v"));
+        
+        ASSERT_THAT(snk->records, testing::ElementsAre(
+            "[" + ts + "] [INFO:/kv] done user=\"bob smith\" id=42 ok=true\n",
+            "time=\"" + ts + "\" level=WARNING path=/kv"
+                " msg=\"a \\\"quoted\\\" msg\" empty=\"\" eq=\"a=b\""
+                " ms=1.5 n=-3 c=x\n",
+            "{\"time\":\"" + ts + "\",\"level\":\"ERROR\",\"path\":\"/kv\","
+                "\"msg\":\"line\\nbreak\",\"s\":\"tab\\there \\\\ \\u0001\","
+                "\"u\":7,\"nan\":null,\"other\":\"v\"}\n",
+            "{\"time\":\"" + ts + "\",\"level\":\"INFO\",\"path\":\"/kv\","
+                "\"msg\":\"1 + 2\"}\n",
+            "{\"time\":\"" + ts + "\",\"level\":\"INFO\",\"path\":\"/kv\","
+                "\"msg\":\"macro\",\"k\":\"v\"}\n"
+        ));
+        
+        // the escapes in and around the 8 bytes blocks.
+        for(size_t sz = 0; sz < 40; ++sz){
+            for(size_t at = 0; at < sz; ++at){
+                std::string in(sz, 'a');
+                in[at] = at % 2 ? '"' : '\n';
+                std::string expected;
+                for(char c : in)
+                    expected += c == '"' ? "\\\"" : c == '\n' ? "\\n" : "a";
+                
+                fmt::memory_buffer buf;
+                md::log::_internal::escape_json(buf, in);
+                ASSERT_THAT(
+                    std::string(buf.data(), buf.size()), testing::Eq(expected)
+                );
+                ASSERT_TRUE(md::log::_internal::logfmt_quoted(in));
+            }
+            if(sz > 0){
+                ASSERT_FALSE(
+                    md::log::_internal::logfmt_quoted(std::string(sz, 'a'))
+                );
+            }
+        }
+        
+        // a sink without fields support gets them in the message.
+        auto msnk = std::make_shared<memory_sink>();
+        md::log::logger_t mlog("/mem", msnk);
+        mlog.info("plain", kv("k", 1));
+        ASSERT_THAT(msnk->records, testing::ElementsAre("/mem:plain k=1"));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, console_sink_test)
+{
+    try{
+        // stderr is a pipe read by the test.
+        int fds[2];
+        ASSERT_THAT(pipe(fds), testing::Eq(0));
+        int err_fd = dup(STDERR_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        auto read_all = [&fds](){
+            std::string out;
+            char buf[4096];
+            int flags = fcntl(fds[0], F_GETFL);
+            fcntl(fds[0], F_SETFL, flags | O_NONBLOCK);
+            ssize_t sz;
+            while((sz = read(fds[0], buf, sizeof(buf))) > 0)
+                out.append(buf, sz);
+            fcntl(fds[0], F_SETFL, flags);
+            return out;
+        };
+        auto count = [](const std::string& out, const std::string& s){
+            size_t n = 0;
+            for(size_t p = out.find(s); p != std::string::npos;
+                p = out.find(s, p +1)
+            )
+                ++n;
+            return n;
+        };
+        
+        std::string msg(1000, 'x');
+        {
+            // a full pipe doesn't block the writers.
+            auto snk = std::make_shared<md::log::sinks::console_sink>(
+                false, 16 * 1024, md::log::overflow_policy::count
+            );
+            md::log::logger_t log("/console", snk);
+            for(int i = 0; i < 200; ++i)
+                log.info("{} {}", i, msg);
+            ASSERT_THAT(snk->dropped(), testing::Gt(0U));
+            ASSERT_THAT(snk->pending(), testing::Le(16U * 1024U));
+            ASSERT_THAT(snk->pending(), testing::Gt(0U));
+            
+            std::string out;
+            while(snk->pending() > 0){
+                out += read_all();
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            out += read_all();
+            
+            // the records are whole and in order.
+            size_t written = count(out, msg);
+            ASSERT_THAT(written + snk->dropped(), testing::Eq(200U));
+            ASSERT_THAT(count(out, "[INFO:/console]"), testing::Eq(written));
+            ASSERT_THAT(
+                out.find("0 " + msg), testing::Lt(out.find("1 " + msg))
+            );
+            ASSERT_THAT(count(out, fmt::format(
+                "{} log records were dropped", snk->dropped()
+            )), testing::Eq(1U));
+        }
+        
+        {
+            // the writers wait for the queue, nothing is lost.
+            auto snk = std::make_shared<md::log::sinks::console_sink>(
+                false, 16 * 1024, md::log::overflow_policy::block
+            );
+            md::log::logger_t log("/console", snk);
+            std::string out;
+            std::atomic<bool> done(false);
+            std::thread reader([&](){
+                while(!done){
+                    out += read_all();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+            for(int i = 0; i < 200; ++i)
+                log.info("{} {}", i, msg);
+            snk->flush();
+            done = true;
+            reader.join();
+            out += read_all();
+            
+            ASSERT_THAT(snk->dropped(), testing::Eq(0U));
+            ASSERT_THAT(count(out, msg), testing::Eq(200U));
+        }
+        
+        dup2(err_fd, STDERR_FILENO);
+        close(err_fd);
+        close(fds[0]);
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(logging_test, stats_test)
+{
+    try{
+        using md::log::log_level;
+        auto msnk = std::make_shared<memory_sink>();
+        msnk->set_timing(true);
+        auto log = std::make_shared<md::log::logger_t>(
+            "/stats", msnk, log_level::trace
+        );
+        auto child = log->add_child("child");
+        for(int i = 0; i < 3; ++i)
+            log->info("info {}", i);
+        log->warn("warn");
+        child->debug("debug");
+        child->defer(log_level::error, "deferred {}", 1);
+        // filtered by the logger, not counted.
+        log->set_level(log_level::info);
+        log->trace("trace");
+        
+        auto snap = log->snapshot();
+        ASSERT_THAT(snap.size(), testing::Eq(2U));
+        ASSERT_THAT(snap[0].path, testing::Eq("/stats"));
+        ASSERT_THAT(snap[0].records[(size_t)log_level::info], testing::Eq(3U));
+        ASSERT_THAT(
+            snap[0].records[(size_t)log_level::warning], testing::Eq(1U)
+        );
+        ASSERT_THAT(snap[0].records[(size_t)log_level::trace], testing::Eq(0U));
+        ASSERT_THAT(snap[1].path, testing::Eq("/stats/child"));
+        ASSERT_THAT(snap[1].records[(size_t)log_level::debug], testing::Eq(1U));
+        ASSERT_THAT(snap[1].records[(size_t)log_level::error], testing::Eq(1U));
+        ASSERT_THAT(snap[1].sinks.size(), testing::Eq(0U));
+        
+        ASSERT_THAT(snap[0].sinks.size(), testing::Eq(1U));
+        auto& st = snap[0].sinks[0];
+        ASSERT_THAT(st.records, testing::Eq(6U));
+        uint64_t calls = 0;
+        for(auto n : st.latency)
+            calls += n;
+        ASSERT_THAT(calls, testing::Eq(6U));
+        ASSERT_THAT(st.percentile(0.5).count(), testing::Gt(0));
+        ASSERT_THAT(st.percentile(0.5), testing::Le(st.percentile(1)));
+        
+        msnk->reset_stats();
+        ASSERT_THAT(msnk->stats().records, testing::Eq(0U));
+        
+        // without timing the records are still counted.
+        msnk->set_timing(false);
+        log->info("untimed");
+        ASSERT_THAT(msnk->stats().records, testing::Eq(1U));
+        ASSERT_THAT(msnk->stats().percentile(1).count(), testing::Eq(0));
+        
+        // the bytes written by a file sink, the batches of an async sink.
+        char dir_tpl[] = "/tmp/md_stats_XXXXXX";
+        std::string dir = mkdtemp(dir_tpl);
+        std::string fn = dir + "/test.log";
+        {
+            auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+                nullptr, fn, 1024 * 1024, 3
+            );
+            auto asnk = std::make_shared<md::log::sinks::async_sink>(fsnk);
+            md::log::logger_t alog("/async", asnk);
+            for(int i = 0; i < 100; ++i)
+                alog.info("record {}", i);
+            alog.flush();
+            
+            auto ast = asnk->stats();
+            auto fst = fsnk->stats();
+            ASSERT_THAT(ast.records, testing::Eq(100U));
+            ASSERT_THAT(fst.records, testing::Eq(100U));
+            ASSERT_THAT(fst.bytes, testing::Eq(fsnk->size()));
+            ASSERT_THAT(fst.errors, testing::Eq(0U));
+        }
+        md::files::wait_async_jobs();
+        unlink(fn.c_str());
+        rmdir(dir.c_str());
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+}} //namespace md::tests
@@ -0,0 +1,181 @@
+/*
+MIT License
+
+Copyright (c) 2011-2019 Michel Dénommée
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gmock/gmock.h>
+#include "md_test_base.h"
+
+#include <fstream>
+#include <new>
+
+// this file is built in its own test binary, the replaced allocation
+// functions count the allocations of the current thread while a
+// counter is set and don't change the allocations of the other tests.
+static thread_local size_t* md_alloc_counter = nullptr;
+
+static void* md_counted_alloc(size_t sz)
+{
+    if(md_alloc_counter)
+        ++*md_alloc_counter;
+    if(void* p = malloc(sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t sz) { return md_counted_alloc(sz);}
+void* operator new[](size_t sz) { return md_counted_alloc(sz);}
+void operator delete(void* p) noexcept { free(p);}
+void operator delete[](void* p) noexcept { free(p);}
+void operator delete(void* p, size_t) noexcept { free(p);}
+void operator delete[](void* p, size_t) noexcept { free(p);}
+
+namespace md{ namespace tests{
+
+class no_alloc_test
+    : public md_test_base
+{
+public:
+    void SetUp() override
+    {
+        md_test_base::SetUp();
+        
+    }
+    
+    void TearDown() override
+    {
+        md_alloc_counter = nullptr;
+        md_test_base::TearDown();
+        
+    }
+};
+
+TEST_F(no_alloc_test, logger_no_alloc_test)
+{
+    try{
+        std::string fn = fmt::format("/tmp/md_no_alloc_{}.log", getpid());
+        event_base* ev_base = event_base_new();
+        {
+            auto fsnk = std::make_shared<md::log::sinks::rotating_file_sink>(
+                ev_base, fn, 1024 * 1024, 2
+            );
+            auto log = std::make_shared<md::log::logger_t>("/noalloc", fsnk);
+            auto child = log->add_child("child");
+            std::string name = "disk";
+            
+            // the first records size the thread buffers.
+            for(int i = 0; i < 10; ++i)
+                child->info("{} {} {:.2f}", name, i, 0.5);
+            
+            size_t allocs = 0;
+            md_alloc_counter = &allocs;
+            for(int i = 0; i < 100; ++i){
+                child->info("{} {} {:.2f}", name, i, 0.5);
+                child->warn("no args");
+            }
+            md_alloc_counter = nullptr;
+            ASSERT_THAT(allocs, testing::Eq(0U));
+        }
+        event_base_free(ev_base);
+        
+        std::ifstream in(fn);
+        std::string line;
+        size_t count = 0;
+        while(std::getline(in, line)){
+            ASSERT_THAT(line, testing::MatchesRegex(
+                "\\[.*\\] \\[(INFO|WARNING):/noalloc/child\\] .*"
+            ));
+            ++count;
+        }
+        unlink(fn.c_str());
+        ASSERT_THAT(count, testing::Eq(210U));
+        
+    }catch(const std::exception& err){
+        md_alloc_counter = nullptr;
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(no_alloc_test, static_series_no_alloc_test)
+{
+    try{
+        auto eq = md::event_queue_t::get_default();
+        auto step = [](md::callback::async_cb scb) -> void {
+            scb(nullptr);
+        };
+        auto wstep = [](int& val, md::callback::value_cb<int> wcb) -> void {
+            wcb(nullptr, val +1);
+        };
+        
+        // the allocations of a pipeline don't depend on its length.
+        int ended = 0;
+        auto series_allocs = [&](auto steps) -> size_t {
+            size_t allocs = 0;
+            md_alloc_counter = &allocs;
+            md::async::series(eq, std::move(steps),
+            [&ended](const md::callback::cb_error& err) -> void {
+                if(!err)
+                    ++ended;
+            });
+            eq->run();
+            md_alloc_counter = nullptr;
+            return allocs;
+        };
+        auto waterfall_allocs = [&](auto steps) -> size_t {
+            size_t allocs = 0;
+            md_alloc_counter = &allocs;
+            md::async::waterfall<int>(eq, std::move(steps),
+            [&ended](const md::callback::cb_error& err, int) -> void {
+                if(!err)
+                    ++ended;
+            });
+            eq->run();
+            md_alloc_counter = nullptr;
+            return allocs;
+        };
+        
+        // the first runs size the queue and the slot pool.
+        series_allocs(std::make_tuple(step));
+        waterfall_allocs(std::make_tuple(wstep));
+        
+        size_t one = series_allocs(std::make_tuple(step));
+        size_t eight = series_allocs(std::make_tuple(
+            step, step, step, step, step, step, step, step
+        ));
+        ASSERT_THAT(eight, testing::Eq(one));
+        
+        one = waterfall_allocs(std::make_tuple(wstep));
+        eight = waterfall_allocs(std::make_tuple(
+            wstep, wstep, wstep, wstep, wstep, wstep, wstep, wstep
+        ));
+        ASSERT_THAT(eight, testing::Eq(one));
+        ASSERT_THAT(ended, testing::Eq(6));
+        
+    }catch(const std::exception& err){
+        md_alloc_counter = nullptr;
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+}} //namespace md::tests
@@ -209,6 +209,693 @@ TEST_F(queue_test, queue_async_series_test)
 
 
 
+TEST_F(queue_test, queue_async_static_series_test)
+{
+    try{
+        auto eq = md::event_queue_t::get_default();
+        int value = 0;
+        bool done = false;
+        
+        md::async::series(eq, std::make_tuple(
+            [&value](md::callback::async_cb scb)->void{
+                value += 1;
+                scb(nullptr);
+            },
+            [&value, eq](md::callback::async_cb scb)->void{
+                eq->push_back([&value, scb]()->void{
+                    value += 10;
+                    scb(nullptr);
+                });
+            },
+            [&value](md::callback::async_cb scb)->void{
+                value += 100;
+                scb(nullptr);
+            }
+        ), [&](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            done = true;
+        });
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(true));
+        ASSERT_THAT(value, testing::Eq(111));
+        
+        md::async::series(eq, std::make_tuple(
+            [](md::callback::async_cb scb)->void{
+                scb(MD_ERR("series error"));
+            },
+            [&value](md::callback::async_cb scb)->void{
+                value = 0;
+                scb(nullptr);
+            }
+        ), [&](const md::callback::cb_error& err)->void{
+            ASSERT_THAT((bool)err, testing::Eq(true));
+            done = false;
+        });
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(false));
+        ASSERT_THAT(value, testing::Eq(111));
+        
+        md::async::waterfall<int>(eq, std::make_tuple(
+            [](int& val, md::callback::value_cb<int> wcb)->void{
+                wcb(nullptr, val + 2);
+            },
+            [eq](int& val, md::callback::value_cb<int> wcb)->void{
+                eq->push_back(std::bind(wcb, nullptr, val * 10));
+            }
+        ), [&value](const md::callback::cb_error& err, int val)->void{
+            if(err)
+                FAIL();
+            value = val;
+        });
+        
+        eq->run();
+        ASSERT_THAT(value, testing::Eq(20));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+
+TEST_F(queue_test, queue_async_double_callback_test)
+{
+    #ifdef MD_ASYNC_CHECKED
+    try{
+        auto eq = md::event_queue_t::get_default();
+        int value = 0;
+        int end_count = 0;
+        
+        md::async::series(eq, {
+            [&value](md::callback::async_cb scb)->void{
+                value += 1;
+                scb(nullptr);
+                scb(nullptr);
+            },
+            [&value](md::callback::async_cb scb)->void{
+                value += 10;
+                scb(nullptr);
+            }
+        }, [&](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            ++end_count;
+        });
+        
+        eq->run();
+        ASSERT_THAT(value, testing::Eq(11));
+        ASSERT_THAT(end_count, testing::Eq(1));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+    #endif
+}
+
+
+TEST_F(queue_test, queue_async_late_callback_test)
+{
+    #ifdef MD_ASYNC_CHECKED
+    try{
+        auto eq = md::event_queue_t::get_default();
+        auto fatal_count = []() -> uint64_t {
+            return md::log::default_logger()->snapshot()[0].records[
+                (size_t)md::log::log_level::fatal
+            ];
+        };
+        int end_count = 0;
+        md::callback::async_cb scb_saved;
+        md::callback::value_cb<int> wcb_saved;
+        
+        md::async::series(eq, std::make_tuple(
+            [&scb_saved](md::callback::async_cb scb)->void{
+                scb_saved = scb;
+                scb(nullptr);
+            }
+        ), [&](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            ++end_count;
+        });
+        
+        md::async::waterfall<int>(eq, std::make_tuple(
+            [&wcb_saved](int& val, md::callback::value_cb<int> wcb)->void{
+                wcb_saved = wcb;
+                wcb(nullptr, val + 1);
+            }
+        ), [&](const md::callback::cb_error& err, int val)->void{
+            if(err)
+                FAIL();
+            ASSERT_THAT(val, testing::Eq(1));
+            ++end_count;
+        });
+        
+        int value = 0;
+        md::callback::async_cb lcb_saved;
+        md::async::loop(eq, [&value]()->bool{
+            return value < 3;
+        }, [&](md::callback::async_cb lcb)->void{
+            ++value;
+            lcb_saved = lcb;
+            lcb(nullptr);
+        }, [&](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            ++end_count;
+        });
+        
+        eq->run();
+        ASSERT_THAT(end_count, testing::Eq(3));
+        ASSERT_THAT(value, testing::Eq(3));
+        
+        // the pipelines ended, their state is gone.
+        auto before = fatal_count();
+        scb_saved(nullptr);
+        scb_saved(nullptr);
+        wcb_saved(nullptr, 10);
+        wcb_saved(nullptr, 10);
+        lcb_saved(nullptr);
+        lcb_saved(nullptr);
+        eq->run();
+        ASSERT_THAT(end_count, testing::Eq(3));
+        ASSERT_THAT(value, testing::Eq(3));
+        ASSERT_THAT(fatal_count() - before, testing::Eq(6U));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+    #endif
+}
+
+
+TEST_F(queue_test, queue_async_loop_test)
+{
+    try{
+        auto eq = md::event_queue_t::get_default();
+        int value = 0;
+        bool done = false;
+        
+        md::async::loop(eq, [&value]()->bool{
+            return value < 1000;
+        }, [&value](md::callback::async_cb lcb)->void{
+            ++value;
+            lcb(nullptr);
+        }, [&done](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            done = true;
+        }, 64);
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(true));
+        ASSERT_THAT(value, testing::Eq(1000));
+        
+        value = 0;
+        md::async::loop(eq, [&value, eq](md::callback::async_cb lcb)->void{
+            eq->push_back([&value, lcb]()->void{
+                ++value;
+                lcb(nullptr);
+            });
+        }, [&value]()->bool{
+            return value < 10;
+        }, [&done](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            done = false;
+        });
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(false));
+        ASSERT_THAT(value, testing::Eq(10));
+        
+        value = 0;
+        md::async::loop(eq, nullptr, [&value](md::callback::async_cb lcb)->void{
+            if(++value == 5)
+                return lcb(MD_ERR("loop error"));
+            lcb(nullptr);
+        }, [&done](const md::callback::cb_error& err)->void{
+            ASSERT_THAT((bool)err, testing::Eq(true));
+            done = true;
+        });
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(true));
+        ASSERT_THAT(value, testing::Eq(5));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+
+TEST_F(queue_test, queue_async_each_limit_test)
+{
+    try{
+        auto eq = md::event_queue_t::get_default();
+        std::vector<int> v{1,2,3,4,5,6,7,8,9,10};
+        int value = 0;
+        size_t running = 0;
+        size_t max_running = 0;
+        bool done = false;
+        
+        md::async::each_limit(eq, v.begin(), v.end(), 3,
+        [&, eq](const int& val, md::callback::async_cb ecb)->void{
+            max_running = std::max(max_running, ++running);
+            eq->push_back([&, ecb, val]()->void{
+                --running;
+                value += val;
+                ecb(nullptr);
+            });
+        }, [&](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            done = true;
+        });
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(true));
+        ASSERT_THAT(value, testing::Eq(55));
+        ASSERT_THAT(max_running, testing::Eq(3U));
+        
+        int called = 0;
+        md::async::each_limit(eq, v.begin(), v.end(), 2,
+        [&](const int& val, md::callback::async_cb ecb)->void{
+            ++called;
+            if(val == 2)
+                return ecb(MD_ERR("each_limit error"));
+            ecb(nullptr);
+        }, [&](const md::callback::cb_error& err)->void{
+            ASSERT_THAT((bool)err, testing::Eq(true));
+            done = false;
+        });
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(false));
+        ASSERT_THAT(called, testing::Lt(10));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+TEST_F(queue_test, queue_async_map_limit_test)
+{
+    try{
+        auto eq = md::event_queue_t::get_default();
+        std::vector<int> v{5,4,3,2,1};
+        std::vector<int> res;
+        
+        md::async::map_limit<int>(eq, v.begin(), v.end(), 4,
+        [eq](const int& val, md::callback::value_cb<int> ecb)->void{
+            eq->push_back(std::bind(ecb, nullptr, val * 2));
+        }, [&](const md::callback::cb_error& err, std::vector<int> r)->void{
+            if(err)
+                FAIL();
+            res = r;
+        });
+        
+        eq->run();
+        ASSERT_THAT(res, testing::ElementsAre(10,8,6,4,2));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+
+TEST_F(queue_test, queue_async_parallel_race_retry_test)
+{
+    try{
+        auto eq = md::event_queue_t::get_default();
+        std::vector<int> res;
+        
+        md::async::parallel<int>(eq, {
+            [eq](md::callback::value_cb<int> tcb)->void{
+                eq->push_back(std::bind(tcb, nullptr, 1));
+            },
+            [](md::callback::value_cb<int> tcb)->void{
+                tcb(nullptr, 2);
+            },
+            [eq](md::callback::value_cb<int> tcb)->void{
+                eq->push_back(std::bind(tcb, nullptr, 3));
+            }
+        }, [&res](const md::callback::cb_error& err, std::vector<int> r){
+            if(err)
+                FAIL();
+            res = r;
+        });
+        
+        eq->run();
+        ASSERT_THAT(res, testing::ElementsAre(1,2,3));
+        
+        int winner = 0;
+        int end_count = 0;
+        md::async::race<int>(eq, {
+            [eq](md::callback::value_cb<int> tcb)->void{
+                eq->push_back([eq, tcb]()->void{
+                    eq->push_back(std::bind(tcb, nullptr, 1));
+                });
+            },
+            [](md::callback::value_cb<int> tcb)->void{
+                tcb(nullptr, 2);
+            },
+            [](md::callback::value_cb<int> tcb)->void{
+                tcb(nullptr, 3);
+            }
+        }, [&](const md::callback::cb_error& err, int val){
+            if(err)
+                FAIL();
+            winner = val;
+            ++end_count;
+        });
+        
+        eq->run();
+        ASSERT_THAT(winner, testing::Eq(2));
+        ASSERT_THAT(end_count, testing::Eq(1));
+        
+        int attempts = 0;
+        bool done = false;
+        md::async::retry(eq, 3, 0,
+        [&attempts](md::callback::async_cb cb)->void{
+            if(++attempts < 3)
+                return cb(MD_ERR("retry error"));
+            cb(nullptr);
+        }, [&done](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            done = true;
+        });
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(true));
+        ASSERT_THAT(attempts, testing::Eq(3));
+        
+        attempts = 0;
+        md::async::retry(eq, 2, 0,
+        [&attempts](md::callback::async_cb cb)->void{
+            ++attempts;
+            cb(MD_ERR("retry error"));
+        }, [&done](const md::callback::cb_error& err)->void{
+            ASSERT_THAT((bool)err, testing::Eq(true));
+            done = false;
+        });
+        
+        eq->run();
+        ASSERT_THAT(done, testing::Eq(false));
+        ASSERT_THAT(attempts, testing::Eq(2));
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+
+TEST_F(queue_test, queue_async_cancel_test)
+{
+    try{
+        auto eq = md::event_queue_t::get_default();
+        auto ct = std::make_shared<md::cancel_token_t>();
+
+        int steps = 0;
+        bool cancelled = false;
+        md::async::series(eq, {
+            [&steps](md::callback::async_cb scb) -> void {
+                ++steps;
+                scb(nullptr);
+            },
+            [&steps, ct](md::callback::async_cb scb) -> void {
+                ++steps;
+                ct->cancel();
+                scb(nullptr);
+            },
+            [&steps](md::callback::async_cb scb) -> void {
+                ++steps;
+                scb(nullptr);
+            },
+        }, [&cancelled](const md::callback::cb_error& err) -> void {
+            cancelled = err.is_cancelled();
+        }, ct);
+
+        eq->run();
+        ASSERT_THAT(steps, testing::Eq(2));
+        ASSERT_THAT(cancelled, testing::Eq(true));
+
+        ct = std::make_shared<md::cancel_token_t>();
+        std::vector<int> v{1,2,3,4,5,6,7,8};
+        size_t seen = 0;
+        int end_count = 0;
+        md::async::each_limit(eq, v.begin(), v.end(), 2,
+        [&seen, eq](const int&, md::callback::async_cb icb) -> void {
+            ++seen;
+            eq->push_back(std::bind(icb, nullptr));
+        }, [&](const md::callback::cb_error& err) -> void {
+            ASSERT_THAT(err.is_cancelled(), testing::Eq(true));
+            ++end_count;
+        }, ct);
+        eq->push_back([ct]() -> void { ct->cancel();});
+
+        eq->run();
+        ASSERT_THAT(seen, testing::Lt(v.size()));
+        ASSERT_THAT(end_count, testing::Eq(1));
+
+        // tasks bound to a token are skipped and removed in bulk.
+        ct = std::make_shared<md::cancel_token_t>();
+        int ran = 0;
+        for(int i = 0; i < 10; ++i)
+            eq->push_back([&ran]() -> void { ++ran;}, ct);
+        ASSERT_THAT(eq->cancel_tasks(ct), testing::Eq(10U));
+        eq->push_back([&ran]() -> void { ++ran;}, ct);
+        ct->cancel();
+        eq->run();
+        ASSERT_THAT(ran, testing::Eq(0));
+
+        end_count = 0;
+        md::async::loop(eq, []() -> bool { return true;},
+        [](md::callback::async_cb lcb) -> void {
+            lcb(nullptr);
+        }, [&end_count](const md::callback::cb_error& err) -> void {
+            ASSERT_THAT(err.is_cancelled(), testing::Eq(true));
+            ++end_count;
+        }, 1, ct);
+        eq->run();
+        ASSERT_THAT(end_count, testing::Eq(1));
+
+        // a token already cancelled ends the race and the retry right away.
+        end_count = 0;
+        md::async::race<int>(eq, {
+            [](md::callback::value_cb<int> cb) -> void { cb(nullptr, 1);}
+        }, [&end_count](const md::callback::cb_error& err, int) -> void {
+            ASSERT_THAT(err.is_cancelled(), testing::Eq(true));
+            ++end_count;
+        }, ct);
+        md::async::retry(eq, 3, 1,
+        [](md::callback::async_cb rcb) -> void {
+            rcb(nullptr);
+        }, [&end_count](const md::callback::cb_error& err) -> void {
+            ASSERT_THAT(err.is_cancelled(), testing::Eq(true));
+            ++end_count;
+        }, ct);
+        eq->run();
+        ASSERT_THAT(end_count, testing::Eq(2));
+
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+
+TEST_F(queue_test, queue_channel_test)
+{
+    try{
+        auto eq = md::event_queue_t::get_default();
+        auto ch = std::make_shared<md::channel_t<int>>(2);
+        int v = 0;
+
+        ASSERT_THAT(ch->try_push(1), testing::Eq(true));
+        ASSERT_THAT(ch->try_push(2), testing::Eq(true));
+        ASSERT_THAT(ch->try_push(3), testing::Eq(false));
+
+        // the producer is suspended until a slot is freed.
+        bool pushed = false;
+        ch->push(eq, 3, [&pushed](const md::callback::cb_error& err){
+            if(err)
+                FAIL();
+            pushed = true;
+        });
+        eq->run();
+        ASSERT_THAT(pushed, testing::Eq(false));
+        ASSERT_THAT(ch->try_pop(v), testing::Eq(true));
+        ASSERT_THAT(v, testing::Eq(1));
+        eq->run();
+        ASSERT_THAT(pushed, testing::Eq(true));
+
+        std::vector<int> res;
+        ch->close();
+        for(int i = 0; i < 3; ++i)
+            ch->pop(eq, [&res](const md::callback::cb_error& err, int val){
+                if(!err)
+                    res.emplace_back(val);
+            });
+        eq->run();
+        ASSERT_THAT(res, testing::ElementsAre(2, 3));
+
+        std::vector<std::string> out;
+        bool ended = false;
+        auto p = md::make_pipeline<int>(2)
+        .then<int>(eq, [](int val, md::callback::value_cb<int> cb){
+            cb(nullptr, val * 2);
+        })
+        .then<std::string>(eq, [](int val, md::callback::value_cb<std::string> cb){
+            cb(nullptr, std::to_string(val));
+        })
+        .sink(eq, [&out](std::string s, md::callback::async_cb cb){
+            out.emplace_back(std::move(s));
+            cb(nullptr);
+        }, [&ended](const md::callback::cb_error& err){
+            if(err)
+                FAIL();
+            ended = true;
+        });
+
+        int i = 0;
+        md::async::loop(eq, [&i]()->bool{ return i < 10;},
+        [&](md::callback::async_cb lcb){
+            p.push(eq, i++, lcb);
+        }, [&p](const md::callback::cb_error& err){
+            if(err)
+                FAIL();
+            p.close();
+        });
+        eq->run();
+
+        ASSERT_THAT(ended, testing::Eq(true));
+        ASSERT_THAT(out.size(), testing::Eq(10U));
+        ASSERT_THAT(out[9], testing::Eq("18"));
+
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+
+TEST_F(queue_test, queue_virtual_time_test)
+{
+    try{
+        auto vq = std::make_shared<md::virtual_event_queue_t>();
+        std::vector<uint64_t> fired;
+
+        vq->push_back_delayed(50, [&]()->void{ fired.emplace_back(vq->now());});
+        vq->push_back_delayed(10, [&]()->void{ fired.emplace_back(vq->now());});
+        vq->push_back_delayed(10, [&]()->void{
+            vq->push_back_delayed(5, [&]()->void{
+                fired.emplace_back(vq->now());
+            });
+        });
+
+        vq->advance(20);
+        ASSERT_THAT(vq->now(), testing::Eq(20U));
+        ASSERT_THAT(fired, testing::ElementsAre(10, 15));
+        ASSERT_THAT(vq->timer_count(), testing::Eq(1U));
+
+        vq->run_until_idle();
+        ASSERT_THAT(vq->now(), testing::Eq(50U));
+        ASSERT_THAT(fired, testing::ElementsAre(10, 15, 50));
+
+        // the retry backoff doubles after every failure.
+        std::vector<uint64_t> attempts;
+        bool done = false;
+        md::async::retry(vq, 4, 100,
+        [&](md::callback::async_cb cb)->void{
+            attempts.emplace_back(vq->now());
+            cb(MD_ERR("retry error"));
+        }, [&done](const md::callback::cb_error& err)->void{
+            ASSERT_THAT((bool)err, testing::Eq(true));
+            done = true;
+        });
+
+        vq->run_until_idle();
+        ASSERT_THAT(done, testing::Eq(true));
+        ASSERT_THAT(attempts, testing::ElementsAre(50, 150, 350, 750));
+
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+}
+
+
+TEST_F(queue_test, queue_async_parallel_for_test)
+{
+    #ifdef MD_THREAD_SAFE
+    try{
+        auto eq = md::event_queue_t::get_default();
+        auto pool = std::make_shared<md::event_queue_pool_t>(4);
+        
+        std::vector<uint64_t> v(100000);
+        bool done = false;
+        md::async::parallel_for(eq, pool, 0, v.size(),
+        [&v](size_t i){
+            v[i] = i;
+        }, [&done](const md::callback::cb_error& err)->void{
+            if(err)
+                FAIL();
+            done = true;
+        });
+        while(!done)
+            eq->run_n(eq->local_size());
+        
+        uint64_t sum = 0;
+        done = false;
+        md::async::parallel_reduce<uint64_t>(eq, pool, 0, v.size(), 0,
+        [&v](uint64_t& acc, size_t i){
+            acc += v[i];
+        }, [](uint64_t a, uint64_t b){
+            return a + b;
+        }, [&](const md::callback::cb_error& err, uint64_t r)->void{
+            if(err)
+                FAIL();
+            sum = r;
+            done = true;
+        }, 64);
+        while(!done)
+            eq->run_n(eq->local_size());
+        ASSERT_THAT(sum, testing::Eq(v.size() * (v.size() -1) / 2));
+        
+        done = false;
+        md::async::parallel_for(eq, pool, 0, v.size(),
+        [](size_t i){
+            if(i == 500)
+                throw MD_ERR("parallel_for error");
+        }, [&done](const md::callback::cb_error& err)->void{
+            ASSERT_THAT((bool)err, testing::Eq(true));
+            done = true;
+        });
+        while(!done)
+            eq->run_n(eq->local_size());
+        
+    }catch(const std::exception& err){
+        std::cout << "Error: " << err.what() << std::endl;
+        FAIL();
+    }
+    #else
+        std::cerr << "parallel_for test require the library to be build with "
+            << "MD_THREAD_SAFE flag enabled"
+            << std::endl;
+    #endif
+}
+
+
 TEST_F(queue_test, queue_async_multithread_test)
 {
     #ifdef MD_THREAD_SAFE